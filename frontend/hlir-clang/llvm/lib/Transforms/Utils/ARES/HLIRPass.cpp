@@ -101,6 +101,12 @@ using namespace std;
 using namespace llvm;
 using namespace ares;
 
+// keep the HLIR as metadata for a later tool to lower
+static cl::opt<bool>
+DeferLowering("hlir-defer-lowering",
+              cl::desc("Write HLIR as metadata instead of lowering it"),
+              cl::init(false));
+
 namespace{
 
 typedef vector<Type*> TypeVec;
@@ -120,9 +126,22 @@ public:
   }
 
   bool runOnModule(Module& M) override{
-    HLIRModule* module = HLIRModule::getModule(&M);
+    if(DeferLowering){
+      HLIRModule::getModule(&M)->writeMetadata();
+      HLIRModule::release(&M);
+      return true;
+    }
+
+    // HLIR written by an earlier compile
+    HLIRModule* module = HLIRModule::readMetadata(&M);
+    if(!module){
+      module = HLIRModule::getModule(&M);
+    }
+
     if(module){
-      return module->lowerToIR_();
+      bool changed = module->lowerToIR_();
+      HLIRModule::release(&M);
+      return changed;
     }
     
     return false;
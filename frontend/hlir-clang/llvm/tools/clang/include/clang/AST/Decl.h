@@ -1564,6 +1564,7 @@ private:
 
   // +=== ares
   bool IsTask : 1;
+  unsigned TaskPriority;
   // =========
 
   bool IsInline : 1;
@@ -1668,6 +1669,7 @@ protected:
       SClass(S),
       // +=== ares
       IsTask(false),
+      TaskPriority(0),
       // =========
       IsInline(isInlineSpecified), IsInlineSpecified(isInlineSpecified),
       IsVirtualAsWritten(false), IsPure(false), HasInheritedPrototype(false),
@@ -1812,6 +1814,14 @@ public:
   bool isTask() const{
     return IsTask;
   }
+
+  void setTaskPriority(unsigned priority){
+    TaskPriority = priority;
+  }
+
+  unsigned getTaskPriority() const{
+    return TaskPriority;
+  }
   // =========
 
   /// Whether this virtual function is pure, i.e. makes the containing class
@@ -354,6 +354,7 @@ private:
 
   // +===== ares
   unsigned FS_task_specified : 1;
+  unsigned FS_task_priority;
   // ===========
 
   // friend-specifier
@@ -436,6 +437,7 @@ public:
       FS_noreturn_specified(false),
       // +===== ares
       FS_task_specified(false),
+      FS_task_priority(0),
       // ===========
       Friend_specified(false),
       Constexpr_specified(false),
@@ -573,6 +575,10 @@ public:
   bool isTaskSpecified() const{
     return FS_task_specified;
   }
+
+  unsigned getTaskPriority() const{
+    return FS_task_priority;
+  }
   // ===========
 
   void ClearFunctionSpecs() {
@@ -690,6 +696,10 @@ public:
   // +===== ares
   bool setFunctionSpecTask(SourceLocation Loc, const char *&PrevSpec,
                            unsigned &DiagID);
+
+  void setFunctionSpecTaskPriority(unsigned Priority){
+    FS_task_priority = Priority;
+  }
   // ===========
 
   bool SetFriendSpec(SourceLocation Loc, const char *&PrevSpec,
@@ -3340,6 +3340,18 @@ public:
                                   BuildForRangeKind Kind);
   StmtResult FinishCXXForRangeStmt(Stmt *ForRange, Stmt *Body);
 
+  // +===== ares
+  /// The scheduling hint a priority applies to, in the order of the
+  /// err_ares_priority_out_of_range selector.
+  enum AresPriorityKind {
+    APK_Task,
+    APK_Forall,
+    APK_ReduceAll
+  };
+
+  bool CheckAresPriority(Expr *E, AresPriorityKind Kind, unsigned &Priority);
+  // ==========
+
   StmtResult ActOnGotoStmt(SourceLocation GotoLoc,
                            SourceLocation LabelLoc,
                            LabelDecl *TheDecl);
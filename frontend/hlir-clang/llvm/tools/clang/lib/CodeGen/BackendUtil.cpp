@@ -276,6 +276,12 @@ static void addSymbolRewriterPass(const CodeGenOptions &Opts,
 void EmitAssemblyHelper::CreatePasses() {
   // +=== ares
   CreateARESPasses();
+
+  // HLIR left as metadata by -hlir-defer-lowering refers to placeholder
+  // instructions the optimizer would delete, so the module is written out
+  // unoptimized for the tool that lowers it
+  if (TheModule->getNamedMetadata("hlir"))
+    return;
   // =========
   
   if (CodeGenOpts.DisableLLVMPasses)
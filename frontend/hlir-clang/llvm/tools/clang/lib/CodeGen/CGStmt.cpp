@@ -150,7 +150,8 @@ private:
 } // namespace
 
 // +===== ares ==============================
-void CodeGenFunction::EmitParallelFor(const CXXForRangeStmt& S){
+void CodeGenFunction::EmitParallelFor(const CXXForRangeStmt& S,
+                                      bool distributed){
   using namespace llvm;
   using namespace std;
   
@@ -228,7 +229,7 @@ void CodeGenFunction::EmitParallelFor(const CXXForRangeStmt& S){
     start = ConstantInt::get(Int32Ty, 0);
     end = EmitAnyExprToTemp(ce->getArg(0)).getScalarVal();
   }
-  else if(ce->getNumArgs() == 2){
+  else if(ce->getNumArgs() == 2 || ce->getNumArgs() == 3){
     start = EmitAnyExprToTemp(ce->getArg(0)).getScalarVal();
     end = EmitAnyExprToTemp(ce->getArg(1)).getScalarVal();
   }
@@ -236,6 +237,21 @@ void CodeGenFunction::EmitParallelFor(const CXXForRangeStmt& S){
     assert(false && "invalid forall range");
   }
 
+  if(distributed){
+    pfor->setDistributed(true);
+
+    if(ce->getNumArgs() == 3){
+      pfor->setPartitioner(EmitAnyExprToTemp(ce->getArg(2)).getScalarVal());
+    }
+  }
+  else if(ce->getNumArgs() == 3){
+    llvm::APSInt priority;
+    bool isConstant = ce->getArg(2)->EvaluateAsInt(priority, getContext());
+    assert(isConstant && "forall priority must be a constant");
+    (void)isConstant;
+    pfor->setPriority(priority.getZExtValue());
+  }
+
   pfor->setRange(start, end);
   pfor->insert(B);
 
@@ -267,7 +283,7 @@ void CodeGenFunction::EmitParallelReduce(const CXXForRangeStmt& S){
 
   auto ce = dyn_cast<CXXConstructExpr>(mt->GetTemporaryExpr());
   assert(ce);
-  assert(ce->getNumArgs() == 3);
+  assert(ce->getNumArgs() == 3 || ce->getNumArgs() == 4);
 
   
   HLIRModule* mod = HLIRModule::getModule(&CGM.getModule());
@@ -280,6 +296,14 @@ void CodeGenFunction::EmitParallelReduce(const CXXForRangeStmt& S){
 
   HLIRParallelReduce* r = mod->createParallelReduce(rt);
 
+  if(ce->getNumArgs() == 4){
+    llvm::APSInt priority;
+    bool isConstant = ce->getArg(3)->EvaluateAsInt(priority, getContext());
+    assert(isConstant && "reduce priority must be a constant");
+    (void)isConstant;
+    r->setPriority(priority.getZExtValue());
+  }
+
   auto dr = dyn_cast<DeclRefExpr>(ce->getArg(2));
   assert(dr);
 
@@ -1227,6 +1251,10 @@ CodeGenFunction::EmitCXXForRangeStmt(const CXXForRangeStmt &S,
           EmitParallelFor(S);
           return;
         }
+        else if(name == "class ares::DistributedForall"){
+          EmitParallelFor(S, true);
+          return;
+        }
         else if(name == "class ares::ReduceAll"){
           EmitParallelReduce(S);
           return;
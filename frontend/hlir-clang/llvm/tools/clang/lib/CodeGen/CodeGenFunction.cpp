@@ -703,6 +703,7 @@ void CodeGenFunction::StartFunction(GlobalDecl GD,
       HLIRModule* module = HLIRModule::getModule(&CGM.getModule());
 
       HLIRTask* task = module->createTask();
+      task->setPriority(FD->getTaskPriority());
       task->setFunction(Fn);
     }
     // =========
@@ -129,7 +129,7 @@ public:
     return getContext().getSourceManager().isInMainFile(S->getLocStart());
   }
   
-  void EmitParallelFor(const CXXForRangeStmt& S);
+  void EmitParallelFor(const CXXForRangeStmt& S, bool distributed=false);
   
   void EmitParallelReduce(const CXXForRangeStmt& S);
 
@@ -2487,6 +2487,61 @@ void Parser::ParseAlignmentSpecifier(ParsedAttributes &Attrs,
                AttributeList::AS_Keyword, EllipsisLoc);
 }
 
+// +===== ares
+
+/// ParseTaskSpecifier - Parse the task function specifier and its optional
+/// scheduling hints.
+///
+///       task-specifier:
+///         'task'
+///         'task' '(' 'priority' '=' constant-expression ')'
+void Parser::ParseTaskSpecifier(DeclSpec &DS) {
+  assert(Tok.is(tok::kw_task) && "Not a task specifier!");
+
+  const char *PrevSpec = nullptr;
+  unsigned DiagID;
+  SourceLocation Loc = ConsumeToken();
+  if (DS.setFunctionSpecTask(Loc, PrevSpec, DiagID))
+    Diag(Loc, DiagID) << PrevSpec;
+
+  if (Tok.isNot(tok::l_paren))
+    return;
+
+  BalancedDelimiterTracker T(*this, tok::l_paren);
+  T.consumeOpen();
+
+  if (Tok.isNot(tok::identifier) ||
+      !Tok.getIdentifierInfo()->isStr("priority")) {
+    Diag(Tok, diag::err_expected) << "priority";
+    T.skipToEnd();
+    return;
+  }
+  ConsumeToken();
+
+  if (ExpectAndConsume(tok::equal)) {
+    T.skipToEnd();
+    return;
+  }
+
+  ExprResult Priority = ParseConstantExpression();
+  if (Priority.isInvalid()) {
+    T.skipToEnd();
+    return;
+  }
+
+  unsigned Value;
+  if (Actions.CheckAresPriority(Priority.get(), Sema::APK_Task, Value)) {
+    T.skipToEnd();
+    return;
+  }
+
+  DS.setFunctionSpecTaskPriority(Value);
+
+  T.consumeClose();
+}
+
+// ==========
+
 /// Determine whether we're looking at something that might be a declarator
 /// in a simple-declaration. If it can't possibly be a declarator, maybe
 /// diagnose a missing semicolon after a prior tag definition in the decl
@@ -3188,8 +3243,8 @@ void Parser::ParseDeclarationSpecifiers(DeclSpec &DS,
 
     // +==== ares
     case tok::kw_task:
-      isInvalid = DS.setFunctionSpecTask(Loc, PrevSpec, DiagID);
-      break;
+      ParseTaskSpecifier(DS);
+      continue;
     // ==========
 
     // alignment-specifier
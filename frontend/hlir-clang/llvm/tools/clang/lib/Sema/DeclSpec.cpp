@@ -859,6 +859,11 @@ bool DeclSpec::setFunctionSpecNoreturn(SourceLocation Loc,
 
 bool DeclSpec::setFunctionSpecTask(SourceLocation Loc, const char *&PrevSpec,
                                           unsigned &DiagID) {
+  if (FS_task_specified) {
+    DiagID = diag::warn_duplicate_declspec;
+    PrevSpec = "task";
+    return true;
+  }
   FS_task_specified = true;
   return false;
 }
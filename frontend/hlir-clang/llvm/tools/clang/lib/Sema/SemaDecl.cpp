@@ -7052,6 +7052,7 @@ static FunctionDecl* CreateNewFunctionDecl(Sema &SemaRef, Declarator &D,
     // +=== ares
     if(D.getDeclSpec().isTaskSpecified()){
       fd->setTask(true);
+      fd->setTaskPriority(D.getDeclSpec().getTaskPriority());
     }
     // =========
 
@@ -2523,6 +2523,73 @@ static void DiagnoseForRangeVariableCopies(Sema &SemaRef,
   }
 }
 
+// +===== ares
+/// CheckAresPriority - Check that E, the priority hint of a task, Forall or
+/// ReduceAll, is an integer constant the scheduler's 32-bit unsigned
+/// priority can hold. Returns true if a diagnostic was emitted.
+bool Sema::CheckAresPriority(Expr *E, AresPriorityKind Kind,
+                             unsigned &Priority) {
+  // look through the conversion to the uint32_t parameter of Forall and
+  // ReduceAll so that a negative value is not wrapped around
+  E = E->IgnoreParenImpCasts();
+
+  llvm::APSInt Value;
+  if (E->isValueDependent() || !E->EvaluateAsInt(Value, Context)) {
+    Diag(E->getExprLoc(), diag::err_expr_not_ice) << 0 << E->getSourceRange();
+    return true;
+  }
+
+  if ((Value.isSigned() && Value.isNegative()) || Value.getActiveBits() > 32) {
+    Diag(E->getExprLoc(), diag::err_ares_priority_out_of_range)
+      << Kind << UINT32_MAX << Value.toString(10) << E->getSourceRange();
+    return true;
+  }
+
+  Priority = Value.getZExtValue();
+  return false;
+}
+
+/// CheckAresRangePriority - If the range of S is a Forall or ReduceAll
+/// constructed with a priority, check it the way a task priority is
+/// checked. CodeGen relies on the priority being a valid constant.
+static void CheckAresRangePriority(Sema &S, CXXForRangeStmt *ForStmt) {
+  if (S.CurContext->isDependentContext())
+    return;
+
+  auto DS = dyn_cast_or_null<DeclStmt>(ForStmt->getRangeStmt());
+  if (!DS || !DS->isSingleDecl())
+    return;
+
+  auto VD = dyn_cast<VarDecl>(DS->getSingleDecl());
+  if (!VD || !VD->getInit())
+    return;
+
+  std::string Name = VD->getType().getNonReferenceType().getAsString();
+
+  Sema::AresPriorityKind Kind;
+  unsigned PriorityArg;
+  if (Name == "class ares::Forall") {
+    Kind = Sema::APK_Forall;
+    PriorityArg = 2;
+  } else if (Name == "class ares::ReduceAll") {
+    Kind = Sema::APK_ReduceAll;
+    PriorityArg = 3;
+  } else
+    return;
+
+  Expr *Init = VD->getInit()->IgnoreImplicit();
+  if (auto FC = dyn_cast<CXXFunctionalCastExpr>(Init))
+    Init = FC->getSubExpr()->IgnoreImplicit();
+
+  auto CE = dyn_cast<CXXConstructExpr>(Init);
+  if (!CE || CE->getNumArgs() <= PriorityArg)
+    return;
+
+  unsigned Priority;
+  S.CheckAresPriority(CE->getArg(PriorityArg), Kind, Priority);
+}
+// ==========
+
 /// FinishCXXForRangeStmt - Attach the body to a C++0x for-range statement.
 /// This is a separate step from ActOnCXXForRangeStmt because analysis of the
 /// body cannot be performed until after the type of the range variable is
@@ -2542,6 +2609,10 @@ StmtResult Sema::FinishCXXForRangeStmt(Stmt *S, Stmt *B) {
 
   DiagnoseForRangeVariableCopies(*this, ForStmt);
 
+  // +===== ares
+  CheckAresRangePriority(*this, ForStmt);
+  // ==========
+
   return S;
 }
 
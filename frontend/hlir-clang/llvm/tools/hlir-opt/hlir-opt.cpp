@@ -0,0 +1,205 @@
+/*
+ * ###########################################################################
+ * Copyright (c) 2015, Los Alamos National Security, LLC.
+ * All rights reserved.
+ *
+ *  Copyright 2015. Los Alamos National Security, LLC. This software was
+ *  produced under U.S. Government contract ??? (LA-CC-15-056) for Los
+ *  Alamos National Laboratory (LANL), which is operated by Los Alamos
+ *  National Security, LLC for the U.S. Department of Energy. The
+ *  U.S. Government has rights to use, reproduce, and distribute this
+ *  software.  NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY,
+ *  LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY
+ *  FOR THE USE OF THIS SOFTWARE.  If software is modified to produce
+ *  derivative works, such modified software should be clearly marked,
+ *  so as not to confuse it with the version available from LANL.
+ *
+ *  Additionally, redistribution and use in source and binary forms,
+ *  with or without modification, are permitted provided that the
+ *  following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ *    * Neither the name of Los Alamos National Security, LLC, Los
+ *      Alamos National Laboratory, LANL, the U.S. Government, nor the
+ *      names of its contributors may be used to endorse or promote
+ *      products derived from this software without specific prior
+ *      written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR
+ *  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *  USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ * ###########################################################################
+ *
+ * Notes
+ *
+ * #####
+ */
+
+// loads a module and its HLIR, from the module's !hlir metadata or a text
+// file written by -emit-hlir, optionally lowers it and writes the result,
+// so lowering can be rerun on a module captured with
+// clang -mllvm -hlir-defer-lowering without recompiling it
+
+#include <iostream>
+#include <memory>
+#include <sstream>
+
+#include "llvm/Bitcode/BitcodeWriterPass.h"
+#include "llvm/IR/IRPrintingPasses.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/SystemUtils.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Transforms/ARES/HLIRPass.h"
+
+#include "hlir/HLIR.h"
+
+using namespace std;
+using namespace llvm;
+using namespace ares;
+
+static cl::opt<string>
+InputFilename(cl::Positional, cl::desc("<input IR file>"),
+              cl::init("-"), cl::value_desc("filename"));
+
+static cl::opt<string>
+OutputFilename("o", cl::desc("Output filename"),
+               cl::value_desc("filename"), cl::init("-"));
+
+static cl::opt<string>
+HLIRFilename("hlir", cl::desc("Read the HLIR from a text file"),
+             cl::value_desc("filename"));
+
+static cl::opt<string>
+EmitHLIR("emit-hlir", cl::desc("Write the HLIR as text to a file"),
+         cl::value_desc("filename"));
+
+static cl::opt<bool>
+Lower("lower", cl::desc("Lower the HLIR to IR"));
+
+static cl::opt<bool>
+PrintHLIR("print-hlir", cl::desc("Print the HLIR as it was read"));
+
+static cl::opt<bool>
+OutputAssembly("S", cl::desc("Write LLVM assembly rather than bitcode"));
+
+static cl::opt<bool>
+Force("f", cl::desc("Enable binary output on terminals"));
+
+int main(int argc, char** argv){
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+
+  LLVMContext context;
+  llvm_shutdown_obj Y;
+  cl::ParseCommandLineOptions(argc, argv, "HLIR optimizer\n");
+
+  SMDiagnostic err;
+  unique_ptr<Module> M = parseIRFile(InputFilename, err, context);
+  if(!M){
+    err.print(argv[0], errs());
+    return 1;
+  }
+
+  error_code ec;
+  tool_output_file out(OutputFilename, ec, sys::fs::F_None);
+  if(ec){
+    errs() << argv[0] << ": " << OutputFilename << ": " << ec.message() << "\n";
+    return 1;
+  }
+
+  try{
+    HLIRModule* module;
+
+    if(HLIRFilename.empty()){
+      module = HLIRModule::readMetadata(M.get());
+    }
+    else{
+      auto buf = MemoryBuffer::getFileOrSTDIN(HLIRFilename);
+      if(!buf){
+        errs() << argv[0] << ": " << HLIRFilename << ": " <<
+          buf.getError().message() << "\n";
+        return 1;
+      }
+      module = HLIRModule::readText(M.get(), (*buf)->getBuffer().str());
+    }
+
+    if(!module){
+      errs() << argv[0] << ": " << InputFilename << " has no HLIR\n";
+      return 1;
+    }
+
+    if(PrintHLIR){
+      module->output(cout);
+      cout << endl;
+    }
+
+    legacy::PassManager passes;
+
+    if(Lower){
+      passes.add(createHLIRPass());
+      passes.add(createVerifierPass());
+    }
+    else if(!EmitHLIR.empty()){
+      ostringstream ostr;
+      module->writeText(ostr);
+      HLIRModule::release(M.get());
+
+      tool_output_file hlirOut(EmitHLIR, ec, sys::fs::F_Text);
+      if(ec){
+        errs() << argv[0] << ": " << EmitHLIR << ": " << ec.message() << "\n";
+        return 1;
+      }
+      hlirOut.os() << ostr.str();
+      hlirOut.keep();
+    }
+    else{
+      module->writeMetadata();
+      HLIRModule::release(M.get());
+    }
+
+    if(OutputAssembly){
+      passes.add(createPrintModulePass(out.os()));
+    }
+    else if(Force || !CheckBitcodeOutputToConsole(out.os(), true)){
+      passes.add(createBitcodeWriterPass(out.os()));
+    }
+
+    passes.run(*M);
+  }
+  catch(HLIRError& e){
+    errs() << argv[0] << ": " << e.what() << "\n";
+    return 1;
+  }
+
+  out.keep();
+
+  return 0;
+}
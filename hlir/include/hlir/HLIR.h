@@ -57,17 +57,22 @@
 
 #include <string>
 #include <map>
+#include <mutex>
 #include <vector>
 #include <cassert>
+#include <cstddef>
 #include <sstream>
 #include <iostream>
 #include <unordered_map>
+#include <algorithm>
 
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include "HLIRError.h"
@@ -95,13 +100,156 @@ namespace ares{
     return ret;
   }
 
+  class HLIRNode;
+
+  // owns the nodes allocated while it is the current arena of a thread and
+  // destroys them together, in reverse order. nodes allocated with no
+  // current arena belong to one that lives until the process exits
+  class HLIRArena{
+  public:
+    HLIRArena(){}
+
+    HLIRArena(const HLIRArena&) = delete;
+
+    HLIRArena& operator=(const HLIRArena&) = delete;
+
+    ~HLIRArena();
+
+    // makes arena current for the lifetime of the scope
+    class Scope{
+    public:
+      Scope(HLIRArena* arena)
+        : prev_(current_()){
+        current_() = arena;
+      }
+
+      ~Scope(){
+        current_() = prev_;
+      }
+
+    private:
+      HLIRArena* prev_;
+    };
+
+    static HLIRArena* current(){
+      return current_();
+    }
+
+    static void setCurrent(HLIRArena* arena){
+      current_() = arena;
+    }
+
+    static void* allocate(size_t size){
+      HLIRArena* arena = current_();
+      if(!arena){
+        static HLIRArena global;
+        arena = &global;
+      }
+
+      void* p = arena->allocator_.Allocate(size, alignof(std::max_align_t));
+      pending_().push_back({p, arena});
+      return p;
+    }
+
+    // called by every node constructor, stack nodes are not pending
+    static void adopt(HLIRNode* node){
+      auto& pending = pending_();
+      if(!pending.empty() && pending.back().first == (void*)node){
+        pending.back().second->nodes_.push_back(node);
+        pending.pop_back();
+      }
+    }
+
+    // a constructor threw, the memory is reclaimed with the arena
+    static void abandon(void* p){
+      auto& pending = pending_();
+      if(!pending.empty() && pending.back().first == p){
+        pending.pop_back();
+      }
+    }
+
+    size_t size() const{
+      return nodes_.size();
+    }
+
+  private:
+    using Pending = std::vector<std::pair<void*, HLIRArena*>>;
+
+    static HLIRArena*& current_(){
+      static thread_local HLIRArena* arena = nullptr;
+      return arena;
+    }
+
+    // allocated but not yet constructed, innermost last
+    static Pending& pending_(){
+      static thread_local Pending pending;
+      return pending;
+    }
+
+    llvm::BumpPtrAllocator allocator_;
+    std::vector<HLIRNode*> nodes_;
+  };
+
   class HLIRNode{
   public:
-    HLIRNode()
-      : parent_(nullptr){}
+    // what a node is, checked by as<T>() in place of a dynamic_cast. the
+    // kinds of a class and its subclasses are contiguous
+    enum Kind{
+      BooleanKind,
+      IntegerKind,
+      FloatingKind,
+      StringKind,
+      SymbolKind,
+      FunctionKind,
+      ValueKind,
+      TypeKind,
+      InstructionKind,
+      BasicBlockKind,
+      VectorKind,
+      MapKind,
+      ModuleKind,
+      TaskParamKind,
+      ConstructKind,
+      TaskKind,
+      FutureKind,
+      BufferKind,
+      TeamKind,
+      SendKind,
+      ReceiveKind,
+      BarrierKind,
+      ParallelForKind,
+      ParallelReduceKind,
+      LastConstructKind = ParallelReduceKind,
+      LastMapKind = LastConstructKind
+    };
+
+    HLIRNode(Kind kind)
+      : kind_(kind),
+        parent_(nullptr){
+      HLIRArena::adopt(this);
+    }
+
+    HLIRNode(const HLIRNode& node)
+      : kind_(node.kind_),
+        parent_(nullptr){
+      HLIRArena::adopt(this);
+    }
 
     virtual ~HLIRNode(){}
 
+    // nodes are freed by the arena they were allocated from
+    static void* operator new(size_t size){
+      return HLIRArena::allocate(size);
+    }
+
+    static void operator delete(void* p){
+      HLIRArena::abandon(p);
+    }
+
+    Kind kind() const{
+      return kind_;
+    }
+
     virtual void output(std::ostream& ostr, size_t level=0) const = 0;
 
     virtual HLIRNode* copy() const = 0;
@@ -114,20 +262,24 @@ namespace ares{
 
     template<class T>
     T& as(){
-      auto r = dynamic_cast<T*>(this);
-      if(!r){
+      if(!T::classof(this)){
         HLIR_ERROR("invalid cast");
       }
-      return *r;
+      return *static_cast<T*>(this);
     }
 
     template<class T>
     const T& as() const{
-      auto r = dynamic_cast<const T*>(this);
-      if(!r){
+      if(!T::classof(this)){
         HLIR_ERROR("invalid cast");
       }
-      return *r;
+      return *static_cast<const T*>(this);
+    }
+
+    // null if this is not a T
+    template<class T>
+    T* tryAs(){
+      return T::classof(this) ? static_cast<T*>(this) : nullptr;
     }
 
     virtual bool isRecursive() const{
@@ -147,9 +299,17 @@ namespace ares{
     }
 
   private:
+    Kind kind_;
     HLIRNode* parent_;
   };
 
+  inline HLIRArena::~HLIRArena(){
+    for(auto itr = nodes_.rbegin(), itrEnd = nodes_.rend();
+        itr != itrEnd; ++itr){
+      (*itr)->~HLIRNode();
+    }
+  }
+
   inline std::ostream& operator<<(std::ostream& ostr, const HLIRNode& n){
     n.output(ostr);
     return ostr;
@@ -158,13 +318,16 @@ namespace ares{
   template<typename T>
   class HLIRScalar : public HLIRNode{
   public:
-    HLIRScalar(){}
+    HLIRScalar(Kind kind)
+      : HLIRNode(kind){}
 
-    HLIRScalar(const T& value)
-      : val_(value){}
+    HLIRScalar(Kind kind, const T& value)
+      : HLIRNode(kind),
+        val_(value){}
 
     HLIRScalar(const HLIRScalar<T>& value)
-      : val_(value.val_){}
+      : HLIRNode(value.kind()),
+        val_(value.val_){}
 
     virtual ~HLIRScalar(){}
 
@@ -192,9 +355,9 @@ namespace ares{
   public:
     using Super = HLIRScalar<bool>;
 
-    HLIRBoolean(bool value) : Super(value){}
+    HLIRBoolean(bool value) : Super(BooleanKind, value){}
 
-    HLIRBoolean(llvm::Value* value){
+    HLIRBoolean(llvm::Value* value) : Super(BooleanKind){
       auto ci = llvm::dyn_cast<llvm::ConstantInt>(value);
       if(!ci){
         HLIR_ERROR("not a boolean");
@@ -205,6 +368,10 @@ namespace ares{
     virtual HLIRBoolean* copy() const override{
       return new HLIRBoolean(*this);
     }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == BooleanKind;
+    }
   };
 
   class HLIRInteger : public HLIRScalar<int64_t>{
@@ -214,9 +381,9 @@ namespace ares{
     HLIRInteger(const HLIRInteger& x) : Super(x){}
 
     template<typename T>
-    HLIRInteger(T value) : Super(value){}
+    HLIRInteger(T value) : Super(IntegerKind, value){}
 
-    HLIRInteger(llvm::Value* value){
+    HLIRInteger(llvm::Value* value) : Super(IntegerKind){
       auto ci = llvm::dyn_cast<llvm::ConstantInt>(value);
       if(!ci){
         HLIR_ERROR("not an integer");
@@ -236,17 +403,21 @@ namespace ares{
       return val_ != std::numeric_limits<int64_t>::max();
     }
 
+    static bool classof(const HLIRNode* n){
+      return n->kind() == IntegerKind;
+    }
+
   };
 
   class HLIRFloating : public HLIRScalar<double>{
   public:
     using Super = HLIRScalar<double>;
 
-    HLIRFloating(double value) : Super(value){}
+    HLIRFloating(double value) : Super(FloatingKind, value){}
 
-    HLIRFloating(float value) : Super(value){}
+    HLIRFloating(float value) : Super(FloatingKind, value){}
 
-    HLIRFloating(llvm::Value* value){
+    HLIRFloating(llvm::Value* value) : Super(FloatingKind){
       auto cf = llvm::dyn_cast<llvm::ConstantFP>(value);
       if(!cf){
         HLIR_ERROR("not an floating point value");
@@ -258,10 +429,18 @@ namespace ares{
       return std::numeric_limits<double>::quiet_NaN();
     }
 
+    virtual HLIRFloating* copy() const override{
+      return new HLIRFloating(*this);
+    }
+
     virtual bool hasValue() const override{
       return val_ == val_;
     }
 
+    static bool classof(const HLIRNode* n){
+      return n->kind() == FloatingKind;
+    }
+
   };
 
   class HLIRString : public HLIRScalar<std::string>{
@@ -270,9 +449,9 @@ namespace ares{
 
     HLIRString(const HLIRString& x) : Super(x){}
 
-    HLIRString(const std::string& value) : Super(value){}
+    HLIRString(const std::string& value) : Super(StringKind, value){}
 
-    HLIRString(const char* value) : Super(value){}
+    HLIRString(const char* value) : Super(StringKind, value){}
 
     virtual void output(std::ostream& ostr, size_t level=0) const override{
       ostr << "\"" << val_ << "\""; 
@@ -289,6 +468,10 @@ namespace ares{
     virtual bool hasValue() const override{
       return !val_.empty();
     }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == StringKind;
+    }
   };
 
   class HLIRSymbol : public HLIRScalar<std::string>{
@@ -297,7 +480,7 @@ namespace ares{
 
     HLIRSymbol(const HLIRSymbol& x) : Super(x){}
 
-    HLIRSymbol(const std::string& value) : Super(value){}
+    HLIRSymbol(const std::string& value) : Super(SymbolKind, value){}
 
     bool operator<(const HLIRSymbol& s) const{
       return val_ < s.val_;
@@ -314,16 +497,73 @@ namespace ares{
     virtual bool hasValue() const override{
       return !val_.empty();
     }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == SymbolKind;
+    }
+
+    // map keys are interned, the id of a name is the number of names
+    // interned before it. names are never freed
+    // names are shared by every thread, each looks in its own cache of
+    // them first
+    static uint32_t intern(llvm::StringRef name){
+      static thread_local llvm::StringMap<uint32_t> cache;
+
+      auto citr = cache.find(name);
+      if(citr != cache.end()){
+        return citr->second;
+      }
+
+      Table_& t = table_();
+      uint32_t id;
+
+      {
+        std::lock_guard<std::mutex> guard(t.mutex);
+
+        auto itr = t.ids.find(name);
+        if(itr != t.ids.end()){
+          id = itr->second;
+        }
+        else{
+          id = t.names.size();
+          auto entry = t.ids.insert(std::make_pair(name, id)).first;
+          t.names.push_back(entry->getKey());
+        }
+      }
+
+      cache.insert(std::make_pair(name, id));
+      return id;
+    }
+
+    static llvm::StringRef name(uint32_t id){
+      Table_& t = table_();
+      std::lock_guard<std::mutex> guard(t.mutex);
+      return t.names[id];
+    }
+
+  private:
+    struct Table_{
+      std::mutex mutex;
+      llvm::StringMap<uint32_t> ids;
+      std::vector<llvm::StringRef> names;
+    };
+
+    static Table_& table_(){
+      static Table_ table;
+      return table;
+    }
   };
   
   template<class T>
   class HLIRContainer : public HLIRNode{
   public:
-    HLIRContainer(T* ptr)
-      : ptr_(ptr){}
+    HLIRContainer(Kind kind, T* ptr)
+      : HLIRNode(kind),
+        ptr_(ptr){}
 
     HLIRContainer(const HLIRContainer& c)
-      : ptr_(c.ptr_){}
+      : HLIRNode(c.kind()),
+        ptr_(c.ptr_){}
 
     T* val() const{
       return ptr_;
@@ -370,7 +610,7 @@ namespace ares{
   public:
     using Super = HLIRContainer<llvm::Function>;
 
-    HLIRFunction(llvm::Function* function) : Super(function){}
+    HLIRFunction(llvm::Function* function) : Super(FunctionKind, function){}
 
     virtual void output(std::ostream& ostr, size_t level=0) const override{
       std::string str;
@@ -387,13 +627,17 @@ namespace ares{
       return nullptr;
     }
 
+    static bool classof(const HLIRNode* n){
+      return n->kind() == FunctionKind;
+    }
+
   };
 
   class HLIRValue : public HLIRContainer<llvm::Value>{
   public:
     using Super = HLIRContainer<llvm::Value>;
 
-    HLIRValue(llvm::Value* value) : Super(value){}
+    HLIRValue(llvm::Value* value) : Super(ValueKind, value){}
 
     virtual void output(std::ostream& ostr, size_t level=0) const override{
       std::string str;
@@ -409,13 +653,17 @@ namespace ares{
     static HLIRValue nullValue(){
       return nullptr;
     }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == ValueKind;
+    }
   };
 
   class HLIRType : public HLIRContainer<llvm::Type>{
   public:
     using Super = HLIRContainer<llvm::Type>;
 
-    HLIRType(llvm::Type* type) : Super(type){}
+    HLIRType(llvm::Type* type) : Super(TypeKind, type){}
 
     virtual void output(std::ostream& ostr, size_t level=0) const override{
       std::string str;
@@ -431,13 +679,17 @@ namespace ares{
     static HLIRType nullValue(){
       return nullptr;
     }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == TypeKind;
+    }
   };
 
   class HLIRInstruction : public HLIRContainer<llvm::Instruction>{
   public:
     using Super = HLIRContainer<llvm::Instruction>;
 
-    HLIRInstruction(llvm::Instruction* inst) : Super(inst){}
+    HLIRInstruction(llvm::Instruction* inst) : Super(InstructionKind, inst){}
 
     virtual void output(std::ostream& ostr, size_t level=0) const override{
       std::string str;
@@ -453,13 +705,17 @@ namespace ares{
     static HLIRInstruction nullValue(){
       return nullptr;
     }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == InstructionKind;
+    }
   };
 
   class HLIRBasicBlock : public HLIRContainer<llvm::BasicBlock>{
   public:
     using Super = HLIRContainer<llvm::BasicBlock>;
 
-    HLIRBasicBlock(llvm::BasicBlock* value) : Super(value){}
+    HLIRBasicBlock(llvm::BasicBlock* value) : Super(BasicBlockKind, value){}
 
     virtual void output(std::ostream& ostr, size_t level=0) const override{
       std::string str;
@@ -475,6 +731,10 @@ namespace ares{
     static HLIRBasicBlock nullValue(){
       return nullptr;
     }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == BasicBlockKind;
+    }
   };
 
   class HLIRNodeFactory{
@@ -487,6 +747,10 @@ namespace ares{
       return node.copy();
     }
 
+    static HLIRNode* create(bool value){
+      return new HLIRBoolean(value);
+    }
+
     template<class T,
              class = typename std::enable_if<
                std::is_integral<T>::value>::type>
@@ -647,12 +911,12 @@ namespace ares{
       }
 
     private:
-      Proxy_(HLIRMap& map, const HLIRSymbol& key)
+      Proxy_(HLIRMap& map, uint32_t key)
         : map_(map),
           key_(key){}
 
       HLIRMap& map_;
-      HLIRSymbol key_;
+      uint32_t key_;
     };
 
     class ConstProxy_{
@@ -668,37 +932,67 @@ namespace ares{
       }
 
     private:
-      ConstProxy_(const HLIRMap& map, const HLIRSymbol& key)
+      ConstProxy_(const HLIRMap& map, uint32_t key)
         : map_(map),
           key_(key){}
 
       const HLIRMap& map_;
-      HLIRSymbol key_;
+      uint32_t key_;
     };
     
     friend class Proxy_;
 
-    HLIRMap(){}
+    HLIRMap()
+      : HLIRNode(MapKind){}
 
     HLIRMap(const HLIRMap& map)
-      : map_(map.map_){}
+      : HLIRNode(MapKind),
+        map_(map.map_){}
 
     template<class T>
-    T& get(const std::string& key){
-      return get_(key)->as<T>();
+    T& get(llvm::StringRef key){
+      return get_(HLIRSymbol::intern(key))->as<T>();
     }
 
     template<class T>
-    const T& get(const std::string& key) const{
-      return get_(key)->as<T>();
+    const T& get(llvm::StringRef key) const{
+      return get_(HLIRSymbol::intern(key))->as<T>();
+    }
+
+    Proxy_ operator[](llvm::StringRef key){
+      return Proxy_(*this, HLIRSymbol::intern(key)); 
+    }
+
+    bool has(llvm::StringRef key) const{
+      return find_(HLIRSymbol::intern(key)) != map_.end();
     }
 
-    Proxy_ operator[](const std::string& key){
-      return Proxy_(*this, key); 
+    ConstProxy_ operator[](llvm::StringRef key) const{
+      return ConstProxy_(*this, HLIRSymbol::intern(key)); 
     }
 
-    ConstProxy_ operator[](const std::string& key) const{
-      return ConstProxy_(*this, key); 
+    using Entries = std::vector<std::pair<llvm::StringRef, HLIRNode*>>;
+
+    // by name rather than by id so they do not depend on the order names
+    // were interned in
+    Entries entries() const{
+      Entries ret;
+      for(auto& itr : map_){
+        ret.push_back({HLIRSymbol::name(itr.first), itr.second});
+      }
+      std::sort(ret.begin(), ret.end(),
+                [](const std::pair<llvm::StringRef, HLIRNode*>& a,
+                   const std::pair<llvm::StringRef, HLIRNode*>& b){
+                  return a.first < b.first;
+                });
+      return ret;
+    }
+
+    // adds or replaces the entries of map, sharing their nodes
+    void merge(const HLIRMap& map){
+      for(auto& itr : map.map_){
+        put_(itr.first, itr.second);
+      }
     }
 
     virtual void output(std::ostream& ostr, size_t level=0) const override{
@@ -706,10 +1000,10 @@ namespace ares{
 
       ostr << "{";
 
-      for(auto& itr : map_){
+      for(auto& itr : entries()){
         HLIRNode* val = itr.second;
         if(val->hasValue()){
-          ostr << std::endl << indent << "  " << itr.first << ": ";
+          ostr << std::endl << indent << "  " << itr.first.str() << ": ";
           itr.second->output(ostr, level + 1);
         }
       }
@@ -725,31 +1019,61 @@ namespace ares{
       return true;
     }
 
+    static bool classof(const HLIRNode* n){
+      return n->kind() >= MapKind && n->kind() <= LastMapKind;
+    }
+
+  protected:
+    HLIRMap(Kind kind)
+      : HLIRNode(kind){}
+
   private:
-    using Map_ = std::map<HLIRSymbol, HLIRNode*>;
+    // sorted by symbol id, a construct has a few dozen entries at most so
+    // a binary search over a vector beats a tree of nodes
+    using Map_ = std::vector<std::pair<uint32_t, HLIRNode*>>;
 
     Map_ map_;
 
-    void put_(const HLIRSymbol& symbol, HLIRNode* value){
+    Map_::const_iterator find_(uint32_t key) const{
+      auto itr = lowerBound_(key);
+      return itr != map_.end() && itr->first == key ? itr : map_.end();
+    }
+
+    Map_::const_iterator lowerBound_(uint32_t key) const{
+      return std::lower_bound(map_.begin(), map_.end(), key,
+                              [](const std::pair<uint32_t, HLIRNode*>& e,
+                                 uint32_t k){
+                                return e.first < k;
+                              });
+    }
+
+    void put_(uint32_t key, HLIRNode* value){
       value->setParent(this);
-      map_[symbol] = value;
+
+      auto itr = map_.begin() + (lowerBound_(key) - map_.begin());
+      if(itr != map_.end() && itr->first == key){
+        itr->second = value;
+      }
+      else{
+        map_.insert(itr, std::make_pair(key, value));
+      }
     }
 
-    HLIRNode* get_(const HLIRSymbol& symbol){
-      auto itr = map_.find(symbol);
+    HLIRNode* get_(uint32_t key){
+      auto itr = find_(key);
 
       if(itr == map_.end()){
-        HLIR_ERROR("invalid key: " + symbol.str());
+        HLIR_ERROR("invalid key: " + HLIRSymbol::name(key).str());
       }
 
       return itr->second;
     }
 
-    const HLIRNode* get_(const HLIRSymbol& symbol) const{
-      auto itr = map_.find(symbol);
+    const HLIRNode* get_(uint32_t key) const{
+      auto itr = find_(key);
 
       if(itr == map_.end()){
-        HLIR_ERROR("invalid key: " + symbol.str());
+        HLIR_ERROR("invalid key: " + HLIRSymbol::name(key).str());
       }
 
       return itr->second;
@@ -810,10 +1134,12 @@ namespace ares{
     
     friend class Proxy_;
 
-    HLIRVector(){}
+    HLIRVector()
+      : HLIRNode(VectorKind){}
 
     HLIRVector(const HLIRVector& vector)
-      : vector_(vector.vector_){}
+      : HLIRNode(VectorKind),
+        vector_(vector.vector_){}
 
     virtual HLIRVector* copy() const override{
       return new HLIRVector(*this);
@@ -827,6 +1153,10 @@ namespace ares{
       return ConstProxy_(*this, index); 
     }
 
+    size_t size() const{
+      return vector_.size();
+    }
+
     template<class T>
     HLIRVector& operator<<(const T& value){
       auto n = HLIRNodeFactory::create(value);
@@ -871,6 +1201,10 @@ namespace ares{
       return true;
     }
 
+    static bool classof(const HLIRNode* n){
+      return n->kind() == VectorKind;
+    }
+
   private:
     using Vector_ = std::vector<HLIRNode*>;
 
@@ -904,6 +1238,9 @@ namespace ares{
   class HLIRParallelFor;
   class HLIRParallelReduce;
   class HLIRTask;
+  class HLIRFuture;
+  class HLIRBuffer;
+  class HLIRBarrier;
 
   class HLIRModule : public HLIRMap{
   public:
@@ -918,8 +1255,28 @@ namespace ares{
     llvm::Type* doubleTy;
     llvm::PointerType* voidPtrTy;
 
+    // the HLIR of module, created on first use. makes its arena current on
+    // this thread
     static HLIRModule* getModule(llvm::Module* module);
 
+    // destroys the HLIR of module and every node in its arena, called
+    // once module has been lowered. a later getModule() on the same
+    // address starts over
+    static void release(llvm::Module* module);
+
+    // modules are not in any arena, they own one
+    static void* operator new(size_t size){
+      return ::operator new(size);
+    }
+
+    static void operator delete(void* p){
+      ::operator delete(p);
+    }
+
+    HLIRArena* arena(){
+      return &arena_;
+    }
+
     void setName(const HLIRString& name){
       (*this)["name"] = name;
     }
@@ -1006,23 +1363,98 @@ namespace ares{
       return func;
     }
 
+    // stores the HLIR of this module in it as the named metadata !hlir
+    // so it survives being written out as bitcode and can be lowered by
+    // a later tool. the instructions it refers to are tagged !hlir.ref
+    void writeMetadata();
+
+    // rebuilds the HLIR of module from what writeMetadata() stored and
+    // removes that metadata, null if module has none
+    static HLIRModule* readMetadata(llvm::Module* module);
+
+    // writes the metadata of writeMetadata() in the readable form read by
+    // readText(), the module keeps the !hlir.ref tags and sealed captures
+    // it refers to so both must be saved to be read back
+    void writeText(std::ostream& ostr);
+
+    static HLIRModule* readText(llvm::Module* module,
+                                const std::string& text);
+
+    // the constructs in the order of their markers in the module
+    std::vector<HLIRConstruct*> orderedConstructs_();
+
     bool lowerToIR_();
     
+    // the values a parallel body and the bodies nested in it capture
+    struct CaptureInfo_{
+      // every value captured by some body of the tree, deduplicated in
+      // first use order, the fields of the top-level args struct
+      std::vector<llvm::Instruction*> captures;
+
+      // the captures defined outside of this body, loaded from its args
+      std::vector<llvm::Instruction*> needs;
+
+      // the operands of this body that refer to values defined outside it
+      std::vector<std::pair<llvm::Instruction*, unsigned>> uses;
+
+      std::vector<HLIRParallelFor*> parallelFors;
+
+      std::vector<HLIRParallelReduce*> parallelReduces;
+    };
+
+    using CaptureMap_ =
+      std::unordered_map<llvm::Function*, CaptureInfo_>;
+
+    const CaptureInfo_& analyzeCaptures_(llvm::Function* body,
+                                         CaptureMap_& captureMap);
+
     void lowerParallelFor_(HLIRParallelFor* pfor,
+                           CaptureMap_& captureMap,
                            llvm::StructType* argsType,
-                           std::unordered_map<llvm::Value*, size_t>& capturedMap,
-                           std::unordered_map<llvm::Value*, llvm::Value*>& replacedMap);
-
-    void lowerParallelReduce_(HLIRParallelReduce* reduce);
+                           std::unordered_map<llvm::Value*, size_t>& fieldMap,
+                           const std::unordered_map<llvm::Value*, llvm::Value*>* parentLoads);
+
+    void lowerPartition_(HLIRParallelFor* pfor,
+                         llvm::IRBuilder<>& b,
+                         llvm::Value*& start,
+                         llvm::Value*& end);
+
+    void lowerParallelReduce_(HLIRParallelReduce* reduce,
+                              CaptureMap_& captureMap,
+                              const std::unordered_map<llvm::Value*, llvm::Value*>* parentLoads);
+
+    void lowerOMPLoop_(llvm::Instruction* marker,
+                       llvm::Function* body,
+                       llvm::Value* args,
+                       llvm::Value* start,
+                       llvm::Value* end,
+                       llvm::Value* result,
+                       bool sum);
 
     void lowerTask_(HLIRTask* task);
 
-    void findExternalValues_(llvm::Function* f,
-                             std::vector<llvm::Instruction*>& v,
-                             bool recursive,
-                             bool top,
-                             std::vector<HLIRParallelFor*>& ps,
-                             std::vector<HLIRParallelReduce*>& rs);
+    std::vector<llvm::CallInst*> taskSpawns_(HLIRTask* task);
+
+    bool messageOperands_(llvm::Instruction* i,
+                          bool send,
+                          llvm::Value*& rank,
+                          llvm::Value*& data);
+
+    void lowerMessage_(HLIRConstruct* c,
+                       bool send,
+                       const HLIRBuffer& buffer,
+                       llvm::Value* rank,
+                       HLIRFuture* future);
+
+    void lowerBarrier_(HLIRBarrier* barrier);
+
+    void lowerAwait_(HLIRFuture* future);
+
+    llvm::Value* getFutureSlot_(HLIRFuture* future, llvm::Function* f);
+
+    llvm::Value* getTaskGroup_(llvm::Function* f);
+
+    void joinTaskGroup_(llvm::CallInst* ci, llvm::Value* group);
 
     llvm::Value* toInt8(const HLIRInteger& i){
       return llvm::ConstantInt::get(i8Ty, i);
@@ -1042,7 +1474,9 @@ namespace ares{
 
   private:
     HLIRModule(llvm::Module* module)
-      : module_(module),
+      : HLIRMap(ModuleKind),
+        nextId_(0),
+        module_(module),
         context_(module_->getContext()),
         builder_(context_){
 
@@ -1059,17 +1493,27 @@ namespace ares{
       voidPtrTy = llvm::PointerType::get(i8Ty, 0);
     }
 
+    // construct names are numbered per module
+    std::string createName_(const std::string& prefix){
+      return prefix + toStr(nextId_++);
+    }
+
+    HLIRArena arena_;
+    size_t nextId_;
     llvm::Module* module_;
     llvm::LLVMContext& context_;
     llvm::IRBuilder<> builder_;
 
     std::unordered_map<llvm::Instruction*, HLIRConstruct*> constructMap_;
     std::vector<HLIRTask*> tasks_;
+    std::unordered_map<llvm::Function*, llvm::Value*> taskGroupMap_;
+    std::unordered_map<HLIRFuture*, llvm::Value*> futureSlotMap_;
   };
 
   class HLIRTaskParam : public HLIRMap{
   public:
-    HLIRTaskParam(){
+    HLIRTaskParam()
+      : HLIRMap(TaskParamKind){
       (*this)["read"] = false;
       (*this)["write"] = false;
       (*this)["partitioner"] = HLIRFunction::nullValue();
@@ -1099,12 +1543,16 @@ namespace ares{
       return get<HLIRFunction>("partitioner");
     }
 
+    static bool classof(const HLIRNode* n){
+      return n->kind() == TaskParamKind;
+    }
   };
 
   class HLIRConstruct : public HLIRMap{
   public:
-    HLIRConstruct(HLIRModule* module)
-      : module_(module){}
+    HLIRConstruct(HLIRModule* module, Kind kind)
+      : HLIRMap(kind),
+        module_(module){}
 
     virtual std::string intrinsic() const{
       HLIR_ERROR("invalid intrinsic");
@@ -1121,6 +1569,10 @@ namespace ares{
       return get<HLIRInstruction>("marker"); 
     }
 
+    static bool classof(const HLIRNode* n){
+      return n->kind() >= ConstructKind && n->kind() <= LastConstructKind;
+    }
+
   protected:
     HLIRModule* module_;
   };
@@ -1128,7 +1580,7 @@ namespace ares{
   class HLIRTask : public HLIRConstruct{
   public:
     HLIRTask(HLIRModule* module)
-      : HLIRConstruct(module){
+      : HLIRConstruct(module, TaskKind){
       auto ret = new HLIRTaskParam;
       ret->setRead(false);
       ret->setWrite(true);
@@ -1136,6 +1588,7 @@ namespace ares{
       (*this)["return"] = ret;
       (*this)["parameters"] = HLIRVector();
       (*this)["function"] = HLIRFunction::nullValue();
+      (*this)["priority"] = HLIRInteger(0);
     }
 
     HLIRTaskParam& getReturn(){
@@ -1159,6 +1612,21 @@ namespace ares{
       return get<HLIRFunction>("wrapperFunction");
     }
 
+    auto& argsType() const{
+      return get<HLIRType>("argsType");
+    }
+
+    // void (and sret) tasks have no return slot and are joined through
+    // the task group of the spawning function rather than a future
+    auto& grouped() const{
+      return get<HLIRBoolean>("grouped");
+    }
+
+    // index of the first parameter field in the args struct
+    size_t paramIndex() const{
+      return grouped() ? 2 : 3;
+    }
+
     void setName(const HLIRString& name){
       (*this)["name"] = name;
     }
@@ -1166,33 +1634,97 @@ namespace ares{
     auto& name() const{
       return get<HLIRString>("name");
     }
+
+    // scheduling hint, higher priorities are dequeued first
+    void setPriority(const HLIRInteger& priority){
+      (*this)["priority"] = priority;
+    }
+
+    auto& priority() const{
+      return get<HLIRInteger>("priority");
+    }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == TaskKind;
+    }
   };
 
+  // an in-flight send or receive, await() marks where it must have
+  // completed by
   class HLIRFuture : public HLIRConstruct{
   public:
-    HLIRFuture(HLIRModule* module, HLIRValue& value)
-      : HLIRConstruct(module){}
+    virtual std::string intrinsic() const override{
+      return "await";
+    }
 
-    void await(){}
+    HLIRFuture(HLIRModule* module)
+      : HLIRConstruct(module, FutureKind){}
+
+    template<bool P, class C, class I>
+    void await(llvm::IRBuilder<P, C, I>& builder){
+      insert(builder);
+    }
 
-    HLIRValue await(const HLIRValue& microsends){}
+    bool awaited() const{
+      return has("marker");
+    }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == FutureKind;
+    }
   };
 
+  // size bytes at data
   class HLIRBuffer : public HLIRConstruct{
   public:
     HLIRBuffer(HLIRModule* module)
-      : HLIRConstruct(module){}
+      : HLIRConstruct(module, BufferKind){}
+
+    void init(const HLIRValue& data,
+              const HLIRValue& size){
+      (*this)["data"] = data;
+      (*this)["size"] = size;
+    }
+
+    auto& data() const{
+      return get<HLIRValue>("data");
+    }
 
-    void init(const HLIRValue& buffer,
-              const HLIRValue& size){}
+    auto& size() const{
+      return get<HLIRValue>("size");
+    }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == BufferKind;
+    }
   };
 
+  // the ranks of the communicator, the only team for now
   class HLIRTeam : public HLIRConstruct{
   public:
     HLIRTeam(HLIRModule* module)
-      : HLIRConstruct(module){}
+      : HLIRConstruct(module, TeamKind){}
+
+    template<bool P, class C, class I>
+    llvm::Value* rank(llvm::IRBuilder<P, C, I>& builder){
+      llvm::Function* f = 
+        module_->getFunction("__ares_comm_rank", {}, module_->i32Ty);
+      return builder.CreateCall(f, {}, "rank");
+    }
+
+    template<bool P, class C, class I>
+    llvm::Value* size(llvm::IRBuilder<P, C, I>& builder){
+      llvm::Function* f = 
+        module_->getFunction("__ares_comm_size", {}, module_->i32Ty);
+      return builder.CreateCall(f, {}, "size");
+    }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == TeamKind;
+    }
   };
 
+  // without a future the send is waited on as late as its block allows
   class HLIRSend : public HLIRConstruct{
   public:
     virtual std::string intrinsic() const override{
@@ -1200,17 +1732,17 @@ namespace ares{
     }
 
     HLIRSend(HLIRModule* module)
-      : HLIRConstruct(module){}
+      : HLIRConstruct(module, SendKind){}
 
-    void setFuture(const HLIRFuture& future){
+    void setFuture(HLIRFuture* future){
       (*this)["future"] = future;
     }
 
-    auto& future() const{
-      return get<HLIRFuture>("future");
+    HLIRFuture* future(){
+      return has("future") ? &get<HLIRFuture>("future") : nullptr;
     }
 
-    void setTeam(const HLIRTeam& team){
+    void setTeam(HLIRTeam* team){
       (*this)["team"] = team;
     }
 
@@ -1218,15 +1750,30 @@ namespace ares{
       return get<HLIRTeam>("team");
     }
 
-    void setBuffer(const HLIRBuffer& buffer){
+    void setBuffer(HLIRBuffer* buffer){
       (*this)["buffer"] = buffer;
     }
 
     auto& buffer() const{
       return get<HLIRBuffer>("buffer");
     }
+
+    // destination rank in the team
+    void setRank(const HLIRValue& rank){
+      (*this)["rank"] = rank;
+    }
+
+    auto& rank() const{
+      return get<HLIRValue>("rank");
+    }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == SendKind;
+    }
   };
 
+  // without a future the receive is waited on before anything after it
+  // touches memory
   class HLIRReceive : public HLIRConstruct{
   public:
     virtual std::string intrinsic() const override{
@@ -1234,17 +1781,17 @@ namespace ares{
     }
 
     HLIRReceive(HLIRModule* module)
-      : HLIRConstruct(module){}
+      : HLIRConstruct(module, ReceiveKind){}
 
-    void setFuture(const HLIRFuture& future){
+    void setFuture(HLIRFuture* future){
       (*this)["future"] = future;
     }
 
-    auto& future() const{
-      return get<HLIRFuture>("future");
+    HLIRFuture* future(){
+      return has("future") ? &get<HLIRFuture>("future") : nullptr;
     }
 
-    void setTeam(const HLIRTeam& team){
+    void setTeam(HLIRTeam* team){
       (*this)["team"] = team;
     }
 
@@ -1252,13 +1799,26 @@ namespace ares{
       return get<HLIRTeam>("team");
     }
 
-    void setBuffer(const HLIRBuffer& buffer){
+    void setBuffer(HLIRBuffer* buffer){
       (*this)["buffer"] = buffer;
     }
 
     auto& buffer() const{
       return get<HLIRBuffer>("buffer");
     }
+
+    // source rank in the team, -1 for any
+    void setRank(const HLIRValue& rank){
+      (*this)["rank"] = rank;
+    }
+
+    auto& rank() const{
+      return get<HLIRValue>("rank");
+    }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == ReceiveKind;
+    }
   };
 
   class HLIRBarrier : public HLIRConstruct{
@@ -1268,15 +1828,19 @@ namespace ares{
     }
 
     HLIRBarrier(HLIRModule* module)
-      : HLIRConstruct(module){}
+      : HLIRConstruct(module, BarrierKind){}
 
-    void setTeam(const HLIRTeam& team){
+    void setTeam(HLIRTeam* team){
       (*this)["team"] = team;
     }
 
     auto& team() const{
       return get<HLIRTeam>("team");
     }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == BarrierKind;
+    }
   };
 
   class HLIRParallelFor : public HLIRConstruct{
@@ -1323,12 +1887,49 @@ namespace ares{
       return get<HLIRVector>("range");
     }
 
+    void setPriority(const HLIRInteger& priority){
+      (*this)["priority"] = priority;
+    }
+
+    auto& priority() const{
+      return get<HLIRInteger>("priority");
+    }
+
+    // run only this rank's block of the range
+    void setDistributed(const HLIRBoolean& flag){
+      (*this)["distributed"] = flag;
+    }
+
+    auto& distributed() const{
+      return get<HLIRBoolean>("distributed");
+    }
+
+    // called as partitioner(start, end, rank, size, &first, &last) to
+    // find the block, null for an even split
+    void setPartitioner(const HLIRValue& partitioner){
+      (*this)["partitioner"] = partitioner;
+    }
+
+    auto& partitioner() const{
+      return get<HLIRValue>("partitioner");
+    }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == ParallelForKind;
+    }
+
   private:
     friend class HLIRModule;
     friend class HLIRPass;
 
     HLIRParallelFor(HLIRModule* module);
 
+    // from the fields read by HLIRModule::readMetadata()
+    HLIRParallelFor(HLIRModule* module, const HLIRMap& fields)
+      : HLIRConstruct(module, ParallelForKind){
+      merge(fields);
+    }
+
     auto& callMarker() const{
       return get<HLIRInstruction>("callMarker");
     }
@@ -1408,12 +2009,29 @@ namespace ares{
       return get<HLIRVector>("range");
     }
 
+    void setPriority(const HLIRInteger& priority){
+      (*this)["priority"] = priority;
+    }
+
+    auto& priority() const{
+      return get<HLIRInteger>("priority");
+    }
+
+    static bool classof(const HLIRNode* n){
+      return n->kind() == ParallelReduceKind;
+    }
+
   private:
     friend class HLIRModule;
     friend class HLIRPass;
 
     HLIRParallelReduce(HLIRModule* module, const HLIRType& reduceType);
 
+    HLIRParallelReduce(HLIRModule* module, const HLIRMap& fields)
+      : HLIRConstruct(module, ParallelReduceKind){
+      merge(fields);
+    }
+
     auto& callMarker() const{
       return get<HLIRInstruction>("callMarker");
     }
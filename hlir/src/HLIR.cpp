@@ -54,7 +54,15 @@
 
 #include "hlir/HLIR.h"
 
+#include <memory>
 #include <mutex>
+#include <unordered_set>
+
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Dominators.h"
 
 //#define USE_ARGOBOTS 1
 
@@ -68,51 +76,122 @@ namespace{
 
   using ValueVec = vector<Value*>;
 
-  mutex _mutex;
+  using Guard = lock_guard<mutex>;
 
-  map<string, HLIRModule*> _moduleNameMap;
+  // the HLIR of the modules of one LLVMContext. contexts are compiled
+  // independently so only lookups of a new context share a lock
+  struct ContextRegistry{
+    mutex mutex_;
+    map<Module*, unique_ptr<HLIRModule>> moduleMap;
+  };
 
-  map<Module*, HLIRModule*> _moduleMap;
+  mutex _contextMutex;
 
-  size_t _nextId = 0;
+  // registries are kept once created since other threads may have cached
+  // them, a context at a reused address finds its empty registry
+  map<LLVMContext*, unique_ptr<ContextRegistry>> _contextMap;
 
-  using Guard = lock_guard<mutex>;
+  thread_local LLVMContext* _lastContext = nullptr;
 
-  size_t createId(){
-    return _nextId++;
-  }
+  thread_local ContextRegistry* _lastRegistry = nullptr;
+
+  ContextRegistry* getRegistry(LLVMContext* context){
+    if(context == _lastContext){
+      return _lastRegistry;
+    }
+
+    Guard guard(_contextMutex);
 
-  string createName(const string& prefix){
-    return prefix + toStr(createId());
+    auto& r = _contextMap[context];
+    if(!r){
+      r.reset(new ContextRegistry);
+    }
+
+    _lastContext = context;
+    _lastRegistry = r.get();
+
+    return _lastRegistry;
   }
 
   static const size_t REDUCE_THREADS = 8;
 
+  // the function i calls directly, empty if none
+  StringRef calleeName(Instruction* i){
+    if(CallInst* ci = dyn_cast<CallInst>(i)){
+      if(Function* f = ci->getCalledFunction()){
+        return f->getName();
+      }
+    }
+    return StringRef();
+  }
+
 } // namespace
 
 HLIRModule* HLIRModule::getModule(Module* module){
-  Guard guard(_mutex);
+  ContextRegistry* r = getRegistry(&module->getContext());
+  Guard guard(r->mutex_);
 
-  auto itr = _moduleMap.find(module);
-  if(itr == _moduleMap.end()){
+  auto itr = r->moduleMap.find(module);
+  if(itr == r->moduleMap.end()){
     auto m = new HLIRModule(module);
-    m->setName(createName("module"));
-    _moduleMap[module] = m;
-    _moduleNameMap[m->name()] = m;
+    HLIRArena::setCurrent(&m->arena_);
+    m->setName(module->getModuleIdentifier());
+    r->moduleMap[module].reset(m);
     return m;
   }
 
-  return itr->second;
+  HLIRArena::setCurrent(&itr->second->arena_);
+  return itr->second.get();
+}
+
+void HLIRModule::release(Module* module){
+  ContextRegistry* r = getRegistry(&module->getContext());
+  unique_ptr<HLIRModule> m;
+
+  {
+    Guard guard(r->mutex_);
+
+    auto itr = r->moduleMap.find(module);
+    if(itr == r->moduleMap.end()){
+      return;
+    }
+
+    m = move(itr->second);
+    r->moduleMap.erase(itr);
+  }
+
+  if(HLIRArena::current() == &m->arena_){
+    HLIRArena::setCurrent(nullptr);
+  }
 }
 
 void HLIRModule::addConstruct(HLIRConstruct* c){
   constructMap_.emplace(c->marker(), c);
 }
 
+vector<HLIRConstruct*> HLIRModule::orderedConstructs_(){
+  vector<HLIRConstruct*> constructs;
+
+  for(Function& f : *module_){
+    for(BasicBlock& b : f){
+      for(Instruction& i : b){
+        auto itr = constructMap_.find(&i);
+        if(itr != constructMap_.end()){
+          constructs.push_back(itr->second);
+        }
+      }
+    }
+  }
+
+  return constructs;
+}
+
 HLIRParallelFor* HLIRModule::createParallelFor(){
+  HLIRArena::Scope scope(&arena_);
+
   auto pf = new HLIRParallelFor(this);
 
-  string name = createName("pfor");
+  string name = createName_("pfor");
   pf->setName(name);
 
   (*this)[name] = pf;
@@ -123,9 +202,11 @@ HLIRParallelFor* HLIRModule::createParallelFor(){
 HLIRParallelReduce* HLIRModule::createParallelReduce(
   const HLIRType& reduceType){
   
+  HLIRArena::Scope scope(&arena_);
+
   auto r = new HLIRParallelReduce(this, reduceType);
 
-  string name = createName("reduce");
+  string name = createName_("reduce");
   r->setName(name);
 
   (*this)[name] = r;
@@ -134,10 +215,12 @@ HLIRParallelReduce* HLIRModule::createParallelReduce(
 }
 
 HLIRTask* HLIRModule::createTask(){
+  HLIRArena::Scope scope(&arena_);
+
   auto task = new HLIRTask(this);
   tasks_.push_back(task);
   
-  string name = createName("task");
+  string name = createName_("task");
   task->setName(name);
 
   (*this)[name] = task;
@@ -145,63 +228,86 @@ HLIRTask* HLIRModule::createTask(){
   return task;
 }
 
-void HLIRModule::findExternalValues_(Function* f,
-                                     vector<Instruction*>& v,
-                                     bool recursive,
-                                     bool top,
-                                     vector<HLIRParallelFor*>& ps,
-                                     vector<HLIRParallelReduce*>& rs){
-  for(BasicBlock& bi : *f){
-    for(Instruction& ii : bi){
-      bool handled = false;
+// computes the captures of body and of the parallel bodies nested in it
+// bottom-up, each body is analyzed once and the result is kept in
+// captureMap for the nested lowerings
+const HLIRModule::CaptureInfo_&
+HLIRModule::analyzeCaptures_(Function* body, CaptureMap_& captureMap){
+  auto itr = captureMap.find(body);
+  if(itr != captureMap.end()){
+    return itr->second;
+  }
+
+  CaptureInfo_& info = captureMap[body];
+
+  unordered_set<Instruction*> captured;
+  unordered_set<Instruction*> needed;
+
+  auto capture = [&](Instruction* vi){
+    if(captured.insert(vi).second){
+      info.captures.push_back(vi);
+    }
+  };
 
+  auto need = [&](Instruction* vi){
+    if(vi->getParent()->getParent() != body && needed.insert(vi).second){
+      info.needs.push_back(vi);
+    }
+  };
+
+  for(BasicBlock& bi : *body){
+    for(Instruction& ii : bi){
       if(CallInst* ci = dyn_cast<CallInst>(&ii)){
-        auto itr = constructMap_.find(ci);
-        
-        if(itr != constructMap_.end()){
-          HLIRConstruct* hc = itr->second;
-          if(auto pf = dynamic_cast<HLIRParallelFor*>(hc)){
-            if(top){
-              ps.push_back(pf);
-            }
-            
-            if(recursive){
-              findExternalValues_(pf->body(), v, recursive, false, ps, rs);
-            }
+        auto citr = constructMap_.find(ci);
+
+        if(citr != constructMap_.end()){
+          HLIRConstruct* hc = citr->second;
+
+          Function* nested;
+          if(auto pf = hc->tryAs<HLIRParallelFor>()){
+            info.parallelFors.push_back(pf);
+            nested = pf->body();
           }
-          else if(auto pr = dynamic_cast<HLIRParallelReduce*>(hc)){
-            if(top){
-              rs.push_back(pr);
-            }
-
-            if(recursive){
-              findExternalValues_(pr->body(), v, recursive, false, ps, rs);
-            }
+          else{
+            auto& pr = hc->as<HLIRParallelReduce>();
+            info.parallelReduces.push_back(&pr);
+            nested = pr.body();
           }
-          
-          handled = true;
+
+          const CaptureInfo_& ni = analyzeCaptures_(nested, captureMap);
+
+          for(Instruction* vi : ni.captures){
+            capture(vi);
+          }
+
+          for(Instruction* vi : ni.needs){
+            need(vi);
+          }
+
+          continue;
         }
       }
 
-      if(handled){
-        continue;
-      }
-      
-      for(Value* vi : ii.operands()){
-        if(Instruction* ij = dyn_cast<Instruction>(vi)){
-          if(ij->getParent()->getParent() != f){
-            v.push_back(ij);
+      for(Use& u : ii.operands()){
+        if(Instruction* vi = dyn_cast<Instruction>(u.get())){
+          if(vi->getParent()->getParent() != body){
+            info.uses.push_back({&ii, u.getOperandNo()});
+            capture(vi);
+            need(vi);
           }
         }
       }
     }
   }
+
+  return info;
 }
 
 void HLIRModule::lowerParallelFor_(HLIRParallelFor* pf,
+                                   CaptureMap_& captureMap,
                                    StructType* argsType,
-                                   unordered_map<Value*, size_t>& capturedMap,
-                                   unordered_map<Value*, Value*>& replacedMap){
+                                   unordered_map<Value*, size_t>& fieldMap,
+                                   const unordered_map<Value*, Value*>* parentLoads){
 
   auto& c = module_->getContext();
   IRBuilder<> b(c);
@@ -225,28 +331,17 @@ void HLIRModule::lowerParallelFor_(HLIRParallelFor* pf,
     return;
   }
 
-  vector<Instruction*> rvs;
-
-  vector<HLIRParallelFor*> rps;
-  vector<HLIRParallelReduce*> rrs;
-
-  findExternalValues_(pf->body(), rvs, true, true, rps, rrs);
-
-  vector<Instruction*> vs;
+  // the whole tree is analyzed here before any of it is rewritten
+  const CaptureInfo_& info = analyzeCaptures_(pf->body(), captureMap);
 
-  vector<HLIRParallelFor*> ps;
-  vector<HLIRParallelReduce*> rs;
-
-  findExternalValues_(pf->body(), vs, false, true, ps, rs);
-
-  // create the struct of all fields used recursively
+  // every level shares the struct of all fields used recursively
   if(top){
     TypeVec fields;
     size_t i = 0;
 
-    for(auto vi : rvs){
+    for(Instruction* vi : info.captures){
       fields.push_back(vi->getType()); 
-      capturedMap.emplace(vi, i++);   
+      fieldMap.emplace(vi, i++);   
     }
 
     argsType = StructType::create(c, fields, "struct.func_args");
@@ -259,60 +354,20 @@ void HLIRModule::lowerParallelFor_(HLIRParallelFor* pf,
   Value* argsStructPtr = 
     b.CreateBitCast(pf->args(), PointerType::get(argsType, 0));
 
-  // find the values that need to be remapped from the struct GEP
-  for(Instruction* vi : rvs){
-    bool local = vi->getParent()->getParent() == pf->body();
-
-    Value* ri = nullptr;
-
-    for(Use& u : vi->uses()){
-      User* user = u.getUser();
-
-      auto inst = dyn_cast<Instruction>(user);
-
-      bool found = false;
-
-      auto parent = inst->getParent()->getParent();
+  // load what this body and the bodies nested in it need from outside
+  unordered_map<Value*, Value*> loads;
 
-      if(inst){
-        if(parent == pf->body()){
-          found = true;
-        }
-        else{
-          for(auto pfi : rps){
-            if(parent == pfi->body()){
-              found = true;
-              break;
-            }
-          }
-        }
-      }
-
-      if(found && !local){
-        if(!ri){
-          Value* vr = vi;
-          for(;;){
-            auto ritr = replacedMap.find(vr);
-            if(ritr != replacedMap.end()){
-              vr = ritr->second;
-            }
-            else{
-              break;
-            }
-          }
-
-          auto itr = capturedMap.find(vr);
-          assert(itr != capturedMap.end());
-          size_t index = itr->second;
+  for(Instruction* vi : info.needs){
+    auto itr = fieldMap.find(vi);
+    assert(itr != fieldMap.end());
 
-          Value* gi = b.CreateStructGEP(argsType, argsStructPtr, index);
-          ri = b.CreateLoad(gi, vi->getName());
-        }
+    Value* gi = b.CreateStructGEP(argsType, argsStructPtr, itr->second);
+    loads.emplace(vi, b.CreateLoad(gi, vi->getName()));
+  }
 
-        user->replaceUsesOfWith(vi, ri);
-        replacedMap.emplace(ri, vi);
-      }
-    }
+  for(auto& u : info.uses){
+    Value* vi = u.first->getOperand(u.second);
+    u.first->setOperand(u.second, loads[vi]);
   }
 
   b.SetInsertPoint(marker);      
@@ -320,39 +375,55 @@ void HLIRModule::lowerParallelFor_(HLIRParallelFor* pf,
   Value* argsPtr = b.CreateAlloca(argsType);
 
   if(top){
-    for(auto& itr : capturedMap){
-      Instruction* ri = dyn_cast<Instruction>(itr.first);
-
-      if(ri && ri->getParent()->getParent() == marker->getParent()->getParent()){
-        Value* pi = b.CreateStructGEP(argsType, argsPtr, itr.second);
-        b.CreateStore(itr.first, pi);
+    for(Instruction* vi : info.captures){
+      if(vi->getParent()->getParent() == func){
+        Value* pi = b.CreateStructGEP(argsType, argsPtr, fieldMap[vi]);
+        b.CreateStore(vi, pi);
       }
     }
   }
   else{
-    for(size_t i = 0; i < rvs.size(); ++i){
-      Value* vi = rvs[i];
-
-      Value* ri = vi;
-      for(;;){
-        auto ritr = replacedMap.find(ri);
-        if(ritr != replacedMap.end()){
-          ri = ritr->second;
-        }
-        else{
-          break;
-        }
+    // store the values as seen from the parent body
+    for(Instruction* vi : info.needs){
+      Value* pv = vi;
+
+      if(vi->getParent()->getParent() != func){
+        auto itr = parentLoads->find(vi);
+        assert(itr != parentLoads->end());
+        pv = itr->second;
       }
 
-      auto itr = capturedMap.find(ri);
-      assert(itr != capturedMap.end());
-      size_t index = itr->second;
-
-      Value* pi = b.CreateStructGEP(argsType, argsPtr, index);
-      b.CreateStore(vi, pi);    
+      Value* pi = b.CreateStructGEP(argsType, argsPtr, fieldMap[vi]);
+      b.CreateStore(pv, pi);    
     }
   }
 
+  auto r = pf->range();
+  Value* start = r[0]->as<HLIRValue>();
+  Value* end = r[1]->as<HLIRValue>();
+
+  if(pf->distributed()){
+    lowerPartition_(pf, b, start, end);
+  }
+
+#if defined(USE_KOKKOS)
+  // the runtime runs the whole range as one Kokkos parallel_for and
+  // returns when it is done
+  Function* parallelForFunc =
+  getFunction("__ares_parallel_for",
+              {voidPtrTy, voidPtrTy, i32Ty, i32Ty, i32Ty});
+
+  b.CreateCall(parallelForFunc, {b.CreateBitCast(pf->body(), voidPtrTy),
+                                 b.CreateBitCast(argsPtr, voidPtrTy),
+                                 start, end, toInt32(pf->priority())});
+
+  marker->removeFromParent();
+#elif defined(USE_OPENMP)
+  lowerOMPLoop_(marker, pf->body(), b.CreateBitCast(argsPtr, voidPtrTy),
+                start, end, nullptr, true);
+
+  marker->removeFromParent();
+#else
   Function* createSynchFunc = 
     getFunction("__ares_create_synch", {i32Ty}, voidPtrTy);
 
@@ -360,15 +431,6 @@ void HLIRModule::lowerParallelFor_(HLIRParallelFor* pf,
   getFunction("__ares_queue_func",
               {voidPtrTy, voidPtrTy, voidPtrTy, i32Ty, i32Ty});
 
-  Function* awaitFunc = getFunction("__ares_await_synch", {voidPtrTy}, i1Ty);
-
-  FunctionType* ft =
-    FunctionType::get(voidTy, {voidPtrTy}, false);
-
-  auto r = pf->range();
-  Value* start = r[0]->as<HLIRValue>();
-  Value* end = r[1]->as<HLIRValue>();
-
   Value* n = b.CreateSub(end, start, "n");
 
   Value* synchPtr = b.CreateCall(createSynchFunc, {n}, "synch.ptr");
@@ -377,7 +439,10 @@ void HLIRModule::lowerParallelFor_(HLIRParallelFor* pf,
   b.CreateStore(start, indexPtr);
 
   BasicBlock* loopBlock = BasicBlock::Create(c, "pfor.queue.loop", func);
-  b.CreateBr(loopBlock);
+  BasicBlock* exitBlock = BasicBlock::Create(c, "pfor.queue.exit", func);
+
+  // a rank's block may be empty
+  b.CreateCondBr(b.CreateICmpULT(start, end), loopBlock, exitBlock);
   b.SetInsertPoint(loopBlock);
 
   Value* bodyFunc = pf->body();
@@ -389,7 +454,7 @@ void HLIRModule::lowerParallelFor_(HLIRParallelFor* pf,
   b.CreateCall(queueFunc, {synchPtr,
                            b.CreateBitCast(argsPtr, voidPtrTy),
                            b.CreateBitCast(bodyFunc, voidPtrTy),
-                           index, one});
+                           index, toInt32(pf->priority())});
 
   Value* nextIndex = b.CreateAdd(index, one);
   
@@ -397,8 +462,6 @@ void HLIRModule::lowerParallelFor_(HLIRParallelFor* pf,
   
   Value* cond = b.CreateICmpULT(nextIndex, end);
   
-  BasicBlock* exitBlock = BasicBlock::Create(c, "pfor.queue.exit", func);
-  
   b.CreateCondBr(cond, loopBlock, exitBlock);
   
   BasicBlock* blockAfter = block->splitBasicBlock(*marker, "pfor.merge");
@@ -418,6 +481,9 @@ void HLIRModule::lowerParallelFor_(HLIRParallelFor* pf,
 
   b.SetInsertPoint(yieldLoopBlock);
 
+  Function* awaitFunc = 
+    getFunction("__ares_try_await_synch", {voidPtrTy}, i1Ty);
+
   Value* done = b.CreateCall(awaitFunc, {synchPtr});
 
   cond = b.CreateICmpNE(done, ConstantInt::get(i1Ty, 0));
@@ -434,24 +500,78 @@ void HLIRModule::lowerParallelFor_(HLIRParallelFor* pf,
 
   b.SetInsertPoint(mergeBlock);
 #else
+  Function* awaitFunc = getFunction("__ares_await_synch", {voidPtrTy});
+
   b.CreateCall(awaitFunc, {synchPtr});
 #endif
 
   b.CreateBr(blockAfter);
+#endif
 
-  for(HLIRParallelFor* pf : ps){
-    lowerParallelFor_(pf, argsType, capturedMap, replacedMap);
+  for(HLIRParallelFor* pfi : info.parallelFors){
+    lowerParallelFor_(pfi, captureMap, argsType, fieldMap, &loads);
+  }
+
+  for(HLIRParallelReduce* ri : info.parallelReduces){
+    lowerParallelReduce_(ri, captureMap, &loads);
   }
 
   //pf->body()->dump();
 }
 
-void HLIRModule::lowerParallelReduce_(HLIRParallelReduce* r){
+// narrow [start, end) to this rank's block, the partitioner has the
+// signature of __ares_comm_block
+void HLIRModule::lowerPartition_(HLIRParallelFor* pf,
+                                 IRBuilder<>& b,
+                                 Value*& start,
+                                 Value*& end){
+  Function* f = b.GetInsertBlock()->getParent();
+
+  IRBuilder<> eb(&f->getEntryBlock(), f->getEntryBlock().begin());
+  Value* firstPtr = eb.CreateAlloca(i32Ty, nullptr, "first.ptr");
+  Value* lastPtr = eb.CreateAlloca(i32Ty, nullptr, "last.ptr");
+
+  Value* partitioner = pf->partitioner();
+  if(!partitioner){
+    partitioner =
+      getFunction("__ares_comm_block",
+                  {i32Ty, i32Ty, i32Ty, i32Ty,
+                   PointerType::get(i32Ty, 0), PointerType::get(i32Ty, 0)});
+  }
+
+  Value* rank =
+    b.CreateCall(getFunction("__ares_comm_rank", {}, i32Ty), {}, "rank");
+  Value* size =
+    b.CreateCall(getFunction("__ares_comm_size", {}, i32Ty), {}, "size");
+
+  b.CreateCall(partitioner, {start, end, rank, size, firstPtr, lastPtr});
+
+  start = b.CreateLoad(firstPtr, "first");
+  end = b.CreateLoad(lastPtr, "last");
+}
+
+void HLIRModule::lowerParallelReduce_(HLIRParallelReduce* r,
+                                      CaptureMap_& captureMap,
+                                      const unordered_map<Value*, Value*>* parentLoads){
   using ValueVec = vector<Value*>;
   using TypeVec = vector<llvm::Type*>;
 
   auto marker = r->get<HLIRInstruction>("marker");
 
+  // already handled as a nested case
+  if(!marker->getParent()){
+    return;
+  }
+
+  Function* parentFunc = marker->getParent()->getParent();
+
+  // this will be handled with the parallel for it is nested in, which
+  // loads the values the reduce needs from outside it
+  if(!parentLoads &&
+     parentFunc->getName().startswith("hlir.parallel_for.body")){
+    return;
+  }
+
   LLVMContext& c = module_->getContext();
   IRBuilder<> b(c);
 
@@ -695,15 +815,9 @@ void HLIRModule::lowerParallelReduce_(HLIRParallelReduce* r){
 
   TypeVec captureFields;
 
-  vector<Instruction*> v;
-  vector<Instruction*> rc;
-
-  std::vector<HLIRParallelFor*> ps;
-  std::vector<HLIRParallelReduce*> rs;
-
-  findExternalValues_(r->body(), v, true, true, ps, rs);
+  const CaptureInfo_& info = analyzeCaptures_(r->body(), captureMap);
   
-  for(Instruction* vi : v){
+  for(Instruction* vi : info.needs){
     captureFields.push_back(vi->getType());    
   }
 
@@ -715,34 +829,86 @@ void HLIRModule::lowerParallelReduce_(HLIRParallelReduce* r){
   Value* argsStructPtr = 
     b.CreateBitCast(r->args(), PointerType::get(captureArgsType, 0));
 
-  size_t j = 0;
-  for(Instruction* vi : v){
+  unordered_map<Value*, Value*> loads;
+
+  for(size_t j = 0; j < info.needs.size(); ++j){
+    Instruction* vi = info.needs[j];
     Value* gi = b.CreateStructGEP(captureArgsType, argsStructPtr, j);
-    Value* ri = b.CreateLoad(gi, vi->getName());
-    
-    for(Use& u : vi->uses()){
-      User* user = u.getUser();
-      auto inst = dyn_cast<Instruction>(user);
-      if(inst && inst->getParent()->getParent() == r->body()){
-        user->replaceUsesOfWith(vi, ri);
-      }
-    }
+    loads.emplace(vi, b.CreateLoad(gi, vi->getName()));
+  }
 
-    ++j;
+  for(auto& u : info.uses){
+    Value* vi = u.first->getOperand(u.second);
+    u.first->setOperand(u.second, loads[vi]);
   }
 
   b.SetInsertPoint(marker);
 
-  Function* parentFunc = marker->getParent()->getParent();
-
   Value* captureArgsPtr = b.CreateAlloca(captureArgsType);
 
-  for(size_t i = 0; i < v.size(); ++i){
-    Value* vi = v[i];
+  // store the values as seen from the parent body
+  for(size_t i = 0; i < info.needs.size(); ++i){
+    Value* pv = info.needs[i];
+
+    if(info.needs[i]->getParent()->getParent() != parentFunc){
+      assert(parentLoads);
+      auto itr = parentLoads->find(pv);
+      assert(itr != parentLoads->end());
+      pv = itr->second;
+    }
+
     Value* pi = b.CreateStructGEP(captureArgsType, captureArgsPtr, i);
-    b.CreateStore(vi, pi);    
+    b.CreateStore(pv, pi);    
+  }
+
+#if defined(USE_KOKKOS)
+  // Kokkos combines the per-thread values itself so the worker function
+  // built above is not needed
+  func->eraseFromParent();
+
+  string typeSuffix;
+  if(rt->isFloatTy()){
+    typeSuffix = "f32";
+  }
+  else if(rt->isDoubleTy()){
+    typeSuffix = "f64";
+  }
+  else if(rt->isIntegerTy(64)){
+    typeSuffix = "i64";
+  }
+  else{
+    assert(rt->isIntegerTy(32) && "unsupported reduce type");
+    typeSuffix = "i32";
   }
 
+  Function* parallelReduceFunc =
+  getFunction("__ares_parallel_reduce_" + typeSuffix,
+              {voidPtrTy, voidPtrTy, i32Ty, i32Ty, i32Ty, voidPtrTy, i32Ty});
+
+  auto range = r->range();
+  start = toInt32(range[0]->as<HLIRInteger>());
+  end = toInt32(range[1]->as<HLIRInteger>());
+
+  b.CreateCall(parallelReduceFunc,
+               {b.CreateBitCast(r->body(), voidPtrTy),
+                b.CreateBitCast(captureArgsPtr, voidPtrTy),
+                start, end, ConstantInt::get(i32Ty, r->sum() ? 1 : 0),
+                b.CreateBitCast(r->reduceResult(), voidPtrTy),
+                toInt32(r->priority())});
+
+  marker->removeFromParent();
+#elif defined(USE_OPENMP)
+  func->eraseFromParent();
+
+  auto range = r->range();
+  start = toInt32(range[0]->as<HLIRInteger>());
+  end = toInt32(range[1]->as<HLIRInteger>());
+
+  lowerOMPLoop_(marker, r->body(), b.CreateBitCast(captureArgsPtr, voidPtrTy),
+                start, end, r->reduceResult(), r->sum());
+
+  marker->removeFromParent();
+#else
   Function* createSynchFunc = 
     getFunction("__ares_create_synch", {i32Ty}, voidPtrTy);
 
@@ -813,7 +979,7 @@ void HLIRModule::lowerParallelReduce_(HLIRParallelReduce* r){
   b.CreateCall(queueFunc, {synchPtr,
                            b.CreateBitCast(reduceArgs, voidPtrTy),
                            b.CreateBitCast(func, voidPtrTy),
-                           index, one});
+                           index, toInt32(r->priority())});
 
   Value* nextIndex = b.CreateAdd(index, one, "next.index");
   
@@ -835,7 +1001,7 @@ void HLIRModule::lowerParallelReduce_(HLIRParallelReduce* r){
   
   b.SetInsertPoint(exitBlock);
 
-  Function* awaitFunc = getFunction("__ares_await_synch", {voidPtrTy}, i1Ty);
+  Function* awaitFunc = getFunction("__ares_await_synch", {voidPtrTy});
 
   b.CreateCall(awaitFunc, {synchPtr});
   
@@ -844,157 +1010,778 @@ void HLIRModule::lowerParallelReduce_(HLIRParallelReduce* r){
   b.CreateCall(freeFunc, {partialSumsVoidPtr});
 
   b.CreateBr(blockAfter);
+#endif
 
 //  func->getParent()->dump();
 }
 
-void HLIRModule::lowerTask_(HLIRTask* task){
-  auto& b = builder();
-  auto& c = context();
+void HLIRModule::lowerOMPLoop_(Instruction* marker,
+                               Function* body,
+                               Value* args,
+                               Value* start,
+                               Value* end,
+                               Value* result,
+                               bool sum){
+  using TypeVec = vector<llvm::Type*>;
+
+  LLVMContext& c = module_->getContext();
+  IRBuilder<> b(c);
+
+  // a reduce passes the result pointer and gets a private value per
+  // thread, a parallel for only passes its args
+  Type* rt = result ? result->getType()->getPointerElementType() : nullptr;
+
+  TypeVec fields = {voidPtrTy, i32Ty, i32Ty};
+  if(rt){
+    fields.push_back(PointerType::get(rt, 0));
+  }
+
+  StructType* dataType = StructType::create(c, fields, "struct.omp_data");
+
+  Value* initVal = nullptr;
+  if(rt){
+    if(rt->isFloatingPointTy()){
+      initVal = ConstantFP::get(rt, sum ? 0.0 : 1.0);
+    }
+    else{
+      initVal = ConstantInt::get(rt, sum ? 0 : 1);
+    }
+  }
+
+  // =================== outlined function run by each OpenMP thread
+
+  auto ft = FunctionType::get(voidTy, {voidPtrTy}, false);
+
+  Function* func =
+    Function::Create(ft,
+                     llvm::Function::InternalLinkage,
+                     rt ? "preduce.omp" : "pfor.omp",
+                     module_);
+
+  auto aitr = func->arg_begin();
+  aitr->setName("data.ptr");
+  Value* dataVoidPtr = aitr;
+
+  BasicBlock* entryBlock = BasicBlock::Create(c, "entry", func);
+  b.SetInsertPoint(entryBlock);
+
+  Value* dataPtr = 
+    b.CreateBitCast(dataVoidPtr, PointerType::get(dataType, 0));
+
+  Value* bodyArgs = b.CreateLoad(b.CreateStructGEP(dataType, dataPtr, 0));
+
+  Value* loopStart = b.CreateLoad(b.CreateStructGEP(dataType, dataPtr, 1));
+  loopStart = b.CreateZExt(loopStart, i64Ty, "start");
+
+  Value* loopEnd = b.CreateLoad(b.CreateStructGEP(dataType, dataPtr, 2));
+  loopEnd = b.CreateZExt(loopEnd, i64Ty, "end");
+
+  Type* i64PtrTy = PointerType::get(i64Ty, 0);
+
+  Value* istartPtr = b.CreateAlloca(i64Ty, nullptr, "istart.ptr");
+  Value* iendPtr = b.CreateAlloca(i64Ty, nullptr, "iend.ptr");
+  Value* iPtr = b.CreateAlloca(i64Ty, nullptr, "i.ptr");
+
+  TypeVec startParams = {i64Ty, i64Ty, i64Ty, i64Ty, i64PtrTy, i64PtrTy};
+  TypeVec nextParams = {i64PtrTy, i64PtrTy};
+
+  Value* zero = ConstantInt::get(i64Ty, 0);
+  Value* one = ConstantInt::get(i64Ty, 1);
+
+  Function* startFunc;
+  Function* nextFunc;
+  Value* chunk;
+  Value* bodyFunc;
+  Value* accPtr = nullptr;
+  Value* funcArgPtr = nullptr;
+
+  if(rt){
+    // reduce bodies are uniform, each thread takes one contiguous block
+    startFunc = getFunction("GOMP_loop_static_start", startParams, i1Ty);
+    nextFunc = getFunction("GOMP_loop_static_next", nextParams, i1Ty);
+    chunk = zero;
+
+    auto bft = 
+      FunctionType::get(voidTy, {voidPtrTy, PointerType::get(rt, 0), i32Ty},
+                        false);
+    bodyFunc = b.CreateBitCast(body, PointerType::get(bft, 0));
+
+    accPtr = b.CreateAlloca(rt, nullptr, "acc.ptr");
+    b.CreateStore(initVal, accPtr);
+  }
+  else{
+    // parallel for bodies may vary in cost, hand out chunks of about an
+    // eighth of each thread's share
+    startFunc = getFunction("GOMP_loop_dynamic_start", startParams, i1Ty);
+    nextFunc = getFunction("GOMP_loop_dynamic_next", nextParams, i1Ty);
+
+    Function* numThreadsFunc = getFunction("omp_get_num_threads", {}, i32Ty);
+    Value* numThreads = b.CreateZExt(b.CreateCall(numThreadsFunc), i64Ty);
+
+    chunk = b.CreateUDiv(b.CreateSub(loopEnd, loopStart),
+                         b.CreateMul(numThreads, ConstantInt::get(i64Ty, 8)));
+    chunk = b.CreateSelect(b.CreateICmpEQ(chunk, zero), one, chunk, "chunk");
+
+    bodyFunc = b.CreateBitCast(body, PointerType::get(ft, 0));
+
+    // the body takes its index from a FuncArg as when queued, GOMP_parallel
+    // is the join so it has no synch
+    StructType* funcArgType = 
+      StructType::create(c, {voidPtrTy, i32Ty, voidPtrTy}, "struct.func_arg");
+
+    funcArgPtr = b.CreateAlloca(funcArgType, nullptr, "func.arg");
+
+    b.CreateStore(ConstantPointerNull::get(voidPtrTy),
+                  b.CreateStructGEP(funcArgType, funcArgPtr, 0));
+    
+    b.CreateStore(bodyArgs, b.CreateStructGEP(funcArgType, funcArgPtr, 2));
+  }
+
+  Value* more = 
+    b.CreateCall(startFunc, {loopStart, loopEnd, one, chunk,
+                             istartPtr, iendPtr});
+
+  BasicBlock* chunkBlock = BasicBlock::Create(c, "chunk.block", func);
+  BasicBlock* loopBlock = BasicBlock::Create(c, "loop.block", func);
+  BasicBlock* nextBlock = BasicBlock::Create(c, "next.block", func);
+  BasicBlock* exitBlock = BasicBlock::Create(c, "exit.block", func);
+
+  b.CreateCondBr(more, chunkBlock, exitBlock);
+
+  b.SetInsertPoint(chunkBlock);
+
+  b.CreateStore(b.CreateLoad(istartPtr), iPtr);
+  b.CreateBr(loopBlock);
+
+  b.SetInsertPoint(loopBlock);
+
+  Value* i = b.CreateLoad(iPtr);
+  Value* index = b.CreateTrunc(i, i32Ty, "index");
+
+  if(rt){
+    b.CreateCall(bodyFunc, {bodyArgs, accPtr, index});
+  }
+  else{
+    b.CreateStore(index, b.CreateStructGEP(nullptr, funcArgPtr, 1));
+    b.CreateCall(bodyFunc, {b.CreateBitCast(funcArgPtr, voidPtrTy)});
+  }
+
+  Value* nextIndex = b.CreateAdd(i, one);
+  b.CreateStore(nextIndex, iPtr);
+
+  Value* cond = b.CreateICmpULT(nextIndex, b.CreateLoad(iendPtr));
+  b.CreateCondBr(cond, loopBlock, nextBlock);
+
+  b.SetInsertPoint(nextBlock);
+
+  more = b.CreateCall(nextFunc, {istartPtr, iendPtr});
+  b.CreateCondBr(more, chunkBlock, exitBlock);
+
+  b.SetInsertPoint(exitBlock);
+
+  Function* endFunc = getFunction("GOMP_loop_end_nowait", {});
+  b.CreateCall(endFunc);
+
+  if(rt){
+    Function* criticalStartFunc = getFunction("GOMP_critical_start", {});
+    Function* criticalEndFunc = getFunction("GOMP_critical_end", {});
+
+    Value* resultPtr = b.CreateLoad(b.CreateStructGEP(dataType, dataPtr, 3));
+
+    b.CreateCall(criticalStartFunc);
+
+    Value* v1 = b.CreateLoad(resultPtr);
+    Value* v2 = b.CreateLoad(accPtr);
+    Value* va;
+
+    if(rt->isFloatingPointTy()){
+      va = sum ? b.CreateFAdd(v1, v2) : b.CreateFMul(v1, v2);
+    }
+    else{
+      va = sum ? b.CreateAdd(v1, v2) : b.CreateMul(v1, v2);
+    }
+
+    b.CreateStore(va, resultPtr);
+
+    b.CreateCall(criticalEndFunc);
+  }
+
+  b.CreateRetVoid();
+
+  // =================== fork / join at the marker
+
+  b.SetInsertPoint(marker);
+
+  Value* data = b.CreateAlloca(dataType, nullptr, "omp.data");
+
+  b.CreateStore(args, b.CreateStructGEP(dataType, data, 0));
+  b.CreateStore(start, b.CreateStructGEP(dataType, data, 1));
+  b.CreateStore(end, b.CreateStructGEP(dataType, data, 2));
+
+  if(rt){
+    b.CreateStore(initVal, result);
+    b.CreateStore(result, b.CreateStructGEP(dataType, data, 3));
+  }
+
+  // 0 threads is the OpenMP default team size
+  Function* parallelFunc = 
+    getFunction("GOMP_parallel",
+                {PointerType::get(ft, 0), voidPtrTy, i32Ty, i32Ty});
+
+  b.CreateCall(parallelFunc, {func,
+                              b.CreateBitCast(data, voidPtrTy),
+                              ConstantInt::get(i32Ty, 0),
+                              ConstantInt::get(i32Ty, 0)});
+}
+
+Value* HLIRModule::getTaskGroup_(Function* f){
+  auto itr = taskGroupMap_.find(f);
+  if(itr != taskGroupMap_.end()){
+    return itr->second;
+  }
+
+  IRBuilder<> b(context_);
+
+  b.SetInsertPoint(&*f->getEntryBlock().getFirstInsertionPt());
+
+  Function* createFunc = getFunction("__ares_create_task_group", {}, voidPtrTy);
+
+  Value* group = b.CreateCall(createFunc, {}, "task.group");
+
+  taskGroupMap_.emplace(f, group);
+
+  // every task spawned into the group is joined before the spawning
+  // function returns
+  Function* awaitFunc = getFunction("__ares_task_group_await", {voidPtrTy});
+  Function* deleteFunc = getFunction("__ares_delete_task_group", {voidPtrTy});
+
+  for(BasicBlock& bi : *f){
+    if(auto ri = dyn_cast<ReturnInst>(bi.getTerminator())){
+      b.SetInsertPoint(ri);
+      b.CreateCall(awaitFunc, {group});
+      b.CreateCall(deleteFunc, {group});
+    }
+  }
+
+  return group;
+}
+
+void HLIRModule::joinTaskGroup_(CallInst* ci, Value* group){
+  Function* parentFunc = ci->getParent()->getParent();
 
   DataLayout layout(module_);
+  DominatorTree dt(*parentFunc);
+
+  // find the instructions in the spawning function which touch the memory
+  // the task was handed, following pointer arithmetic and casts
+  vector<Value*> worklist;
+  unordered_set<Value*> visited;
+
+  for(auto& arg : ci->arg_operands()){
+    if(arg->getType()->isPointerTy()){
+      Value* object = GetUnderlyingObject(arg, layout);
+      if(visited.insert(object).second){
+        worklist.push_back(object);
+      }
+    }
+  }
 
-  Function* func = task->function();
-  Function* wrapperFunc = task->wrapperFunction();
+  // a later spawn handed the same memory is an access, including ci
+  // itself when it is spawned again on a later loop iteration
+  vector<Instruction*> accesses;
+  unordered_set<Instruction*> accessed;
 
-  for(auto itr = func->use_begin(), itrEnd = func->use_end();
-    itr != itrEnd; ++itr){
-    if(CallInst* ci = dyn_cast<CallInst>(itr->getUser())){
-      BasicBlock* parentBlock = ci->getParent();
-      Function* parentFunc = parentBlock->getParent();
-      
-      if(parentFunc == wrapperFunc){
+  while(!worklist.empty()){
+    Value* v = worklist.back();
+    worklist.pop_back();
+
+    for(User* u : v->users()){
+      auto inst = dyn_cast<Instruction>(u);
+      if(!inst || inst->getParent()->getParent() != parentFunc){
         continue;
       }
 
-      b.SetInsertPoint(ci);
+      if(isa<BitCastInst>(inst) || isa<GetElementPtrInst>(inst) ||
+         isa<PHINode>(inst) || isa<SelectInst>(inst) ||
+         isa<AddrSpaceCastInst>(inst)){
+        if(visited.insert(inst).second){
+          worklist.push_back(inst);
+        }
+        continue;
+      }
 
-      TypeVec fields;
-      fields.push_back(voidPtrTy);
-      fields.push_back(i32Ty);
-      fields.push_back(func->getReturnType());
+      if(auto si = dyn_cast<StoreInst>(inst)){
+        // storing the pointer itself does not touch the memory
+        if(si->getPointerOperand() != v){
+          continue;
+        }
+      }
 
-      for(auto pitr = func->arg_begin(), pitrEnd = func->arg_end();
-        pitr != pitrEnd; ++pitr){
-        fields.push_back(pitr->getType());
+      if(accessed.insert(inst).second){
+        accesses.push_back(inst);
       }
+    }
+  }
+
+  Function* awaitFunc = getFunction("__ares_task_group_await", {voidPtrTy});
 
-      StructType* argsType = StructType::create(c, fields, "struct.func_args");
+  IRBuilder<> b(context_);
+
+  for(Instruction* i : accesses){
+    bool reachable;
+    if(i == ci){
+      // ci reaches itself only around a loop
+      reachable = false;
+      for(BasicBlock* s : successors(ci->getParent())){
+        if(isPotentiallyReachable(&s->front(), ci, &dt)){
+          reachable = true;
+          break;
+        }
+      }
+    }
+    else{
+      reachable = isPotentiallyReachable(ci, i, &dt);
+    }
 
-      size_t size = layout.getTypeAllocSize(argsType);
+    if(!reachable){
+      continue;
+    }
 
-      Function* allocFunc = getFunction("__ares_alloc", {i64Ty}, voidPtrTy);
+    // an earlier spawn may already have joined the group here
+    if(auto prev = dyn_cast_or_null<CallInst>(i->getPrevNode())){
+      if(prev->getCalledFunction() == awaitFunc &&
+         prev->getArgOperand(0) == group){
+        continue;
+      }
+    }
 
-      ValueVec args = {ConstantInt::get(i64Ty, size)};
+    b.SetInsertPoint(i);
+    b.CreateCall(awaitFunc, {group});
+  }
+}
 
-      Value* argsVoidPtr = b.CreateCall(allocFunc, args, "args.void.ptr");
+vector<CallInst*> HLIRModule::taskSpawns_(HLIRTask* task){
+  Function* func = task->function();
+  Function* wrapperFunc = task->wrapperFunction();
 
-      Value* argsPtr = 
-        b.CreateBitCast(argsVoidPtr, PointerType::get(argsType, 0), "args.ptr");
+  vector<CallInst*> calls;
 
-      Value* depth = b.CreateStructGEP(nullptr, argsPtr, 1, "depth.ptr");
-      depth = b.CreateLoad(depth, "depth");
+  for(User* u : func->users()){
+    if(CallInst* ci = dyn_cast<CallInst>(u)){
+      if(ci->getParent()->getParent() != wrapperFunc){
+        calls.push_back(ci);
+      }
+    }
+  }
 
-      size_t idx = 3;
-      for(auto& arg : ci->arg_operands()){
-        Value* argPtr = b.CreateStructGEP(nullptr, argsPtr, idx, "arg.ptr");
+  return calls;
+}
+
+void HLIRModule::lowerTask_(HLIRTask* task){
+  auto& b = builder();
+  auto& c = context();
+
+  DataLayout layout(module_);
+
+  Function* func = task->function();
+  Function* wrapperFunc = task->wrapperFunction();
+
+  StructType* argsType = cast<StructType>(task->argsType().val());
+  size_t size = layout.getTypeAllocSize(argsType);
+
+  vector<CallInst*> calls = taskSpawns_(task);
+
+  Function* allocFunc = getFunction("__ares_alloc", {i64Ty}, voidPtrTy);
+
+  for(CallInst* ci : calls){
+    BasicBlock* parentBlock = ci->getParent();
+    Function* parentFunc = parentBlock->getParent();
+
+    b.SetInsertPoint(ci);
+
+    ValueVec args = {ConstantInt::get(i64Ty, size)};
+
+    Value* argsVoidPtr = b.CreateCall(allocFunc, args, "args.void.ptr");
+
+    Value* argsPtr = 
+      b.CreateBitCast(argsVoidPtr, PointerType::get(argsType, 0), "args.ptr");
+
+    size_t idx = task->paramIndex();
+    auto pitr = func->arg_begin();
+    for(auto& arg : ci->arg_operands()){
+      Value* argPtr = b.CreateStructGEP(argsType, argsPtr, idx, "arg.ptr");
+
+      // the task may run after the caller changes its variable
+      if(pitr->hasByValAttr()){
+        Type* t = pitr->getType()->getPointerElementType();
+        b.CreateMemCpy(argPtr, arg, layout.getTypeAllocSize(t),
+                       pitr->getParamAlignment());
+      }
+      else{
         b.CreateStore(arg, argPtr);
-        ++idx;
       }
 
-      Function* queueFunc = 
-        getFunction("__ares_task_queue", {voidPtrTy, voidPtrTy});
+      ++pitr;
+      ++idx;
+    }
+
+    Value* funcVoidPtr = b.CreateBitCast(wrapperFunc, voidPtrTy, "funcVoidPtr");
 
-      Value* funcVoidPtr = b.CreateBitCast(wrapperFunc, voidPtrTy, "funcVoidPtr");
+    Value* priority = toInt32(task->priority());
+
+    // void tasks and tasks whose result is discarded are fire-and-join:
+    // the runtime frees their args when they finish
+    if(task->grouped() || ci->use_empty()){
+      Value* group = getTaskGroup_(parentFunc);
+
+      Function* queueFunc = 
+        getFunction("__ares_task_group_queue",
+                    {voidPtrTy, voidPtrTy, voidPtrTy, i32Ty});
 
-      args = {funcVoidPtr, argsVoidPtr};
+      b.SetInsertPoint(ci);
+      args = {group, funcVoidPtr, argsVoidPtr, priority};
       b.CreateCall(queueFunc, args);
 
-      for(auto itr = ci->use_begin(), itrEnd = ci->use_end();
-        itr != itrEnd; ++itr){
+      ci->eraseFromParent();
+      continue;
+    }
+
+    Function* queueFunc = 
+      getFunction("__ares_task_queue", {voidPtrTy, voidPtrTy, i32Ty});
 
-        if(Instruction* i = dyn_cast<Instruction>(itr->getUser())){
-          b.SetInsertPoint(i);
+    args = {funcVoidPtr, argsVoidPtr, priority};
+    b.CreateCall(queueFunc, args);
 
-          BasicBlock* splitBlock = i->getParent();
-          BasicBlock* splitAfter = splitBlock->splitBasicBlock(i, "split.after");
+    for(auto itr = ci->use_begin(), itrEnd = ci->use_end();
+      itr != itrEnd; ++itr){
 
-          splitBlock->getTerminator()->removeFromParent();
+      if(Instruction* i = dyn_cast<Instruction>(itr->getUser())){
+        b.SetInsertPoint(i);
 
-          b.SetInsertPoint(splitBlock);
+        BasicBlock* splitBlock = i->getParent();
+        BasicBlock* splitAfter = splitBlock->splitBasicBlock(i, "split.after");
+
+        splitBlock->getTerminator()->removeFromParent();
+
+        b.SetInsertPoint(splitBlock);
 
 #ifdef USE_ARGOBOTS
 
-          BasicBlock* loopBlock = BasicBlock::Create(c, "loop.block", parentFunc);
+        BasicBlock* loopBlock = BasicBlock::Create(c, "loop.block", parentFunc);
 
-          b.CreateBr(loopBlock);
+        b.CreateBr(loopBlock);
 
-          BasicBlock* mergeBlock = BasicBlock::Create(c, "merge.block", parentFunc);
-          BasicBlock* yieldBlock = BasicBlock::Create(c, "yield.block", parentFunc);
-          
-          b.SetInsertPoint(loopBlock);
+        BasicBlock* mergeBlock = BasicBlock::Create(c, "merge.block", parentFunc);
+        BasicBlock* yieldBlock = BasicBlock::Create(c, "yield.block", parentFunc);
+        
+        b.SetInsertPoint(loopBlock);
 
-          Function* awaitFunc = 
-            getFunction("__ares_task_try_await_future", {voidPtrTy}, i1Ty);
+        Function* awaitFunc = 
+          getFunction("__ares_task_try_await_future", {voidPtrTy}, i1Ty);
 
-          args = {argsVoidPtr};
-          Value* done = b.CreateCall(awaitFunc, args);
+        args = {argsVoidPtr};
+        Value* done = b.CreateCall(awaitFunc, args);
 
-          Value* cond = b.CreateICmpNE(done, ConstantInt::get(i1Ty, 0));
+        Value* cond = b.CreateICmpNE(done, ConstantInt::get(i1Ty, 0));
 
-          b.CreateCondBr(cond, mergeBlock, yieldBlock);
+        b.CreateCondBr(cond, mergeBlock, yieldBlock);
 
-          b.SetInsertPoint(yieldBlock);
+        b.SetInsertPoint(yieldBlock);
 
-          Function* yieldFunc = getFunction("__ares_thread_yield", TypeVec());
-            
-          b.CreateCall(yieldFunc);
+        Function* yieldFunc = getFunction("__ares_thread_yield", TypeVec());
+          
+        b.CreateCall(yieldFunc);
 
-          b.CreateBr(loopBlock);
+        b.CreateBr(loopBlock);
 
-          b.SetInsertPoint(mergeBlock);
+        b.SetInsertPoint(mergeBlock);
 #else
-          Function* awaitFunc = 
-            getFunction("__ares_task_await_future", {voidPtrTy});
+        Function* awaitFunc = 
+          getFunction("__ares_task_await_future", {voidPtrTy});
 
-          args = {argsVoidPtr};
-          b.CreateCall(awaitFunc, args);
+        args = {argsVoidPtr};
+        b.CreateCall(awaitFunc, args);
 #endif
-          Value* retPtr = b.CreateStructGEP(nullptr, argsPtr, 2, "retPtr");
-          Value* retVal = b.CreateLoad(retPtr, "retVal"); 
+        Value* retPtr = b.CreateStructGEP(argsType, argsPtr, 2, "retPtr");
+        Value* retVal = b.CreateLoad(retPtr, "retVal"); 
 
-          ci->replaceAllUsesWith(retVal);
+        Function* freeFunc = 
+          getFunction("__ares_task_free_future", {voidPtrTy});
 
-          b.CreateBr(splitAfter);
-          b.SetInsertPoint(splitAfter);
+        args = {argsVoidPtr};
+        b.CreateCall(freeFunc, args);
 
-          break;
-        }
+        ci->replaceAllUsesWith(retVal);
+
+        b.CreateBr(splitAfter);
+        b.SetInsertPoint(splitAfter);
+
+        break;
+      }
+    }
+
+    ci->eraseFromParent();
+
+    //parentFunc->dump();
+  }
+
+  // byval parameters would be copied again by the call in the wrapper,
+  // the copy in the args struct is already private to the task so pass
+  // it by pointer when no other caller can observe the ABI change
+  if(func->hasLocalLinkage() && !func->hasAddressTaken()){
+    for(Argument& arg : func->args()){
+      if(arg.hasByValAttr()){
+        unsigned i = arg.getArgNo() + 1;
+        arg.removeAttr(AttributeSet::get(c, i, Attribute::ByVal));
       }
+    }
+  }
+}
 
-      ci->eraseFromParent();
+// the rank and data of i if it is a send, or a receive when !send,
+// lowered or not
+bool HLIRModule::messageOperands_(Instruction* i,
+                                  bool send,
+                                  Value*& rank,
+                                  Value*& data){
+  StringRef name = calleeName(i);
+
+  if(name == (send ? "__ares_isend" : "__ares_irecv")){
+    CallInst* ci = cast<CallInst>(i);
+    rank = ci->getArgOperand(0);
+    data = ci->getArgOperand(1);
+    return true;
+  }
+
+  // lowered markers are erased, so check the callee before the map
+  if(name != (send ? "hlir.send" : "hlir.receive")){
+    return false;
+  }
+
+  auto itr = constructMap_.find(i);
+  if(itr == constructMap_.end()){
+    return false;
+  }
 
-      //parentFunc->dump();
-    }    
+  if(auto s = itr->second->tryAs<HLIRSend>()){
+    rank = s->rank();
+    data = s->buffer().data();
+    return true;
   }
+  else if(auto r = itr->second->tryAs<HLIRReceive>()){
+    rank = r->rank();
+    data = r->buffer().data();
+    return true;
+  }
+
+  return false;
+}
+
+// the send or receive is hoisted above instructions that cannot affect
+// its buffer or operands and, without a future, waited on just before
+// the first later instruction that could observe it, both within the
+// marker's block
+void HLIRModule::lowerMessage_(HLIRConstruct* c,
+                               bool send,
+                               const HLIRBuffer& buffer,
+                               Value* rank,
+                               HLIRFuture* future){
+  auto& b = builder();
+
+  Instruction* marker = c->marker();
+  Function* f = marker->getParent()->getParent();
+
+  Value* data = buffer.data();
+  Value* size = buffer.size();
+
+  DataLayout layout(module_);
+
+  // the communicator matches messages per peer in the order they were
+  // posted, so another message of the same kind is only passed when it
+  // is to or from another constant rank and its buffer is distinct
+  auto independent = [&](Instruction* i){
+    Value* otherRank;
+    Value* otherData;
+    if(!messageOperands_(i, send, otherRank, otherData)){
+      return false;
+    }
+
+    auto r1 = dyn_cast<ConstantInt>(rank);
+    auto r2 = dyn_cast<ConstantInt>(otherRank);
+    if(!r1 || !r2 || r1->getSExtValue() == r2->getSExtValue()){
+      return false;
+    }
+
+    Value* o1 = GetUnderlyingObject(data, layout);
+    Value* o2 = GetUnderlyingObject(otherData, layout);
+    return o1 != o2 && isIdentifiedObject(o1) && isIdentifiedObject(o2);
+  };
+
+  // a send only needs its buffer to be final, a receive must not be
+  // posted before anything that reads or writes memory
+  auto touches = [&](Instruction* i){
+    if(independent(i)){
+      return false;
+    }
+
+    return send ? i->mayWriteToMemory() : i->mayReadOrWriteMemory();
+  };
+
+  Instruction* start = marker;
+  while(start != &start->getParent()->front()){
+    Instruction* prev = start->getPrevNode();
+    if(prev == data || prev == size || prev == rank || 
+       isa<PHINode>(prev) || touches(prev)){
+      break;
+    }
+    start = prev;
+  }
+
+  b.SetInsertPoint(start);
+
+  Function* messageFunc = 
+    getFunction(send ? "__ares_isend" : "__ares_irecv",
+                {i32Ty, voidPtrTy, i64Ty}, voidPtrTy);
+
+  ValueVec args = 
+    {b.CreateSExtOrTrunc(rank, i32Ty),
+     b.CreateBitCast(data, voidPtrTy),
+     b.CreateZExtOrTrunc(size, i64Ty)};
+
+  Value* request = b.CreateCall(messageFunc, args, "request");
+
+  if(future && future->awaited()){
+    b.CreateStore(request, getFutureSlot_(future, f));
+  }
+  else{
+    // waiting later on another request is harmless
+    Instruction* end = marker->getNextNode();
+    while(!isa<TerminatorInst>(end)){
+      if(touches(end) && calleeName(end) != "__ares_wait"){
+        break;
+      }
+      end = end->getNextNode();
+    }
+
+    b.SetInsertPoint(end);
+
+    Function* waitFunc = getFunction("__ares_wait", {voidPtrTy}, i64Ty);
+    b.CreateCall(waitFunc, {request});
+  }
+
+  marker->eraseFromParent();
+}
+
+void HLIRModule::lowerBarrier_(HLIRBarrier* barrier){
+  auto& b = builder();
+
+  Instruction* marker = barrier->marker();
+  b.SetInsertPoint(marker);
+
+  Function* barrierFunc = getFunction("__ares_comm_barrier", TypeVec());
+  b.CreateCall(barrierFunc);
+
+  marker->eraseFromParent();
+}
+
+void HLIRModule::lowerAwait_(HLIRFuture* future){
+  auto& b = builder();
+
+  Instruction* marker = future->marker();
+  Function* f = marker->getParent()->getParent();
+
+  b.SetInsertPoint(marker);
+
+  Value* request = b.CreateLoad(getFutureSlot_(future, f), "request");
+
+  Function* waitFunc = getFunction("__ares_wait", {voidPtrTy}, i64Ty);
+  b.CreateCall(waitFunc, {request});
+
+  marker->eraseFromParent();
+}
+
+// the request of a future is kept in a stack slot of the function it is
+// started and awaited in so the two need not be in the same block
+Value* HLIRModule::getFutureSlot_(HLIRFuture* future, Function* f){
+  auto itr = futureSlotMap_.find(future);
+  if(itr != futureSlotMap_.end()){
+    Value* slot = itr->second;
+    assert(cast<Instruction>(slot)->getParent()->getParent() == f &&
+           "future awaited outside of the function it was started in");
+    return slot;
+  }
+
+  IRBuilder<> eb(&f->getEntryBlock(), f->getEntryBlock().begin());
+  Value* slot = eb.CreateAlloca(voidPtrTy, nullptr, "future.request");
+
+  futureSlotMap_[future] = slot;
+  return slot;
 }
 
 bool HLIRModule::lowerToIR_(){
-  for(auto& itr : constructMap_){
-    HLIRConstruct* c = itr.second;
-    if(auto pfor = dynamic_cast<HLIRParallelFor*>(c)){
-      unordered_map<Value*, size_t> m;
-      unordered_map<Value*, Value*> rm;
-      lowerParallelFor_(pfor, nullptr, m, rm);
+  HLIRArena::Scope scope(&arena_);
+
+  // communication first, its markers may be inside loop bodies that the
+  // parallel constructs outline. each kind is lowered in program order so
+  // the generated types, functions and blocks are numbered the same way
+  // on every compile
+  vector<HLIRConstruct*> parallel;
+  vector<HLIRFuture*> futures;
+
+  for(HLIRConstruct* c : orderedConstructs_()){
+    if(auto s = c->tryAs<HLIRSend>()){
+      lowerMessage_(s, true, s->buffer(), s->rank(), s->future());
+    }
+    else if(auto r = c->tryAs<HLIRReceive>()){
+      lowerMessage_(r, false, r->buffer(), r->rank(), r->future());
+    }
+    else if(auto b = c->tryAs<HLIRBarrier>()){
+      lowerBarrier_(b);
     }
-    else if(auto r = dynamic_cast<HLIRParallelReduce*>(c)){
-      lowerParallelReduce_(r);
+    else if(auto f = c->tryAs<HLIRFuture>()){
+      futures.push_back(f);
+    }
+    else{
+      parallel.push_back(c);
+    }
+  }
+
+  for(HLIRFuture* f : futures){
+    lowerAwait_(f);
+  }
+
+  // the lowered markers are gone, new calls could reuse their addresses
+  constructMap_.clear();
+  for(HLIRConstruct* c : parallel){
+    constructMap_.emplace(c->marker(), c);
+  }
+
+  for(HLIRConstruct* c : parallel){
+    if(auto pfor = c->tryAs<HLIRParallelFor>()){
+      CaptureMap_ captureMap;
+      unordered_map<Value*, size_t> fieldMap;
+      lowerParallelFor_(pfor, captureMap, nullptr, fieldMap, nullptr);
+    }
+    else if(auto r = c->tryAs<HLIRParallelReduce>()){
+      CaptureMap_ captureMap;
+      lowerParallelReduce_(r, captureMap, nullptr);
     }
     else{
       assert(false && "unknown HLIR construct");
     }
   }
 
+  // join the task groups while every spawn is still a call to its task
+  // function, so that a later spawn is seen as an access to the memory
+  // an earlier one was handed
+  for(HLIRTask* t : tasks_){
+    for(CallInst* ci : taskSpawns_(t)){
+      if(t->grouped() || ci->use_empty()){
+        joinTaskGroup_(ci, getTaskGroup_(ci->getParent()->getParent()));
+      }
+    }
+  }
+
   for(HLIRTask* t : tasks_){
     lowerTask_(t);
   }
@@ -1006,7 +1793,7 @@ bool HLIRModule::lowerToIR_(){
 }
 
 HLIRParallelFor::HLIRParallelFor(HLIRModule* module)
-  : HLIRConstruct(module){
+  : HLIRConstruct(module, ParallelForKind){
 
   auto& b = module_->builder();
   auto& c = module_->context();
@@ -1061,6 +1848,9 @@ HLIRParallelFor::HLIRParallelFor(HLIRModule* module)
   (*this)["args"] = HLIRValue(funcArgsPtr);
   (*this)["argsInsertion"] = HLIRInstruction(placeholder); 
   (*this)["exitBlock"] = HLIRBasicBlock(exitBlock); 
+  (*this)["priority"] = HLIRInteger(1);
+  (*this)["distributed"] = HLIRBoolean(false);
+  (*this)["partitioner"] = HLIRValue::nullValue();
 
   HLIRFunction f(func);
   (*this)["body"] = f;  
@@ -1072,7 +1862,7 @@ HLIRFunction& HLIRParallelFor::body(){
 
 HLIRParallelReduce::HLIRParallelReduce(HLIRModule* module,
   const HLIRType& reduceType)
-  : HLIRConstruct(module){
+  : HLIRConstruct(module, ParallelReduceKind){
 
   auto& b = module_->builder();
   auto& c = module_->context();
@@ -1117,6 +1907,7 @@ HLIRParallelReduce::HLIRParallelReduce(HLIRModule* module,
   (*this)["argsInsertion"] = HLIRInstruction(argsPlaceholder); 
   (*this)["reduceVar"] = HLIRValue(partial);
   (*this)["reduceType"] = reduceType;
+  (*this)["priority"] = HLIRInteger(1);
 
   HLIRFunction f(func);
   (*this)["body"] = f;  
@@ -1132,6 +1923,11 @@ void HLIRTask::setFunction(const HLIRFunction& func){
 
   (*this)["function"] = func;
 
+  Type* retType = func->getReturnType();
+  bool grouped = retType->isVoidTy();
+
+  (*this)["grouped"] = HLIRBoolean(grouped);
+
   TypeVec params = {module_->voidPtrTy};
 
   auto funcType = FunctionType::get(module_->voidTy, params, false);
@@ -1149,34 +1945,55 @@ void HLIRTask::setFunction(const HLIRFunction& func){
   BasicBlock* entry = BasicBlock::Create(c, "entry", wrapperFunc);
   b.SetInsertPoint(entry);
 
+  // future and task group header, shared with TaskArg in the runtime
   TypeVec fields;
   fields.push_back(module_->voidPtrTy);
-  fields.push_back(module_->i32Ty);
-  fields.push_back(func->getReturnType());
+  fields.push_back(module_->voidPtrTy);
 
+  if(!grouped){
+    fields.push_back(retType);
+  }
+
+  // sret and reference parameters are pointers here, so only the pointer
+  // is stored in the args struct and the callee works on the caller's
+  // storage directly. clang may pass the caller's own variable to a byval
+  // parameter, so those are copied into the args struct
   for(auto pitr = func->arg_begin(), pitrEnd = func->arg_end();
     pitr != pitrEnd; ++pitr){
-    fields.push_back(pitr->getType());
+    if(pitr->hasByValAttr()){
+      fields.push_back(pitr->getType()->getPointerElementType());
+    }
+    else{
+      fields.push_back(pitr->getType());
+    }
   }
 
   StructType* argsType = StructType::create(c, fields, "struct.func_args");
+  (*this)["argsType"] = HLIRType(argsType);
 
   ValueVec args;
   Value* argsPtr = 
     b.CreateBitCast(argsVoidPtr, PointerType::get(argsType, 0), "argsPtr");
 
-  size_t idx = 3;
+  size_t idx = paramIndex();
   for(auto pitr = func->arg_begin(), pitrEnd = func->arg_end();
     pitr != pitrEnd; ++pitr){
-    Value* arg = b.CreateStructGEP(nullptr, argsPtr, idx, "arg.ptr");
-    arg = b.CreateLoad(arg, "arg");
+    Value* arg = b.CreateStructGEP(argsType, argsPtr, idx, "arg.ptr");
+    if(!pitr->hasByValAttr()){
+      arg = b.CreateLoad(arg, "arg");
+    }
     args.push_back(arg);
     ++idx;
   }
 
-  Value* ret = b.CreateCall(func, args, "ret");
-  Value* retPtr = b.CreateStructGEP(nullptr, argsPtr, 2, "retPtr");
-  b.CreateStore(ret, retPtr);
+  if(grouped){
+    b.CreateCall(func, args);
+  }
+  else{
+    Value* ret = b.CreateCall(func, args, "ret");
+    Value* retPtr = b.CreateStructGEP(argsType, argsPtr, 2, "retPtr");
+    b.CreateStore(ret, retPtr);
+  }
 
   Function* releaseFunc = 
     module_->getFunction("__ares_task_release_future", {module_->voidPtrTy});
@@ -0,0 +1,711 @@
+/*
+ * ###########################################################################
+ * Copyright (c) 2015-2016, Los Alamos National Security, LLC.
+ * All rights reserved.
+ *
+ *  Copyright 2015-2016. Los Alamos National Security, LLC. This software was
+ *  produced under U.S. Government contract ??? (LA-CC-15-056) for Los
+ *  Alamos National Laboratory (LANL), which is operated by Los Alamos
+ *  National Security, LLC for the U.S. Department of Energy. The
+ *  U.S. Government has rights to use, reproduce, and distribute this
+ *  software.  NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY,
+ *  LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY
+ *  FOR THE USE OF THIS SOFTWARE.  If software is modified to produce
+ *  derivative works, such modified software should be clearly marked,
+ *  so as not to confuse it with the version available from LANL.
+ *
+ *  Additionally, redistribution and use in source and binary forms,
+ *  with or without modification, are permitted provided that the
+ *  following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ *    * Neither the name of Los Alamos National Security, LLC, Los
+ *      Alamos National Laboratory, LANL, the U.S. Government, nor the
+ *      names of its contributors may be used to endorse or promote
+ *      products derived from this software without specific prior
+ *      written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR
+ *  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *  USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ * ###########################################################################
+ *
+ * Notes
+ *
+ * HLIR is stored as the named metadata !hlir = !{module, constructs,
+ * tasks, captures}. each node is a tuple led by a tag naming its kind,
+ * constructs are distinct so a construct referred to from several places
+ * is read back as one. instructions are referred to by the id in the
+ * !hlir.ref attached to them, since module level metadata cannot refer to
+ * function local values.
+ *
+ * until lowering captures them, loop bodies use values of the function
+ * they were written in, which is not valid IR. each such use is replaced
+ * by a call to an hlir.capture.* function whose argument indexes the
+ * captures, and put back when read
+ *
+ * #####
+ */
+
+#include "hlir/HLIR.h"
+
+#include <functional>
+#include <map>
+#include <unordered_map>
+
+#include "llvm/IR/Metadata.h"
+
+using namespace std;
+using namespace llvm;
+using namespace ares;
+
+namespace{
+
+  using MetadataVec = vector<Metadata*>;
+
+  using ConstructFunc =
+    function<HLIRConstruct*(HLIRNode::Kind, const HLIRMap&)>;
+
+  const char* constructName(HLIRNode::Kind kind){
+    switch(kind){
+      case HLIRNode::TaskKind:
+        return "task";
+      case HLIRNode::FutureKind:
+        return "future";
+      case HLIRNode::BufferKind:
+        return "buffer";
+      case HLIRNode::TeamKind:
+        return "team";
+      case HLIRNode::SendKind:
+        return "send";
+      case HLIRNode::ReceiveKind:
+        return "receive";
+      case HLIRNode::BarrierKind:
+        return "barrier";
+      case HLIRNode::ParallelForKind:
+        return "parallel_for";
+      case HLIRNode::ParallelReduceKind:
+        return "parallel_reduce";
+      default:
+        HLIR_ERROR("invalid construct");
+    }
+  }
+
+  HLIRNode::Kind constructKind(StringRef name){
+    for(int k = HLIRNode::ConstructKind + 1;
+        k <= HLIRNode::LastConstructKind; ++k){
+      if(name == constructName(HLIRNode::Kind(k))){
+        return HLIRNode::Kind(k);
+      }
+    }
+
+    HLIR_ERROR("invalid construct: " + name.str());
+  }
+
+  class Writer{
+  public:
+    Writer(Module* module)
+      : module_(module),
+        context_(module->getContext()),
+        refKind_(context_.getMDKindID("hlir.ref")),
+        i1Ty_(Type::getInt1Ty(context_)),
+        i64Ty_(Type::getInt64Ty(context_)),
+        nextRef_(0){
+
+      // from an earlier write
+      for(Function& f : *module_){
+        for(BasicBlock& b : f){
+          for(Instruction& i : b){
+            i.setMetadata(refKind_, nullptr);
+          }
+        }
+      }
+    }
+
+    MDNode* write(const HLIRNode* n){
+      MetadataVec ops;
+
+      switch(n->kind()){
+        case HLIRNode::BooleanKind:
+          ops = {tag("bool"),
+                 constant(ConstantInt::get(i1Ty_, n->as<HLIRBoolean>()))};
+          break;
+        case HLIRNode::IntegerKind:
+          ops = {tag("int"),
+                 constant(ConstantInt::get(i64Ty_, n->as<HLIRInteger>(),
+                                           true))};
+          break;
+        case HLIRNode::FloatingKind:
+          ops = {tag("float"),
+                 constant(ConstantFP::get(Type::getDoubleTy(context_),
+                                          n->as<HLIRFloating>()))};
+          break;
+        case HLIRNode::StringKind:
+          ops = {tag("string"), tag(n->as<HLIRString>().val())};
+          break;
+        case HLIRNode::SymbolKind:
+          ops = {tag("symbol"), tag(n->as<HLIRSymbol>().val())};
+          break;
+        case HLIRNode::FunctionKind:
+          ops = {tag("function"), constant(n->as<HLIRFunction>().val())};
+          break;
+        case HLIRNode::ValueKind:
+          ops = {tag("value")};
+          writeValue(n->as<HLIRValue>().val(), ops);
+          break;
+        case HLIRNode::InstructionKind:
+          ops = {tag("instruction")};
+          writeValue(n->as<HLIRInstruction>().val(), ops);
+          break;
+        case HLIRNode::TypeKind:{
+          // as an undef pointer to it, void cannot be pointed to
+          Type* t = n->as<HLIRType>().val();
+          ops = {tag("type"), !t ? nullptr : t->isVoidTy() ? tag("void") :
+                 constant(UndefValue::get(PointerType::getUnqual(t)))};
+          break;
+        }
+        case HLIRNode::BasicBlockKind:{
+          BasicBlock* b = n->as<HLIRBasicBlock>().val();
+          ops = {tag("block")};
+          if(b){
+            Function* f = b->getParent();
+            if(!f){
+              HLIR_ERROR("basic block is not in a function");
+            }
+
+            uint64_t index = 0;
+            for(auto itr = f->begin(); &*itr != b; ++itr){
+              ++index;
+            }
+
+            ops.push_back(constant(f));
+            ops.push_back(constant(ConstantInt::get(i64Ty_, index)));
+          }
+          break;
+        }
+        case HLIRNode::VectorKind:{
+          auto& v = n->as<HLIRVector>();
+          ops = {tag("vector")};
+          for(size_t i = 0; i < v.size(); ++i){
+            const HLIRNode& vi = v[i];
+            ops.push_back(write(&vi));
+          }
+          break;
+        }
+        case HLIRNode::MapKind:
+          ops = {tag("map")};
+          writeEntries(n->as<HLIRMap>(), ops);
+          break;
+        case HLIRNode::ModuleKind:
+          ops = {tag("module")};
+          writeEntries(n->as<HLIRMap>(), ops);
+          break;
+        case HLIRNode::TaskParamKind:
+          ops = {tag("param")};
+          writeEntries(n->as<HLIRMap>(), ops);
+          break;
+        default:
+          return writeConstruct(&n->as<HLIRConstruct>());
+      }
+
+      return MDTuple::get(context_, ops);
+    }
+
+    // replaces the uses of values of another function
+    MDNode* seal(){
+      vector<Use*> uses;
+      for(Function& f : *module_){
+        for(BasicBlock& b : f){
+          for(Instruction& i : b){
+            for(Use& u : i.operands()){
+              Function* owner = ownerOf(u.get());
+              if(owner && owner != &f){
+                uses.push_back(&u);
+              }
+            }
+          }
+        }
+      }
+
+      MetadataVec captures;
+      unordered_map<Value*, uint64_t> ids;
+      unordered_map<Type*, Function*> funcs;
+      map<pair<Function*, Value*>, CallInst*> sealed;
+
+      for(Use* u : uses){
+        Value* v = u->get();
+        Function* f = cast<Instruction>(u->getUser())->getParent()->getParent();
+
+        CallInst*& ci = sealed[{f, v}];
+        if(!ci){
+          auto itr = ids.find(v);
+          if(itr == ids.end()){
+            MetadataVec ops = {tag("value")};
+            writeValue(v, ops);
+            captures.push_back(MDTuple::get(context_, ops));
+            itr = ids.emplace(v, captures.size() - 1).first;
+          }
+
+          Function*& cf = funcs[v->getType()];
+          if(!cf){
+            cf = Function::Create(
+              FunctionType::get(v->getType(), {i64Ty_}, false),
+              GlobalValue::ExternalLinkage,
+              "hlir.capture." + toStr(funcs.size() - 1), module_);
+          }
+
+          ci = CallInst::Create(cf,
+                                {ConstantInt::get(i64Ty_, itr->second)},
+                                "", &*f->getEntryBlock().getFirstInsertionPt());
+        }
+
+        u->set(ci);
+      }
+
+      return MDTuple::get(context_, captures);
+    }
+
+  private:
+    Module* module_;
+    LLVMContext& context_;
+    unsigned refKind_;
+    IntegerType* i1Ty_;
+    IntegerType* i64Ty_;
+    uint64_t nextRef_;
+    unordered_map<const HLIRConstruct*, MDNode*> constructs_;
+    unordered_map<Instruction*, uint64_t> refs_;
+
+    static Function* ownerOf(Value* v){
+      if(auto i = dyn_cast<Instruction>(v)){
+        return i->getParent() ? i->getParent()->getParent() : nullptr;
+      }
+      else if(auto a = dyn_cast<Argument>(v)){
+        return a->getParent();
+      }
+      return nullptr;
+    }
+
+    MDString* tag(StringRef name){
+      return MDString::get(context_, name);
+    }
+
+    Metadata* constant(Constant* c){
+      return c ? ConstantAsMetadata::get(c) : nullptr;
+    }
+
+    MDNode* writeConstruct(const HLIRConstruct* c){
+      auto itr = constructs_.find(c);
+      if(itr != constructs_.end()){
+        return itr->second;
+      }
+
+      MetadataVec ops = {tag("construct"), tag(constructName(c->kind()))};
+      writeEntries(*c, ops);
+
+      MDNode* n = MDTuple::getDistinct(context_, ops);
+      constructs_.emplace(c, n);
+      return n;
+    }
+
+    void writeEntries(const HLIRMap& m, MetadataVec& ops){
+      for(auto& itr : m.entries()){
+        ops.push_back(tag(itr.first));
+        ops.push_back(write(itr.second));
+      }
+    }
+
+    // nothing for null or for an instruction no longer in the IR, such as
+    // an insertion point codegen has used up
+    void writeValue(Value* v, MetadataVec& ops){
+      if(!v){
+        return;
+      }
+
+      auto i = dyn_cast<Instruction>(v);
+      if(i && !i->getParent()){
+        return;
+      }
+
+      if(auto c = dyn_cast<Constant>(v)){
+        ops.push_back(tag("constant"));
+        ops.push_back(constant(c));
+      }
+      else if(auto a = dyn_cast<Argument>(v)){
+        ops.push_back(tag("arg"));
+        ops.push_back(constant(a->getParent()));
+        ops.push_back(constant(ConstantInt::get(i64Ty_, a->getArgNo())));
+      }
+      else if(i){
+        ops.push_back(tag("inst"));
+        ops.push_back(constant(ConstantInt::get(i64Ty_, ref(i))));
+      }
+      else{
+        HLIR_ERROR("cannot write value");
+      }
+    }
+
+    uint64_t ref(Instruction* i){
+      auto itr = refs_.find(i);
+      if(itr != refs_.end()){
+        return itr->second;
+      }
+
+      uint64_t id = nextRef_++;
+      i->setMetadata(refKind_,
+        MDNode::get(context_, {constant(ConstantInt::get(i64Ty_, id))}));
+      refs_.emplace(i, id);
+      return id;
+    }
+  };
+
+  class Reader{
+  public:
+    Reader(Module* module, const ConstructFunc& createConstruct)
+      : createConstruct_(createConstruct){
+
+      unsigned refKind = module->getContext().getMDKindID("hlir.ref");
+
+      for(Function& f : *module){
+        for(BasicBlock& b : f){
+          for(Instruction& i : b){
+            if(MDNode* n = i.getMetadata(refKind)){
+              refs_[getInteger(n, 0)] = &i;
+              i.setMetadata(refKind, nullptr);
+            }
+          }
+        }
+      }
+    }
+
+    HLIRNode* read(const Metadata* md){
+      auto n = dyn_cast_or_null<MDNode>(md);
+      if(!n || n->getNumOperands() == 0){
+        HLIR_ERROR("malformed HLIR metadata");
+      }
+
+      StringRef t = getString(n, 0);
+
+      if(t == "bool"){
+        return new HLIRBoolean(getInteger(n, 1) != 0);
+      }
+      else if(t == "int"){
+        return new HLIRInteger(getInteger(n, 1));
+      }
+      else if(t == "float"){
+        auto c = getConstant<ConstantFP>(n, 1);
+        return new HLIRFloating(c->getValueAPF().convertToDouble());
+      }
+      else if(t == "string"){
+        return new HLIRString(getString(n, 1).str());
+      }
+      else if(t == "symbol"){
+        return new HLIRSymbol(getString(n, 1).str());
+      }
+      else if(t == "function"){
+        const Metadata* op = getOperand(n, 1);
+        return new HLIRFunction(op ? getConstant<Function>(n, 1) : nullptr);
+      }
+      else if(t == "value"){
+        return new HLIRValue(value(n, 1));
+      }
+      else if(t == "instruction"){
+        Value* v = value(n, 1);
+        if(v && !isa<Instruction>(v)){
+          HLIR_ERROR("malformed HLIR metadata");
+        }
+        return new HLIRInstruction(cast_or_null<Instruction>(v));
+      }
+      else if(t == "type"){
+        const Metadata* op = getOperand(n, 1);
+        if(!op){
+          return new HLIRType(nullptr);
+        }
+        else if(auto s = dyn_cast<MDString>(op)){
+          if(s->getString() != "void"){
+            HLIR_ERROR("malformed HLIR metadata");
+          }
+          return new HLIRType(Type::getVoidTy(n->getContext()));
+        }
+
+        auto pt = dyn_cast<PointerType>(getConstant<Constant>(n, 1)->getType());
+        if(!pt){
+          HLIR_ERROR("malformed HLIR metadata");
+        }
+        return new HLIRType(pt->getElementType());
+      }
+      else if(t == "block"){
+        if(n->getNumOperands() == 1){
+          return new HLIRBasicBlock(nullptr);
+        }
+
+        auto f = getConstant<Function>(n, 1);
+        int64_t index = getInteger(n, 2);
+        if(index < 0 || uint64_t(index) >= f->size()){
+          HLIR_ERROR("malformed HLIR metadata");
+        }
+
+        auto itr = f->begin();
+        for(int64_t i = index; i > 0; --i){
+          ++itr;
+        }
+        return new HLIRBasicBlock(&*itr);
+      }
+      else if(t == "vector"){
+        auto v = new HLIRVector;
+        for(unsigned i = 1; i < n->getNumOperands(); ++i){
+          *v << read(n->getOperand(i));
+        }
+        return v;
+      }
+      else if(t == "map"){
+        auto m = new HLIRMap;
+        m->merge(readEntries(n, 1));
+        return m;
+      }
+      else if(t == "param"){
+        auto p = new HLIRTaskParam;
+        p->merge(readEntries(n, 1));
+        return p;
+      }
+      else if(t == "construct"){
+        auto itr = constructs_.find(n);
+        if(itr != constructs_.end()){
+          return itr->second;
+        }
+
+        HLIRConstruct* c =
+          createConstruct_(constructKind(getString(n, 1)), readEntries(n, 2));
+        constructs_.emplace(n, c);
+        return c;
+      }
+
+      HLIR_ERROR("malformed HLIR metadata: " + t.str());
+    }
+
+    // puts back the uses seal() replaced
+    void unseal(Module* module, const MDNode* captures){
+      vector<Value*> values;
+      for(const MDOperand& op : captures->operands()){
+        auto n = dyn_cast_or_null<MDNode>(op.get());
+        Value* v = n ? value(n, 1) : nullptr;
+        if(!v){
+          HLIR_ERROR("malformed HLIR metadata");
+        }
+        values.push_back(v);
+      }
+
+      vector<Function*> funcs;
+      for(Function& f : *module){
+        if(f.getName().startswith("hlir.capture.")){
+          funcs.push_back(&f);
+        }
+      }
+
+      for(Function* f : funcs){
+        while(!f->use_empty()){
+          auto ci = dyn_cast<CallInst>(f->user_back());
+          auto id = ci && ci->getNumArgOperands() == 1 ?
+            dyn_cast<ConstantInt>(ci->getArgOperand(0)) : nullptr;
+          if(!id || id->getZExtValue() >= values.size()){
+            HLIR_ERROR("malformed HLIR metadata");
+          }
+          ci->replaceAllUsesWith(values[id->getZExtValue()]);
+          ci->eraseFromParent();
+        }
+        f->eraseFromParent();
+      }
+    }
+
+    // key, value pairs from operand start
+    HLIRMap readEntries(const MDNode* n, unsigned start){
+      HLIRMap m;
+      for(unsigned i = start; i + 1 < n->getNumOperands(); i += 2){
+        m[getString(n, i)] = read(n->getOperand(i + 1));
+      }
+      return m;
+    }
+
+  private:
+    ConstructFunc createConstruct_;
+    unordered_map<int64_t, Instruction*> refs_;
+    unordered_map<const MDNode*, HLIRConstruct*> constructs_;
+
+    static const Metadata* getOperand(const MDNode* n, unsigned i){
+      if(i >= n->getNumOperands()){
+        HLIR_ERROR("malformed HLIR metadata");
+      }
+      return n->getOperand(i);
+    }
+
+    // the constant of kind T at operand i
+    template<class T>
+    static T* getConstant(const MDNode* n, unsigned i){
+      auto c = mdconst::dyn_extract_or_null<T>(getOperand(n, i));
+      if(!c){
+        HLIR_ERROR("malformed HLIR metadata");
+      }
+      return c;
+    }
+
+    static StringRef getString(const MDNode* n, unsigned i){
+      auto s = dyn_cast_or_null<MDString>(getOperand(n, i));
+      if(!s){
+        HLIR_ERROR("malformed HLIR metadata");
+      }
+      return s->getString();
+    }
+
+    static int64_t getInteger(const MDNode* n, unsigned i){
+      return getConstant<ConstantInt>(n, i)->getSExtValue();
+    }
+
+    Value* value(const MDNode* n, unsigned i){
+      if(i >= n->getNumOperands()){
+        return nullptr;
+      }
+
+      StringRef t = getString(n, i);
+
+      if(t == "constant"){
+        return getConstant<Constant>(n, i + 1);
+      }
+      else if(t == "arg"){
+        auto f = getConstant<Function>(n, i + 1);
+        int64_t index = getInteger(n, i + 2);
+        if(index < 0 || uint64_t(index) >= f->arg_size()){
+          HLIR_ERROR("malformed HLIR metadata");
+        }
+
+        auto itr = f->arg_begin();
+        for(int64_t j = index; j > 0; --j){
+          ++itr;
+        }
+        return &*itr;
+      }
+      else if(t == "inst"){
+        auto itr = refs_.find(getInteger(n, i + 1));
+        if(itr == refs_.end()){
+          HLIR_ERROR("instruction referred to by HLIR was removed");
+        }
+        return itr->second;
+      }
+
+      HLIR_ERROR("malformed HLIR metadata: " + t.str());
+    }
+  };
+
+} // namespace
+
+void HLIRModule::writeMetadata(){
+  Writer w(module_);
+
+  NamedMDNode* md = module_->getNamedMetadata("hlir");
+  if(md){
+    module_->eraseNamedMetadata(md);
+  }
+  md = module_->getOrInsertNamedMetadata("hlir");
+
+  // in the order of their markers
+  MetadataVec constructs;
+  for(HLIRConstruct* c : orderedConstructs_()){
+    constructs.push_back(w.write(c));
+  }
+
+  MetadataVec tasks;
+  for(HLIRTask* task : tasks_){
+    tasks.push_back(w.write(task));
+  }
+
+  md->addOperand(w.write(this));
+  md->addOperand(MDTuple::get(context_, constructs));
+  md->addOperand(MDTuple::get(context_, tasks));
+  md->addOperand(w.seal());
+}
+
+HLIRModule* HLIRModule::readMetadata(Module* module){
+  NamedMDNode* md = module->getNamedMetadata("hlir");
+  if(!md){
+    return nullptr;
+  }
+
+  if(md->getNumOperands() != 4){
+    HLIR_ERROR("malformed HLIR metadata");
+  }
+
+  HLIRModule* m = getModule(module);
+  HLIRArena::Scope scope(&m->arena_);
+
+  Reader r(module, [m](HLIRNode::Kind kind, const HLIRMap& fields){
+    HLIRConstruct* c;
+
+    switch(kind){
+      case TaskKind:
+        c = new HLIRTask(m);
+        break;
+      case FutureKind:
+        c = new HLIRFuture(m);
+        break;
+      case BufferKind:
+        c = new HLIRBuffer(m);
+        break;
+      case TeamKind:
+        c = new HLIRTeam(m);
+        break;
+      case SendKind:
+        c = new HLIRSend(m);
+        break;
+      case ReceiveKind:
+        c = new HLIRReceive(m);
+        break;
+      case BarrierKind:
+        c = new HLIRBarrier(m);
+        break;
+      // without creating another body
+      case ParallelForKind:
+        return (HLIRConstruct*)new HLIRParallelFor(m, fields);
+      case ParallelReduceKind:
+        return (HLIRConstruct*)new HLIRParallelReduce(m, fields);
+      default:
+        HLIR_ERROR("invalid construct");
+    }
+
+    c->merge(fields);
+    return c;
+  });
+
+  r.unseal(module, md->getOperand(3));
+
+  m->merge(r.readEntries(md->getOperand(0), 1));
+
+  for(const MDOperand& op : md->getOperand(1)->operands()){
+    m->addConstruct(&r.read(op)->as<HLIRConstruct>());
+  }
+
+  for(const MDOperand& op : md->getOperand(2)->operands()){
+    m->tasks_.push_back(&r.read(op)->as<HLIRTask>());
+  }
+
+  // past the names read back
+  m->nextId_ = m->entries().size();
+
+  module->eraseNamedMetadata(md);
+
+  return m;
+}
@@ -0,0 +1,679 @@
+/*
+ * ###########################################################################
+ * Copyright (c) 2015-2016, Los Alamos National Security, LLC.
+ * All rights reserved.
+ *
+ *  Copyright 2015-2016. Los Alamos National Security, LLC. This software was
+ *  produced under U.S. Government contract ??? (LA-CC-15-056) for Los
+ *  Alamos National Laboratory (LANL), which is operated by Los Alamos
+ *  National Security, LLC for the U.S. Department of Energy. The
+ *  U.S. Government has rights to use, reproduce, and distribute this
+ *  software.  NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY,
+ *  LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY
+ *  FOR THE USE OF THIS SOFTWARE.  If software is modified to produce
+ *  derivative works, such modified software should be clearly marked,
+ *  so as not to confuse it with the version available from LANL.
+ *
+ *  Additionally, redistribution and use in source and binary forms,
+ *  with or without modification, are permitted provided that the
+ *  following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ *    * Neither the name of Los Alamos National Security, LLC, Los
+ *      Alamos National Laboratory, LANL, the U.S. Government, nor the
+ *      names of its contributors may be used to endorse or promote
+ *      products derived from this software without specific prior
+ *      written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR
+ *  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *  USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ * ###########################################################################
+ *
+ * Notes
+ *
+ * a readable form of the !hlir metadata written by writeMetadata(), read
+ * back by parsing it into that metadata. a file looks like
+ *
+ *   module {
+ *     name: "t"
+ *     pfor0: parallel_for #0 {
+ *       body: function @"hlir.parallel_for.body"
+ *       index: value inst 4
+ *       priority: 1
+ *       range: [
+ *         value const "i32 0"
+ *         value arg @"run" 1
+ *       ]
+ *     }
+ *   }
+ *   constructs [
+ *     #0
+ *   ]
+ *   tasks []
+ *   captures [
+ *     value inst 0
+ *   ]
+ *
+ * a construct is defined by kind #id {...} where it first appears and is
+ * referred to as #id after that. the instructions it names by number are
+ * the !hlir.ref tags of the IR it was written with
+ *
+ * #####
+ */
+
+#include "hlir/HLIR.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <unordered_map>
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/AsmParser/SlotMapping.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/TypeFinder.h"
+#include "llvm/Support/SourceMgr.h"
+
+using namespace std;
+using namespace llvm;
+using namespace ares;
+
+namespace{
+
+  using MetadataVec = vector<Metadata*>;
+
+  bool isConstruct(StringRef t){
+    return t == "task" || t == "future" || t == "buffer" || t == "team" ||
+      t == "send" || t == "receive" || t == "barrier" ||
+      t == "parallel_for" || t == "parallel_reduce";
+  }
+
+  class Printer{
+  public:
+    Printer(ostream& ostr)
+      : ostr_(ostr){}
+
+    void print(const Metadata* md, size_t level){
+      auto n = cast<MDNode>(md);
+      StringRef t = tag(n, 0);
+
+      if(t == "bool"){
+        ostr_ << (integer(n, 1) ? "true" : "false");
+      }
+      else if(t == "int"){
+        ostr_ << integer(n, 1);
+      }
+      else if(t == "float"){
+        auto c = mdconst::extract<ConstantFP>(n->getOperand(1));
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.17g",
+                 c->getValueAPF().convertToDouble());
+        ostr_ << "float " << buf;
+      }
+      else if(t == "string"){
+        printString(tag(n, 1));
+      }
+      else if(t == "symbol"){
+        ostr_ << "symbol ";
+        printString(tag(n, 1));
+      }
+      else if(t == "function"){
+        ostr_ << "function ";
+        printFunction(n->getOperand(1));
+      }
+      else if(t == "value" || t == "instruction"){
+        ostr_ << t.str() << " ";
+        printValue(n, 1);
+      }
+      else if(t == "type"){
+        ostr_ << "type ";
+        const Metadata* op = n->getOperand(1);
+        if(!op){
+          ostr_ << "null";
+        }
+        else if(isa<MDString>(op)){
+          printString("void");
+        }
+        else{
+          Type* pt = mdconst::extract<Constant>(op)->getType();
+          printString(print(cast<PointerType>(pt)->getElementType()));
+        }
+      }
+      else if(t == "block"){
+        ostr_ << "block ";
+        if(n->getNumOperands() == 1){
+          ostr_ << "null";
+        }
+        else{
+          printFunction(n->getOperand(1));
+          ostr_ << " " << integer(n, 2);
+        }
+      }
+      else if(t == "vector"){
+        ostr_ << "[";
+        for(unsigned i = 1; i < n->getNumOperands(); ++i){
+          ostr_ << endl << __indentTo(level + 1);
+          print(n->getOperand(i), level + 1);
+        }
+        ostr_ << endl << __indentTo(level) << "]";
+      }
+      else if(t == "map"){
+        printEntries(n, 1, level);
+      }
+      else if(t == "param" || t == "module"){
+        ostr_ << t.str() << " ";
+        printEntries(n, 1, level);
+      }
+      else if(t == "construct"){
+        auto itr = ids_.find(n);
+        if(itr != ids_.end()){
+          ostr_ << "#" << itr->second;
+          return;
+        }
+
+        size_t id = ids_.size();
+        ids_.emplace(n, id);
+
+        ostr_ << tag(n, 1).str() << " #" << id << " ";
+        printEntries(n, 2, level);
+      }
+      else{
+        HLIR_ERROR("malformed HLIR metadata: " + t.str());
+      }
+    }
+
+    void printList(const char* name, const MDNode* n){
+      ostr_ << name << " [";
+      for(const MDOperand& op : n->operands()){
+        ostr_ << endl << __indentTo(1);
+        print(op, 1);
+      }
+      ostr_ << (n->getNumOperands() ? "\n]" : "]") << endl;
+    }
+
+  private:
+    ostream& ostr_;
+    unordered_map<const MDNode*, size_t> ids_;
+
+    static StringRef tag(const MDNode* n, unsigned i){
+      return cast<MDString>(n->getOperand(i))->getString();
+    }
+
+    static int64_t integer(const MDNode* n, unsigned i){
+      return mdconst::extract<ConstantInt>(n->getOperand(i))->getSExtValue();
+    }
+
+    template<class T>
+    static string print(T* x){
+      string str;
+      raw_string_ostream sstr(str);
+      x->print(sstr);
+      return sstr.str();
+    }
+
+    // quotes, backslashes and unprintable characters as \XX, as LLVM does
+    void printString(StringRef s){
+      ostr_ << "\"";
+      for(unsigned char c : s){
+        if(isprint(c) && c != '\\' && c != '"'){
+          ostr_ << c;
+        }
+        else{
+          ostr_ << '\\' << hexdigit(c >> 4) << hexdigit(c & 0xf);
+        }
+      }
+      ostr_ << "\"";
+    }
+
+    void printFunction(const Metadata* op){
+      if(!op){
+        ostr_ << "null";
+        return;
+      }
+
+      ostr_ << "@";
+      printString(mdconst::extract<Function>(op)->getName());
+    }
+
+    void printValue(const MDNode* n, unsigned i){
+      if(i >= n->getNumOperands()){
+        ostr_ << "null";
+        return;
+      }
+
+      StringRef t = tag(n, i);
+      ostr_ << t.str() << " ";
+
+      if(t == "constant"){
+        string str;
+        raw_string_ostream sstr(str);
+        mdconst::extract<Constant>(n->getOperand(i + 1))->
+          printAsOperand(sstr, true);
+        printString(sstr.str());
+      }
+      else if(t == "arg"){
+        printFunction(n->getOperand(i + 1));
+        ostr_ << " " << integer(n, i + 2);
+      }
+      else{
+        ostr_ << integer(n, i + 1);
+      }
+    }
+
+    void printEntries(const MDNode* n, unsigned start, size_t level){
+      ostr_ << "{";
+      for(unsigned i = start; i + 1 < n->getNumOperands(); i += 2){
+        ostr_ << endl << __indentTo(level + 1) << tag(n, i).str() << ": ";
+        print(n->getOperand(i + 1), level + 1);
+      }
+      ostr_ << endl << __indentTo(level) << "}";
+    }
+  };
+
+  class Parser{
+  public:
+    Parser(Module* module, const string& text)
+      : module_(module),
+        context_(module->getContext()),
+        text_(text),
+        pos_(0),
+        line_(1){
+
+      // so the types of constants can name the module's structs
+      TypeFinder types;
+      types.run(*module_, true);
+      for(StructType* st : types){
+        if(st->hasName()){
+          slots_.NamedTypes[st->getName()] = st;
+        }
+      }
+    }
+
+    NamedMDNode* parse(){
+      expect("module");
+      MetadataVec module = {tag("module")};
+      parseEntries(module);
+
+      MetadataVec lists[3];
+      const char* names[] = {"constructs", "tasks", "captures"};
+      for(size_t i = 0; i < 3; ++i){
+        expect(names[i]);
+        expect("[");
+        while(!accept("]")){
+          lists[i].push_back(parseNode());
+        }
+      }
+
+      if(!next().empty()){
+        error("expected end of input");
+      }
+
+      NamedMDNode* md = module_->getNamedMetadata("hlir");
+      if(md){
+        module_->eraseNamedMetadata(md);
+      }
+      md = module_->getOrInsertNamedMetadata("hlir");
+
+      md->addOperand(MDTuple::get(context_, module));
+      for(auto& l : lists){
+        md->addOperand(MDTuple::get(context_, l));
+      }
+
+      return md;
+    }
+
+  private:
+    Module* module_;
+    LLVMContext& context_;
+    const string& text_;
+    size_t pos_;
+    size_t line_;
+    SlotMapping slots_;
+    unordered_map<int64_t, MDNode*> constructs_;
+
+    [[noreturn]] void error(const string& what){
+      HLIR_ERROR("line " + toStr(line_) + ": " + what);
+    }
+
+    MDString* tag(StringRef name){
+      return MDString::get(context_, name);
+    }
+
+    Metadata* constant(Constant* c){
+      return ConstantAsMetadata::get(c);
+    }
+
+    void skip(){
+      while(pos_ < text_.size()){
+        char c = text_[pos_];
+        if(c == '\n'){
+          ++line_;
+        }
+        else if(c == ';'){
+          while(pos_ < text_.size() && text_[pos_] != '\n'){
+            ++pos_;
+          }
+          continue;
+        }
+        else if(!isspace(c) && c != ','){
+          break;
+        }
+        ++pos_;
+      }
+    }
+
+    // the next token without consuming it: punctuation, a quoted string
+    // with its quotes, or a run of word characters
+    string peek(){
+      skip();
+
+      if(pos_ >= text_.size()){
+        return "";
+      }
+
+      char c = text_[pos_];
+      if(strchr("{}[]:@#", c)){
+        return string(1, c);
+      }
+
+      size_t end = pos_;
+      if(c == '"'){
+        end = text_.find('"', pos_ + 1);
+        if(end == string::npos){
+          error("unterminated string");
+        }
+        return text_.substr(pos_, end - pos_ + 1);
+      }
+
+      while(end < text_.size() &&
+            (isalnum(text_[end]) || strchr("_.-+", text_[end]))){
+        ++end;
+      }
+
+      if(end == pos_){
+        error(string("unexpected character: ") + c);
+      }
+
+      return text_.substr(pos_, end - pos_);
+    }
+
+    string next(){
+      string t = peek();
+      pos_ += t.size();
+      return t;
+    }
+
+    bool accept(const string& t){
+      if(peek() == t){
+        next();
+        return true;
+      }
+      return false;
+    }
+
+    void expect(const string& t){
+      string n = next();
+      if(n != t){
+        error("expected " + t + ", found " + (n.empty() ? "end" : n));
+      }
+    }
+
+    string parseString(){
+      string t = next();
+      if(t.size() < 2 || t[0] != '"'){
+        error("expected string, found " + t);
+      }
+
+      string ret;
+      for(size_t i = 1; i + 1 < t.size(); ++i){
+        if(t[i] == '\\' && i + 3 < t.size()){
+          ret += char(hexDigitValue(t[i + 1]) * 16 + hexDigitValue(t[i + 2]));
+          i += 2;
+        }
+        else{
+          ret += t[i];
+        }
+      }
+      return ret;
+    }
+
+    int64_t parseInteger(){
+      string t = next();
+      char* end;
+      int64_t ret = strtoll(t.c_str(), &end, 10);
+      if(t.empty() || *end){
+        error("expected integer, found " + t);
+      }
+      return ret;
+    }
+
+    Metadata* parseInt64(){
+      return constant(ConstantInt::get(Type::getInt64Ty(context_),
+                                       parseInteger(), true));
+    }
+
+    // by name, null for null
+    Function* parseFunction(){
+      if(accept("null")){
+        return nullptr;
+      }
+
+      expect("@");
+      string name = parseString();
+      Function* f = module_->getFunction(name);
+      if(!f){
+        error("unknown function: " + name);
+      }
+      return f;
+    }
+
+    // this LLVM parses only literal constants and expressions on their
+    // own, a global is looked up by name
+    Constant* parseConstant(const string& str){
+      size_t at = str.rfind(" @");
+      if(at != string::npos){
+        string name = str.substr(at + 2);
+        if(name.size() >= 2 && name.front() == '"' && name.back() == '"'){
+          name = name.substr(1, name.size() - 2);
+        }
+
+        if(GlobalValue* gv = module_->getNamedValue(name)){
+          return gv;
+        }
+      }
+
+      SMDiagnostic err;
+      Constant* c = parseConstantValue(str, err, *module_, &slots_);
+      if(!c){
+        error("invalid constant: " + str + ": " + err.getMessage().str());
+      }
+      return c;
+    }
+
+    void parseValue(MetadataVec& ops){
+      string t = next();
+
+      if(t == "null"){
+        return;
+      }
+
+      ops.push_back(tag(t));
+
+      if(t == "constant"){
+        ops.push_back(constant(parseConstant(parseString())));
+      }
+      else if(t == "arg"){
+        Function* f = parseFunction();
+        if(!f){
+          error("expected function");
+        }
+        ops.push_back(constant(f));
+        ops.push_back(parseInt64());
+      }
+      else if(t == "inst"){
+        ops.push_back(parseInt64());
+      }
+      else{
+        error("expected value, found " + t);
+      }
+    }
+
+    void parseEntries(MetadataVec& ops){
+      expect("{");
+      while(!accept("}")){
+        string key = next();
+        if(key.empty() || !(isalpha(key[0]) || key[0] == '_')){
+          error("expected key, found " + (key.empty() ? "end" : key));
+        }
+        expect(":");
+        ops.push_back(tag(key));
+        ops.push_back(parseNode());
+      }
+    }
+
+    MDNode* parseNode(){
+      string t = peek();
+      MetadataVec ops;
+
+      if(t == "true" || t == "false"){
+        next();
+        ops = {tag("bool"), constant(ConstantInt::get(
+          Type::getInt1Ty(context_), t == "true"))};
+      }
+      else if(!t.empty() && (isdigit(t[0]) || t[0] == '-')){
+        ops = {tag("int"), parseInt64()};
+      }
+      else if(!t.empty() && t[0] == '"'){
+        ops = {tag("string"), tag(parseString())};
+      }
+      else if(t == "[" ){
+        next();
+        ops = {tag("vector")};
+        while(!accept("]")){
+          ops.push_back(parseNode());
+        }
+      }
+      else if(t == "{"){
+        ops = {tag("map")};
+        parseEntries(ops);
+      }
+      else if(t == "#"){
+        next();
+        auto itr = constructs_.find(parseInteger());
+        if(itr == constructs_.end()){
+          error("undefined construct");
+        }
+        return itr->second;
+      }
+      else{
+        next();
+
+        if(t == "float"){
+          string v = next();
+          char* end;
+          double d = strtod(v.c_str(), &end);
+          if(v.empty() || *end){
+            error("expected number, found " + v);
+          }
+          ops = {tag("float"),
+                 constant(ConstantFP::get(Type::getDoubleTy(context_), d))};
+        }
+        else if(t == "symbol"){
+          ops = {tag("symbol"), tag(parseString())};
+        }
+        else if(t == "function"){
+          Function* f = parseFunction();
+          ops = {tag("function"), f ? constant(f) : nullptr};
+        }
+        else if(t == "value" || t == "instruction"){
+          ops = {tag(t)};
+          parseValue(ops);
+        }
+        else if(t == "type"){
+          ops = {tag("type")};
+          if(accept("null")){
+            ops.push_back(nullptr);
+          }
+          else{
+            string type = parseString();
+            if(type == "void"){
+              ops.push_back(tag("void"));
+            }
+            else{
+              ops.push_back(constant(parseConstant(type + "* undef")));
+            }
+          }
+        }
+        else if(t == "block"){
+          ops = {tag("block")};
+          if(Function* f = parseFunction()){
+            ops.push_back(constant(f));
+            ops.push_back(parseInt64());
+          }
+        }
+        else if(t == "param"){
+          ops = {tag("param")};
+          parseEntries(ops);
+        }
+        else if(isConstruct(t)){
+          expect("#");
+          int64_t id = parseInteger();
+          if(constructs_.count(id)){
+            error("construct defined twice: #" + toStr(id));
+          }
+
+          ops = {tag("construct"), tag(t)};
+          parseEntries(ops);
+
+          MDNode* n = MDTuple::getDistinct(context_, ops);
+          constructs_.emplace(id, n);
+          return n;
+        }
+        else{
+          error("unexpected " + (t.empty() ? string("end") : t));
+        }
+      }
+
+      return MDTuple::get(context_, ops);
+    }
+  };
+
+} // namespace
+
+void HLIRModule::writeText(ostream& ostr){
+  writeMetadata();
+
+  NamedMDNode* md = module_->getNamedMetadata("hlir");
+
+  Printer p(ostr);
+  p.print(md->getOperand(0), 0);
+  ostr << endl;
+  p.printList("constructs", md->getOperand(1));
+  p.printList("tasks", md->getOperand(2));
+  p.printList("captures", md->getOperand(3));
+
+  module_->eraseNamedMetadata(md);
+}
+
+HLIRModule* HLIRModule::readText(Module* module, const string& text){
+  Parser(module, text).parse();
+  return readMetadata(module);
+}
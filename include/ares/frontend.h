@@ -97,6 +97,48 @@
       : start_(0),
       end_(end){}
 
+      // priority is a compile-time scheduling hint, higher runs first
+      Forall(uint32_t start, uint32_t end, uint32_t priority)
+      : start_(start),
+      end_(end){}
+
+      Iterator_ begin() const{
+        return Iterator_(start_);
+      }
+
+      Iterator_ end() const{
+        return Iterator_(end_);
+      }
+
+   private:
+    uint32_t start_;
+    uint32_t end_;
+   };
+
+   // sets [first, last) to rank's block of [start, end) out of size ranks
+   typedef void (*Partitioner)(uint32_t start, uint32_t end,
+                               int rank, int size,
+                               uint32_t& first, uint32_t& last);
+
+   // each rank of the communicator runs its own contiguous block of the
+   // range, an even split unless a partitioner is given. no rank waits
+   // for the others once its block is done
+   class DistributedForall{
+   public:
+      typedef Forall::Iterator_ Iterator_;
+
+      DistributedForall(uint32_t start, uint32_t end)
+      : start_(start),
+      end_(end){}
+
+      DistributedForall(uint32_t end)
+      : start_(0),
+      end_(end){}
+
+      DistributedForall(uint32_t start, uint32_t end, Partitioner partitioner)
+      : start_(start),
+      end_(end){}
+
       Iterator_ begin() const{
         return Iterator_(start_);
       }
@@ -148,6 +190,11 @@
       : start_(start),
       end_(end){}
 
+      template<typename T>
+      ReduceAll(uint32_t start, uint32_t end, T& r, uint32_t priority)
+      : start_(start),
+      end_(end){}
+
       Iterator_ begin() const{
         return Iterator_(start_);
       }
@@ -53,6 +53,8 @@
 #define __ARES_RUNTIME_H__
 
 #include <functional>
+#include <string>
+#include <cstdint>
 
  namespace ares{
 
@@ -64,14 +66,182 @@
 
    bool ares_connect(const std::string& sendPath, const std::string& receivePath);
 
+   // ranks on one node through shared memory, path is the unix socket
+   // the listener accepts on
+   bool ares_listen(const std::string& path);
+
+   bool ares_connect(const std::string& path);
+
+   // run main as each of groupSize ranks, threads of this process that
+   // share its thread pool, and return once every rank has. the ranks
+   // still call ares_init_comm(groupSize)
+   void ares_run_loopback(size_t groupSize, std::function<void()> main);
+
+   // the listener is rank 0, connecting ranks are numbered from 1 in
+   // the order they connect. the forms without a rank send to the first
+   // peer and receive from any rank
+
+   // buf is freed with free() once sent
    void ares_send(char* buf, size_t size);
 
+   void ares_send(int rank, char* buf, size_t size);
+
+   // the returned buffer is owned by the caller and freed with free()
    char* ares_receive(size_t& size);
 
+   char* ares_receive(int rank, size_t& size);
+
+   // receive into caller memory, returns the message size, the message
+   // is truncated if that is larger than size
+   size_t ares_receive(char* buf, size_t size);
+
+   size_t ares_receive(int rank, char* buf, size_t size);
+
+   // nonblocking point to point. each request is freed by the ares_test
+   // that returns true, ares_wait, ares_waitall or ares_then
+
+   class Request;
+
+   typedef Request* ares_request;
+
+   // buf must stay valid and unchanged until the request completes
+   ares_request ares_isend(int rank, const char* buf, size_t size);
+
+   // receive the next message from rank, or any rank if -1, into buf.
+   // receives are matched in the order they are posted
+   ares_request ares_irecv(int rank, char* buf, size_t size);
+
+   // true once complete, size is then the message size as for ares_wait
+   bool ares_test(ares_request request, size_t* size = nullptr);
+
+   // returns the size of the message, which is truncated if larger than
+   // the receive buffer
+   size_t ares_wait(ares_request request);
+
+   void ares_waitall(ares_request* requests, size_t count);
+
+   // queue f as a task once the request completes rather than block a
+   // thread waiting for it
+   void ares_then(ares_request request, std::function<void(size_t)> f);
+
+   // active messages. a handler runs as a task on the receiving rank's
+   // thread pool, scheduled by the receive thread as the message arrives
+
+   typedef uint32_t ares_handler;
+
+   typedef std::function<void(int source, const char* payload,
+                              size_t size)> ares_handler_function;
+
+   // every rank must register its handlers in the same order, which gives
+   // each the same id on every rank
+   ares_handler ares_register_handler(ares_handler_function f);
+
+   // run handler on rank with a copy of size bytes of payload
+   void ares_remote_spawn(int rank, ares_handler handler,
+                          const char* payload, size_t size);
+
+   int ares_rank();
+
    void ares_init_comm(size_t groupSize);
 
+   // pack sends of up to maxSize bytes to the same peer into one frame,
+   // written once flushSize bytes are packed or micros microseconds after
+   // the first. a maxSize of 0 turns this off
+   void ares_aggregate(size_t maxSize = 256,
+                       size_t flushSize = 16384,
+                       uint32_t micros = 50);
+
    void ares_barrier();
 
+   // collectives, every rank must make the same calls in the same order
+
+   enum class ReduceOp : uint32_t{
+     Sum,
+     Product,
+     Min,
+     Max
+   };
+
+   enum class DataType : uint32_t{
+     Int32,
+     Int64,
+     UInt32,
+     UInt64,
+     Float,
+     Double
+   };
+
+   template<class T>
+   struct DataTypeOf;
+
+   template<> struct DataTypeOf<int32_t>{
+     static const DataType value = DataType::Int32;
+   };
+
+   template<> struct DataTypeOf<int64_t>{
+     static const DataType value = DataType::Int64;
+   };
+
+   template<> struct DataTypeOf<uint32_t>{
+     static const DataType value = DataType::UInt32;
+   };
+
+   template<> struct DataTypeOf<uint64_t>{
+     static const DataType value = DataType::UInt64;
+   };
+
+   template<> struct DataTypeOf<float>{
+     static const DataType value = DataType::Float;
+   };
+
+   template<> struct DataTypeOf<double>{
+     static const DataType value = DataType::Double;
+   };
+
+   // size bytes of buf on root are copied to buf on every rank
+   void ares_bcast(void* buf, size_t size, int root);
+
+   // combine count elements of in from every rank into out on root, out
+   // is not written on other ranks. in and out may be the same
+   void ares_reduce(const void* in, void* out, size_t count,
+                    DataType type, ReduceOp op, int root);
+
+   // as ares_reduce but every rank receives the result
+   void ares_allreduce(const void* in, void* out, size_t count,
+                       DataType type, ReduceOp op);
+
+   // size bytes of in from each rank are placed in rank order in out on
+   // root, which holds size * group size bytes
+   void ares_gather(const void* in, size_t size, void* out, int root);
+
+   template<class T>
+   void ares_bcast(T* buf, size_t count, int root){
+     ares_bcast((void*)buf, count * sizeof(T), root);
+   }
+
+   template<class T>
+   void ares_reduce(const T* in, T* out, size_t count, ReduceOp op, int root){
+     ares_reduce(in, out, count, DataTypeOf<T>::value, op, root);
+   }
+
+   template<class T>
+   void ares_allreduce(const T* in, T* out, size_t count, ReduceOp op){
+     ares_allreduce(in, out, count, DataTypeOf<T>::value, op);
+   }
+
+   // e.g: dt = ares_allreduce(dt, ReduceOp::Min)
+   template<class T>
+   T ares_allreduce(T value, ReduceOp op){
+     T result;
+     ares_allreduce(&value, &result, 1, DataTypeOf<T>::value, op);
+     return result;
+   }
+
+   template<class T>
+   void ares_gather(const T* in, size_t count, T* out, int root){
+     ares_gather((const void*)in, count * sizeof(T), (void*)out, root);
+   }
+
  } // namespace ares
  
 #endif // __ARES_RUNTIME_H__
@@ -6,12 +6,76 @@
 #include <assert.h>
 #include <stdlib.h>
 
+// the argobots calls must still run when assert() is compiled out
+#define ABT_CHECK(X) do{ int ret = (X); assert(ret == ABT_SUCCESS); (void)ret; }while(0)
+
+namespace {
+
+  // how many units a scheduler runs between checks for a join request
+  const int EVENT_FREQ = 64;
+
+  // work-stealing scheduler: pools[0] is the stream's own pool, the rest
+  // are the other streams' pools in rank order and are only popped from
+  // when the own pool is empty
+  int ws_init(ABT_sched sched, ABT_sched_config config) {
+    return ABT_SUCCESS;
+  }
+
+  void ws_run(ABT_sched sched) {
+    int numPools;
+    ABT_CHECK(ABT_sched_get_num_pools(sched, &numPools));
+
+    ABT_pool *pools = (ABT_pool *)malloc(sizeof(ABT_pool) * numPools);
+    ABT_CHECK(ABT_sched_get_pools(sched, numPools, 0, pools));
+
+    unsigned seed = (unsigned)(uintptr_t)sched;
+    int count = 0;
+
+    for (;;) {
+      ABT_unit unit;
+      ABT_pool_pop(pools[0], &unit);
+
+      if (unit != ABT_UNIT_NULL) {
+        ABT_xstream_run_unit(unit, pools[0]);
+      }
+      else if (numPools > 1) {
+        // random victim, a yielded stolen unit goes back to its owner
+        int victim = rand_r(&seed) % (numPools - 1) + 1;
+        ABT_pool_pop(pools[victim], &unit);
+        if (unit != ABT_UNIT_NULL) {
+          ABT_xstream_run_unit(unit, pools[victim]);
+        }
+      }
+
+      if (++count >= EVENT_FREQ) {
+        count = 0;
+
+        ABT_bool stop;
+        ABT_sched_has_to_stop(sched, &stop);
+        if (stop == ABT_TRUE) {
+          break;
+        }
+
+        ABT_xstream_check_events(sched);
+      }
+    }
+
+    free(pools);
+  }
+
+  int ws_free(ABT_sched sched) {
+    return ABT_SUCCESS;
+  }
+
+} // namespace
+
 namespace ares {
 
   ABT_xstream *ArgoPool::xstreams;
+  ABT_sched *ArgoPool::scheds;
   ABT_pool *ArgoPool::pools;
   int ArgoPool::numStreams;
-  int ArgoPool::nextPool;
+  std::atomic<int> ArgoPool::nextPool;
 
   ArgoPool::ArgoPool(int argc, char *argv[], int _numStreams)
   //    : numStreams(numStreams) // in addition to the "main" stream
@@ -22,60 +86,112 @@ namespace ares {
     // can only have one instance of ArgoPool
     assert(ABT_initialized() == ABT_ERR_UNINITIALIZED);
     // start ArgoBots
-    assert(ABT_init(argc, argv) == ABT_SUCCESS);
+    ABT_CHECK(ABT_init(argc, argv));
+
+    int n = numStreams + 1;
+
+    // one pool per stream including the "main" stream, any stream may
+    // push to or steal from it. the pools are automatic so each is freed
+    // with the last scheduler that uses it
+    pools = (ABT_pool *)malloc(sizeof(ABT_pool) * n);
+    for (int i = 0; i != n; i++) {
+      ABT_CHECK(ABT_pool_create_basic(ABT_POOL_FIFO, ABT_POOL_ACCESS_MPMC,
+                                      ABT_TRUE, &pools[i]));
+    }
+
+    ABT_sched_def def;
+    def.type = ABT_SCHED_TYPE_ULT;
+    def.init = ws_init;
+    def.run = ws_run;
+    def.free = ws_free;
+    def.get_migr_pool = NULL;
 
-    // populate xstreams, numStreams is in addition to "main" stream
-    xstreams = 
-      (ABT_xstream *)malloc(sizeof(ABT_xstream) * (numStreams + 1));
+    // each scheduler sees its own pool first, then every other pool
+    scheds = (ABT_sched *)malloc(sizeof(ABT_sched) * n);
+    ABT_pool *schedPools = (ABT_pool *)malloc(sizeof(ABT_pool) * n);
+    for (int i = 0; i != n; i++) {
+      for (int j = 0; j != n; j++) {
+        schedPools[j] = pools[(i + j) % n];
+      }
+      ABT_CHECK(ABT_sched_create(&def, n, schedPools,
+                                 ABT_SCHED_CONFIG_NULL, &scheds[i]));
+    }
+    free(schedPools);
+
+    // populate xstreams, numStreams is in addition to "main" stream,
+    // stream i runs scheds[i] whose own pool is pools[i]
+    xstreams = (ABT_xstream *)malloc(sizeof(ABT_xstream) * n);
     // we are the main ES and ULT, stream already exists
-    assert(ABT_xstream_self(&xstreams[0]) == ABT_SUCCESS);
+    ABT_CHECK(ABT_xstream_self(&xstreams[0]));
+    ABT_CHECK(ABT_xstream_set_main_sched(xstreams[0], scheds[0]));
     // and numStreams new ones
-    for (int i = 1; i != numStreams + 1; i++) {
-      assert(ABT_xstream_create(ABT_SCHED_NULL, // round robin?
-				&xstreams[i]) == ABT_SUCCESS);
+    for (int i = 1; i != n; i++) {
+      ABT_CHECK(ABT_xstream_create(scheds[i], &xstreams[i]));
     }
 
-    // populate pools, one per total number of streams
-    pools = (ABT_pool *)malloc(sizeof(ABT_pool) * (numStreams + 1));
-    // get the pools in which to allocate threads
-    for (int i = 0; i != numStreams + 1; i++) {
-      assert(ABT_xstream_get_main_pools(xstreams[i], 
-					1, // just the first such pool
-					&pools[i]) 
-	   == ABT_SUCCESS);
-    }
-    // first pool in which to allocate thread
-    nextPool = 1;
+    nextPool = 0;
   }
 
   ArgoPool::~ArgoPool() {
     // initialized?
     assert(ABT_initialized() == ABT_SUCCESS);
 
-    // join user-created ES with main ES
-    assert(ABT_xstream_join(xstreams[1]) == ABT_SUCCESS);
-    // free user-created ES
-    assert(ABT_xstream_free(&xstreams[1]) == ABT_SUCCESS);
+    // join and free every user-created ES, each stops once all pools
+    // are drained. their schedulers were created explicitly so freeing
+    // the ES does not free them
+    for (int i = 1; i != numStreams + 1; i++) {
+      ABT_CHECK(ABT_xstream_join(xstreams[i]));
+      ABT_CHECK(ABT_xstream_free(&xstreams[i]));
+      ABT_CHECK(ABT_sched_free(&scheds[i]));
+    }
 
-    // finalize
-    assert(ABT_finalize() == ABT_SUCCESS);
+    // finalize, this also frees the main ES and its scheduler, which
+    // was the last user of the pools
+    ABT_CHECK(ABT_finalize());
+
+    free(xstreams);
+    free(scheds);
+    free(pools);
   }
 
   void ArgoPool::AP_push(FuncPtr func, void* argp, uint32_t priority) {
-    // new thread on ES[nextPool] via POOL[nextPool]
-    assert(ABT_thread_create(pools[nextPool],
+    // a ULT pushes to the pool of the stream it runs on so spawned work
+    // stays local until it is stolen, external threads spread their work.
+    // each ES is bound to one OS thread so its pool index is cached
+    // per thread, -1 is unknown and -2 is not an ES of ours
+    static thread_local int localPool = -1;
+
+    if (localPool == -1) {
+      localPool = -2;
+      ABT_xstream self;
+      if (ABT_xstream_self(&self) == ABT_SUCCESS) {
+        for (int i = 0; i != numStreams + 1; i++) {
+          ABT_bool same;
+          ABT_xstream_equal(self, xstreams[i], &same);
+          if (same == ABT_TRUE) {
+            localPool = i;
+            break;
+          }
+        }
+      }
+    }
+
+    int pool = localPool;
+    if (pool < 0) {
+      pool = nextPool.fetch_add(1, std::memory_order_relaxed) %
+        (numStreams + 1);
+    }
+
+    ABT_CHECK(ABT_thread_create(pools[pool],
 			     func,
 			     argp,
 			     ABT_THREAD_ATTR_NULL,
-			     NULL)
-	   == ABT_SUCCESS);
-    nextPool = ((nextPool + 1) % numStreams) + 1;
-    // threadId++;
-    // assert(ABT_thread_free... not needed since NULL passed to ABT_thread_create()
+			     NULL));
+    // ABT_thread_free... not needed since NULL passed to ABT_thread_create()
   }
 
   void ArgoPool::AP_yield() {
-    assert(ABT_thread_yield() == ABT_SUCCESS);
+    ABT_CHECK(ABT_thread_yield());
   }
 
   void ArgoPool::AP_finish() {
@@ -60,6 +60,7 @@
 
 #include "abt.h"
 #include <stdint.h>
+#include <atomic>
 
 namespace ares {
 
@@ -77,6 +78,15 @@ namespace ares {
     // queue a function pointer for execution with args
     // we will ignore priority for now
     static void AP_push(FuncPtr func, void* argp, uint32_t priority);
+
+    // same interface as ThreadPool so the runtime can use either
+    void push(FuncPtr func, void* argp, uint32_t priority){
+      AP_push(func, argp, priority);
+    }
+
+    void yield(){
+      AP_yield();
+    }
     
     // called by an argobots thread to yield
     static void AP_yield();
@@ -89,9 +99,10 @@ namespace ares {
     // this could be static since only one instance of ArgoPool may exist
     //    int threadId;
     static ABT_xstream *xstreams;
-    static ABT_pool *pools;
+    static ABT_sched *scheds;   // work-stealing scheduler per stream
+    static ABT_pool *pools;     // one pool per stream, indexed by rank
     static int numStreams;
-    static int nextPool;  // creating threads round robin in pools
+    static std::atomic<int> nextPool;  // pushes from non-ULT threads
   };
   
 } // namespace ares
@@ -0,0 +1,168 @@
+/*
+ * ###########################################################################
+ *  Copyright 2015-2016. Los Alamos National Security, LLC. This software was
+ *  produced under U.S. Government contract ??? (LA-CC-15-056) for Los
+ *  Alamos National Laboratory (LANL), which is operated by Los Alamos
+ *  National Security, LLC for the U.S. Department of Energy. The
+ *  U.S. Government has rights to use, reproduce, and distribute this
+ *  software.  NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY,
+ *  LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY
+ *  FOR THE USE OF THIS SOFTWARE.  If software is modified to produce
+ *  derivative works, such modified software should be clearly marked,
+ *  so as not to confuse it with the version available from LANL.
+ *
+ *  Additionally, redistribution and use in source and binary forms,
+ *  with or without modification, are permitted provided that the
+ *  following conditions are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ *    * Neither the name of Los Alamos National Security, LLC, Los
+ *      Alamos National Laboratory, LANL, the U.S. Government, nor the
+ *      names of its contributors may be used to endorse or promote
+ *      products derived from this software without specific prior
+ *      written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR
+ *  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ *  USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ *  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ *  OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ * ###########################################################################
+ *
+ * Notes
+ *
+ * #####
+ */
+
+#ifndef __ARES_KOKKOS_POOL_H__
+#define __ARES_KOKKOS_POOL_H__
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+#include <Kokkos_Core.hpp>
+
+namespace ares{
+
+  // runs parallel loops and reductions on the Kokkos default host
+  // execution space, tasks stay on the native ThreadPool
+  class KokkosPool{
+  public:
+    using Space = Kokkos::DefaultHostExecutionSpace;
+    using Policy = Kokkos::RangePolicy<Space>;
+
+    KokkosPool(int numThreads)
+    : master_(std::this_thread::get_id()),
+    busy_(false){
+      Kokkos::InitArguments args;
+      args.num_threads = numThreads;
+      Kokkos::initialize(args);
+    }
+
+    ~KokkosPool(){
+      Kokkos::finalize();
+    }
+
+    // the host spaces accept one dispatch at a time and only from the
+    // thread that initialized Kokkos, a loop launched from anywhere else
+    // (nested, or from a task) runs serially in the calling thread
+    template<class F>
+    void parallelFor(uint32_t start, uint32_t end, const F& f){
+      if(!acquire_()){
+        for(uint32_t i = start; i < end; ++i){
+          f(i);
+        }
+        return;
+      }
+
+      Kokkos::parallel_for(Policy(start, end), f);
+      release_();
+    }
+
+    template<class T, class F>
+    T parallelReduce(uint32_t start, uint32_t end, bool sum, const F& f){
+      Reducer<T, F> r(f, sum);
+      T result;
+
+      if(!acquire_()){
+        r.init(result);
+        for(uint32_t i = start; i < end; ++i){
+          r(i, result);
+        }
+        return result;
+      }
+
+      Kokkos::parallel_reduce(Policy(start, end), r, result);
+      release_();
+      return result;
+    }
+
+  private:
+    template<class T, class F>
+    class Reducer{
+    public:
+      using execution_space = Space;
+      using value_type = T;
+
+      Reducer(const F& f, bool sum)
+      : f_(f),
+      sum_(sum){}
+
+      void operator()(size_t i, T& v) const{
+        f_(i, v);
+      }
+
+      void init(T& v) const{
+        v = sum_ ? T(0) : T(1);
+      }
+
+      void join(volatile T& v, const volatile T& u) const{
+        if(sum_){
+          v += u;
+        }
+        else{
+          v *= u;
+        }
+      }
+
+    private:
+      F f_;
+      bool sum_;
+    };
+
+    bool acquire_(){
+      if(std::this_thread::get_id() != master_){
+        return false;
+      }
+
+      bool expected = false;
+      return busy_.compare_exchange_strong(expected, true);
+    }
+
+    void release_(){
+      busy_.store(false);
+    }
+
+    std::thread::id master_;
+    std::atomic<bool> busy_;
+  };
+
+} // namespace ares
+
+#endif // __ARES_KOKKOS_POOL_H__
@@ -79,19 +79,26 @@ class ThreadPool{
 
      class Item{
      public:
-       Item(Func func, void* arg, uint32_t priority)
+       Item(Func func, void* arg, uint32_t priority, uint32_t depth)
        : func(func),
        arg(arg),
-       priority(priority){}
+       priority(priority),
+       depth(depth),
+       seq(0){}
 
        Func func;
        void* arg;
        uint32_t priority;
+       uint32_t depth;
+       uint64_t seq;
      };
 
-     void push(Func func, void* arg, uint32_t priority){
+     void push(Func func, void* arg, uint32_t priority, uint32_t depth){
+       Item* item = new Item(func, arg, priority, depth);
+
        mutex_.lock();
-       queue_.push(new Item(func, arg, priority));
+       item->seq = nextSeq_++;
+       queue_.push(item);
        mutex_.unlock();
        
        sem_.release();
@@ -110,15 +117,27 @@ class ThreadPool{
      }
 
    private:
+     // highest priority first. Among equal priorities the most deeply
+     // nested work goes first: whoever spawned it is usually blocked
+     // awaiting it, so it is on the critical path. Ties are FIFO.
      struct Compare_{
        bool operator()(const Item* i1, const Item* i2) const{
-         return i1->priority < i2->priority;
+         if(i1->priority != i2->priority){
+           return i1->priority < i2->priority;
+         }
+
+         if(i1->depth != i2->depth){
+           return i1->depth < i2->depth;
+         }
+
+         return i1->seq > i2->seq;
        }
      };
      
      typedef std::priority_queue<Item*, std::vector<Item*>, Compare_> Queue_;
 
      Queue_ queue_;
+     uint64_t nextSeq_ = 0;
      CVSemaphore sem_;
      std::mutex mutex_;
    };
@@ -128,7 +147,7 @@ class ThreadPool{
    }
 
    void push(Func func, void* arg, uint32_t priority){
-     queue_.push(func, arg, priority);
+     queue_.push(func, arg, priority, currentDepth_() + 1);
    }
 
    void start(size_t numThreads){
@@ -141,6 +160,7 @@ class ThreadPool{
      for(;;){
        Queue::Item* item = queue_.get();
        assert(item);
+       currentDepth_() = item->depth;
        item->func(item->arg);
        delete item;
      }
@@ -149,6 +169,12 @@ class ThreadPool{
  private:
    using ThreadVec = std::vector<std::thread*>;
 
+   // nesting depth of the item the calling thread is running
+   static uint32_t& currentDepth_(){
+     static thread_local uint32_t depth = 0;
+     return depth;
+   }
+
    Queue queue_;
 
    std::mutex mutex_;
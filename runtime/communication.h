@@ -57,41 +57,122 @@
 #include <cstring>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
-#include <sys/select.h>
-#include <sys/socket.h>
 #include <sys/stat.h>
 #include <errno.h>
-#include <unistd.h>
 #include <strings.h>
-
-#include "CVSemaphore.h"
+#include <climits>
+#include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
+#include <memory>
 
 namespace ares{
 
+// a nonblocking byte stream to one peer, polled by the communicator's
+// event loop
 class Channel{
 public:
   virtual ~Channel(){}
 
-  virtual void send(char* buf, size_t size) = 0;
+  // descriptors the event loop watches for input and output
+  virtual int readFD() = 0;
+
+  virtual int writeFD() = 0;
+
+  // both return the number of bytes moved, 0 if nothing can be moved
+  // without blocking, or -1 if the peer is gone
+  virtual ssize_t read(char* buf, size_t size) = 0;
+
+  virtual ssize_t write(iovec* iov, int count) = 0;
+
+  // what writeFD() is polled for while a write is waiting for room
+  virtual uint32_t writeEvents(){
+    return EPOLLOUT;
+  }
+
+  // drop n written bytes from the front of iov
+  static void consume(iovec*& iov, int& count, size_t n){
+    while(count > 0 && n >= iov->iov_len){
+      n -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+
+    if(count > 0){
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+protected:
+  static void setNonBlocking_(int fd){
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+
+  static ssize_t result_(ssize_t n){
+    if(n >= 0){
+      return n;
+    }
 
-  virtual void receive(char* buf, size_t size) = 0;
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+  }
 };
 
 class SocketChannel : public Channel{
 public:
   SocketChannel(int fd)
-  : fd_(fd){}
+  : fd_(fd){
+    setNonBlocking_(fd_);
+
+    // headers are small and sent as soon as they are queued
+    int noDelay = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+  }
+
+  ~SocketChannel(){
+    ::close(fd_);
+  }
+
+  int readFD() override{
+    return fd_;
+  }
+
+  int writeFD() override{
+    return fd_;
+  }
 
-  void send(char* buf, size_t size) override{
-    ::send(fd_, buf, size, 0);
+  ssize_t read(char* buf, size_t size) override{
+    ssize_t n = ::recv(fd_, buf, size, 0);
+    return n == 0 && size > 0 ? -1 : result_(n);
   }
 
-  void receive(char* buf, size_t size) override{
-    ::recv(fd_, buf, size, 0);
+  ssize_t write(iovec* iov, int count) override{
+    msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = std::min(count, IOV_MAX);
+
+    return result_(::sendmsg(fd_, &mh, MSG_NOSIGNAL));
   }
 
 private:
@@ -100,42 +181,349 @@ private:
 
 class FIFOChannel : public Channel{
 public:
-  FIFOChannel(int fd)
-  : fd_(fd){}
+  FIFOChannel(int readFD, int writeFD)
+  : readFD_(readFD),
+  writeFD_(writeFD){
+    setNonBlocking_(readFD_);
+    setNonBlocking_(writeFD_);
+  }
 
   ~FIFOChannel(){
-    ::close(fd_);
+    ::close(readFD_);
+    ::close(writeFD_);
+  }
+
+  int readFD() override{
+    return readFD_;
   }
 
-  void send(char* buf, size_t size) override{
-    ::write(fd_, buf, size);
+  int writeFD() override{
+    return writeFD_;
   }
 
-  void receive(char* buf, size_t size) override{
-    ::read(fd_, buf, size);
+  ssize_t read(char* buf, size_t size) override{
+    ssize_t n = ::read(readFD_, buf, size);
+    return n == 0 && size > 0 ? -1 : result_(n);
+  }
+
+  ssize_t write(iovec* iov, int count) override{
+    return result_(::writev(writeFD_, iov, std::min(count, IOV_MAX)));
   }
 
 private:
-  int fd_;
+  int readFD_;
+  int writeFD_;
+};
+
+// a pair of single producer, single consumer byte rings in a memory
+// segment shared by two processes on the same node. frames are copied
+// from the sender's buffers into the ring and from the ring straight
+// into the receiving buffer, no system call is made while there is data
+// or room. eventfds only wake a side that found its ring empty or full
+class SharedMemoryChannel : public Channel{
+public:
+  // the listener creates the segment and the eventfds and passes them to
+  // the connecting process
+  static const size_t RING_SIZE = 4 << 20;
+
+  static const int NUM_FDS = 5;
+
+  // fds are the segment and the data and room eventfds of ring 0 and
+  // ring 1. the creator writes ring 0 and reads ring 1
+  static bool create(int* fds){
+    fds[0] = memfd_create("ares", 0);
+    if(fds[0] < 0){
+      return false;
+    }
+
+    size_t size = 2 * sizeof(Ring) + 2 * RING_SIZE;
+    if(ftruncate(fds[0], size) < 0){
+      ::close(fds[0]);
+      return false;
+    }
+
+    for(int i = 1; i < NUM_FDS; ++i){
+      fds[i] = eventfd(0, EFD_NONBLOCK);
+      assert(fds[i] >= 0);
+    }
+
+    return true;
+  }
+
+  SharedMemoryChannel(const int* fds, bool creator){
+    struct stat st;
+    int status = fstat(fds[0], &st);
+    assert(status == 0);
+    (void)status;
+
+    size_ = st.st_size;
+    capacity_ = (size_ - 2 * sizeof(Ring)) / 2;
+    assert((capacity_ & (capacity_ - 1)) == 0);
+
+    base_ = (char*)mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fds[0], 0);
+    assert(base_ != MAP_FAILED);
+    ::close(fds[0]);
+
+    Ring* rings = (Ring*)base_;
+    char* data = base_ + 2 * sizeof(Ring);
+
+    int w = creator ? 0 : 1;
+    int r = 1 - w;
+
+    if(creator){
+      new (&rings[0]) Ring;
+      new (&rings[1]) Ring;
+    }
+
+    out_ = &rings[w];
+    outData_ = data + w * capacity_;
+    outDataFD_ = fds[1 + w * 2];
+    outRoomFD_ = fds[2 + w * 2];
+
+    in_ = &rings[r];
+    inData_ = data + r * capacity_;
+    inDataFD_ = fds[1 + r * 2];
+    inRoomFD_ = fds[2 + r * 2];
+  }
+
+  ~SharedMemoryChannel(){
+    out_->closed = 1;
+    in_->closed = 1;
+    signal_(outDataFD_);
+    signal_(inRoomFD_);
+
+    munmap(base_, size_);
+
+    ::close(outDataFD_);
+    ::close(outRoomFD_);
+    ::close(inDataFD_);
+    ::close(inRoomFD_);
+  }
+
+  int readFD() override{
+    return inDataFD_;
+  }
+
+  int writeFD() override{
+    return outRoomFD_;
+  }
+
+  uint32_t writeEvents() override{
+    return EPOLLIN;
+  }
+
+  ssize_t read(char* buf, size_t size) override{
+    uint64_t tail = in_->tail.load(std::memory_order_relaxed);
+    uint64_t avail = in_->head.load() - tail;
+
+    if(avail == 0){
+      // sleep unless the writer got in after the flag was raised
+      drain_(inDataFD_);
+      in_->readerWaiting = 1;
+      avail = in_->head.load() - tail;
+      if(avail == 0){
+        return in_->closed ? -1 : 0;
+      }
+      in_->readerWaiting = 0;
+    }
+
+    size_t n = std::min<uint64_t>(avail, size);
+    copyOut_(inData_, tail, buf, n);
+    in_->tail.store(tail + n);
+
+    if(in_->writerWaiting.load() && in_->writerWaiting.exchange(0)){
+      signal_(inRoomFD_);
+    }
+
+    return n;
+  }
+
+  ssize_t write(iovec* iov, int count) override{
+    if(out_->closed){
+      return -1;
+    }
+
+    uint64_t head = out_->head.load(std::memory_order_relaxed);
+    uint64_t room = capacity_ - (head - out_->tail.load());
+
+    if(room == 0){
+      drain_(outRoomFD_);
+      out_->writerWaiting = 1;
+      room = capacity_ - (head - out_->tail.load());
+      if(room == 0){
+        return 0;
+      }
+      out_->writerWaiting = 0;
+    }
+
+    size_t n = 0;
+    for(int i = 0; i < count && room > 0; ++i){
+      size_t m = std::min<uint64_t>(iov[i].iov_len, room);
+      copyIn_(outData_, head + n, (const char*)iov[i].iov_base, m);
+      n += m;
+      room -= m;
+    }
+
+    out_->head.store(head + n);
+
+    if(out_->readerWaiting.load() && out_->readerWaiting.exchange(0)){
+      signal_(outDataFD_);
+    }
+
+    return n;
+  }
+
+private:
+  // head and tail only grow, the writer owns head and the reader tail.
+  // they are on separate cache lines so the two sides do not contend.
+  // the reader starts out waiting as it only looks once woken
+  struct Ring{
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) std::atomic<uint32_t> readerWaiting{1};
+    std::atomic<uint32_t> writerWaiting{0};
+    std::atomic<uint32_t> closed{0};
+  };
+
+  void copyIn_(char* data, uint64_t pos, const char* src, size_t n){
+    size_t offset = pos & (capacity_ - 1);
+    size_t first = std::min(n, capacity_ - offset);
+    memcpy(data + offset, src, first);
+    memcpy(data, src + first, n - first);
+  }
+
+  void copyOut_(const char* data, uint64_t pos, char* dest, size_t n){
+    size_t offset = pos & (capacity_ - 1);
+    size_t first = std::min(n, capacity_ - offset);
+    memcpy(dest, data + offset, first);
+    memcpy(dest + first, data, n - first);
+  }
+
+  static void signal_(int fd){
+    uint64_t n = 1;
+    ssize_t r = ::write(fd, &n, sizeof(n));
+    (void)r;
+  }
+
+  static void drain_(int fd){
+    uint64_t n;
+    ssize_t r = ::read(fd, &n, sizeof(n));
+    (void)r;
+  }
+
+  char* base_;
+  size_t size_;
+  size_t capacity_;
+
+  Ring* out_;
+  char* outData_;
+  int outDataFD_;
+  int outRoomFD_;
+
+  Ring* in_;
+  char* inData_;
+  int inDataFD_;
+  int inRoomFD_;
 };
 
 enum class MessageType : uint8_t{
   None,
   Raw,
-  Barrier
+  Collective,
+  Rank,
+  Aggregate,
+  Active
+};
+
+// frame header, the payload follows. an aggregate frame's payload is a
+// sequence of header and payload pairs
+struct MessageHeader{
+  uint32_t size;
+  uint32_t source;
+  uint32_t dest;
+  uint32_t tag;
+  MessageType type;
+  uint8_t pad[3];
+};
+
+// first frame on a new connection, tells the peer its rank
+class RankMessage{
+public:
+  static const MessageType type = MessageType::Rank;
+
+  uint32_t rank;
 };
 
-class BarrierMessage{
+// completion of a nonblocking send or receive. size() and source()
+// are valid once done() is true
+class Request{
 public:
-  static const MessageType type = MessageType::Barrier;
+  bool done() const{
+    return done_;
+  }
+
+  void wait(){
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [&]{ return done_.load(); });
+  }
+
+  // bytes sent, or the size of the message received, which may be more
+  // than was copied into a smaller receive buffer
+  size_t size() const{
+    return size_;
+  }
+
+  // the rank sent to or received from
+  int source() const{
+    return source_;
+  }
+
+  // f runs once on completion, on the event loop thread, or right away
+  // if the request is already done. it may delete the request
+  void then(std::function<void()> f){
+    std::unique_lock<std::mutex> lock(mutex_);
+    if(!done_){
+      then_ = std::move(f);
+      return;
+    }
+    lock.unlock();
+
+    f();
+  }
+
+  void complete(size_t size, int source){
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_ = size;
+    source_ = source;
+    done_ = true;
+    std::function<void()> f = std::move(then_);
+    cond_.notify_all();
+    lock.unlock();
+
+    if(f){
+      f();
+    }
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::atomic<bool> done_{false};
+  size_t size_ = 0;
+  int source_ = -1;
+  std::function<void()> then_;
 };
 
+class MessageBufferPool;
+
 class MessageBuffer{
 public:
   template<class M>
   MessageBuffer(const M& msg, bool owned)
   : type_(M::type), 
   size_(sizeof(M)), 
+  capacity_(sizeof(M)),
   owned_(owned){
     buf_ = (char*)malloc(sizeof(M));
     memcpy(buf_, &msg, sizeof(M));
@@ -145,17 +533,20 @@ public:
   : type_(MessageType::Raw), 
     buf_(buf),
     size_(size),
+    capacity_(size),
     owned_(owned){}
 
   MessageBuffer(MessageType type, char* buf, size_t size, bool owned)
   : type_(type), 
     buf_(buf),
     size_(size),
+    capacity_(size),
     owned_(owned){}
 
   MessageBuffer(MessageType type, size_t size, bool owned)
   : type_(type), 
   size_(size), 
+  capacity_(size),
   owned_(owned){
     buf_ = (char*)malloc(size);
   }
@@ -166,220 +557,1442 @@ public:
     }
   }
 
-  template<class T>
-  T* as(){
-    return reinterpret_cast<T*>(buf_);
-  }
+  template<class T>
+  T* as(){
+    return reinterpret_cast<T*>(buf_);
+  }
+
+  char* buffer(){
+    return buf_;
+  }
+
+  // hand the buffer to the caller, who frees it with free()
+  char* detach(){
+    char* buf = buf_;
+    buf_ = nullptr;
+    capacity_ = 0;
+    return buf;
+  }
+
+  // return a received message to the pool it came from
+  static void recycle(MessageBuffer* msg);
+
+  uint32_t size() const{
+    return size_;
+  }
+  
+  MessageType type(){
+    return type_;
+  }
+
+  uint32_t source() const{
+    return source_;
+  }
+
+  uint32_t dest() const{
+    return dest_;
+  }
+
+  uint32_t tag() const{
+    return tag_;
+  }
+
+  void setSource(uint32_t source){
+    source_ = source;
+  }
+
+  void setDest(uint32_t dest){
+    dest_ = dest;
+  }
+
+  void setTag(uint32_t tag){
+    tag_ = tag;
+  }
+
+  // completed once the message has been written to the channel
+  Request* request() const{
+    return request_;
+  }
+
+  void setRequest(Request* request){
+    request_ = request;
+  }
+
+private:
+  friend class MessageBufferPool;
+
+  MessageType type_;
+  char* buf_;
+  uint32_t size_;
+  uint32_t capacity_;
+  bool owned_;
+  uint32_t source_ = 0;
+  uint32_t dest_ = 0;
+  uint32_t tag_ = 0;
+  Request* request_ = nullptr;
+  MessageBufferPool* pool_ = nullptr;
+};
+
+// receive buffers recycled by power of two capacity so steady traffic
+// does not allocate
+class MessageBufferPool{
+public:
+  ~MessageBufferPool(){
+    for(auto& c : free_){
+      for(MessageBuffer* msg : c){
+        delete msg;
+      }
+    }
+  }
+
+  MessageBuffer* acquire(MessageType type, size_t size){
+    size_t c = sizeClass_(size);
+
+    if(c < NUM_CLASSES){
+      std::lock_guard<std::mutex> lock(mutex_);
+      if(!free_[c].empty()){
+        MessageBuffer* msg = free_[c].back();
+        free_[c].pop_back();
+        msg->type_ = type;
+        msg->size_ = size;
+        return msg;
+      }
+    }
+
+    size_t capacity = c < NUM_CLASSES ? size_t(1) << (c + MIN_CLASS) : size;
+    auto msg = new MessageBuffer(type, capacity, true);
+    msg->size_ = size;
+    msg->pool_ = this;
+    return msg;
+  }
+
+  void release(MessageBuffer* msg){
+    size_t c = sizeClass_(msg->capacity_);
+
+    if(msg->buf_ && c < NUM_CLASSES && 
+       msg->capacity_ == size_t(1) << (c + MIN_CLASS)){
+      std::lock_guard<std::mutex> lock(mutex_);
+      if(free_[c].size() < MAX_FREE){
+        free_[c].push_back(msg);
+        return;
+      }
+    }
+
+    delete msg;
+  }
+
+private:
+  // classes are 64 bytes to 64 MB, larger buffers are not kept
+  static const size_t MIN_CLASS = 6;
+  static const size_t NUM_CLASSES = 21;
+  static const size_t MAX_FREE = 64;
+
+  static size_t sizeClass_(size_t size){
+    size_t c = 0;
+    while((size_t(1) << (c + MIN_CLASS)) < size){
+      ++c;
+    }
+    return c;
+  }
+
+  std::mutex mutex_;
+  std::vector<MessageBuffer*> free_[NUM_CLASSES];
+};
+
+inline void MessageBuffer::recycle(MessageBuffer* msg){
+  if(msg->pool_){
+    msg->pool_->release(msg);
+  }
+  else{
+    delete msg;
+  }
+}
+
+class MessageHandler{
+public:
+  virtual bool handleMessage(MessageBuffer* msg) = 0;
+};
+
+// ranks are assigned by the listener, which is rank 0, in the order
+// peers connect. the listener is connected to every other rank and
+// forwards frames between them. a single event loop thread does all
+// socket I/O for every peer
+class Communicator : public MessageHandler{
+public:
+  Communicator(){
+    epollFD_ = epoll_create1(0);
+    assert(epollFD_ >= 0);
+
+    wakeFD_ = eventfd(0, EFD_NONBLOCK);
+    assert(wakeFD_ >= 0);
+
+    watch_(wakeFD_, EPOLLIN, &waker_);
+
+    timerFD_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    assert(timerFD_ >= 0);
+
+    watch_(timerFD_, EPOLLIN, &flushTimer_);
+
+    loopThread_ = new std::thread(&Communicator::run_, this);
+  }
+
+  virtual ~Communicator(){
+    if(loopThread_){
+      stop_ = true;
+      wake_();
+      loopThread_->join();
+      delete loopThread_;
+    }
+
+    for(Peer* p : peers_){
+      delete p;
+    }
+
+    if(loopThread_){
+      ::close(timerFD_);
+      ::close(wakeFD_);
+      ::close(epollFD_);
+    }
+  }
+
+  int rank(){
+    std::unique_lock<std::mutex> lock(peersMutex_);
+    peersCond_.wait(lock, [&]{ return rank_ >= 0; });
+    return rank_;
+  }
+
+  size_t groupSize() const{
+    return groupSize_;
+  }
+
+  // queue msg for rank, it is deleted or recycled once written
+  void send(int rank, MessageBuffer* msg){
+    msg->setSource(rank_);
+    msg->setDest(rank);
+
+    if(rank == rank_){
+      deliver_(msg);
+      return;
+    }
+
+    transmit_(rank, msg);
+  }
+
+  // the first peer, rank 1 for the listener and rank 0 otherwise
+  void send(MessageBuffer* msg){
+    send(rank_ == 0 ? 1 : 0, msg);
+  }
+
+  // next message from rank, or from any rank if rank is -1
+  MessageBuffer* receive(int rank){
+    std::unique_lock<std::mutex> lock(receiveMutex_);
+
+    auto itr = receiveQueue_.end();
+    receiveCond_.wait(lock, [&]{
+      itr = findQueued_(rank);
+      return itr != receiveQueue_.end();
+    });
+
+    MessageBuffer* msg = *itr;
+    receiveQueue_.erase(itr);
+    return msg;
+  }
+
+  MessageBuffer* receive(){
+    return receive(-1);
+  }
+
+  // receive the next raw message from rank into buf, returns its size,
+  // which is truncated to size if larger. an already queued message is
+  // copied, otherwise the payload is read directly into buf
+  size_t receive(int rank, char* buf, size_t size){
+    Request request;
+    irecv(rank, buf, size, &request);
+    request.wait();
+    return request.size();
+  }
+
+  size_t receive(char* buf, size_t size){
+    return receive(-1, buf, size);
+  }
+
+  // send size bytes of buf to rank without copying, buf must not change
+  // until request completes
+  void isend(int rank, const char* buf, size_t size, Request* request){
+    if(rank == rank_){
+      auto msg = new MessageBuffer(MessageType::Raw, size, true);
+      memcpy(msg->buffer(), buf, size);
+      send(rank, msg);
+      request->complete(size, rank);
+      return;
+    }
+
+    auto msg = new MessageBuffer(MessageType::Raw, (char*)buf, size, false);
+    msg->setRequest(request);
+    send(rank, msg);
+  }
+
+  // receive the next raw message from rank, or any rank if rank is -1,
+  // into buf. posted receives are matched in the order they are made
+  void irecv(int rank, char* buf, size_t size, Request* request){
+    std::unique_lock<std::mutex> lock(receiveMutex_);
+
+    auto itr = findQueued_(rank);
+
+    if(itr == receiveQueue_.end()){
+      posted_.push_back({rank, buf, size, request});
+      return;
+    }
+
+    MessageBuffer* msg = *itr;
+    receiveQueue_.erase(itr);
+    lock.unlock();
+
+    memcpy(buf, msg->buffer(), std::min<size_t>(size, msg->size()));
+    request->complete(msg->size(), msg->source());
+    MessageBuffer::recycle(msg);
+  }
+
+  // called on the thread that receives an active message, which is
+  // usually the event loop, and takes ownership of it
+  typedef std::function<void(MessageBuffer*)> ActiveHandler;
+
+  // active messages carry the id of their handler in the tag. those that
+  // arrive before their handler is registered are held until it is
+  void registerHandler(uint32_t id, ActiveHandler handler){
+    std::unique_lock<std::mutex> lock(handlersMutex_);
+    handlers_[id] = handler;
+
+    std::vector<MessageBuffer*> held;
+    auto itr = std::stable_partition(unhandled_.begin(), unhandled_.end(),
+                                     [&](MessageBuffer* msg){
+                                       return msg->tag() != id;
+                                     });
+    held.assign(itr, unhandled_.end());
+    unhandled_.erase(itr, unhandled_.end());
+    lock.unlock();
+
+    for(MessageBuffer* msg : held){
+      handler(msg);
+    }
+  }
+
+  // register handler under the next free id, which is the same on every
+  // rank that adds its handlers in the same order
+  uint32_t addHandler(ActiveHandler handler){
+    uint32_t id = nextHandler_++;
+    registerHandler(id, handler);
+    return id;
+  }
+
+  // run handler on rank with a copy of size bytes of payload
+  void spawn(int rank, uint32_t handler, const void* payload, size_t size){
+    MessageBuffer* msg = pool_.acquire(MessageType::Active, size);
+    if(size > 0){
+      memcpy(msg->buffer(), payload, size);
+    }
+    msg->setTag(handler);
+    send(rank, msg);
+  }
+
+  virtual bool isListener() = 0; 
+
+  // collectives must be called by every rank in the same order, each
+  // call takes the next sequence number which is carried in the tag of
+  // its messages together with the step within the call
+
+  // dissemination barrier, round k signals rank + 2^k and waits for
+  // rank - 2^k
+  void barrier(){
+    size_t n = groupSize_;
+    int r = rank();
+
+    uint32_t seq = nextCollective_();
+    uint32_t step = 0;
+
+    for(size_t k = 1; k < n; k <<= 1, ++step){
+      sendCollective_((r + k) % n, nullptr, 0, seq, step);
+      MessageBuffer* msg = receiveCollective_((r + n - k) % n, seq, step);
+      MessageBuffer::recycle(msg);
+    }
+  }
+
+  // binomial tree broadcast of size bytes from root
+  void bcast(void* buf, size_t size, int root){
+    size_t n = groupSize_;
+    size_t vr = relativeRank_(root);
+
+    uint32_t seq = nextCollective_();
+
+    size_t mask = 1;
+    while(mask < n){
+      if(vr & mask){
+        receiveCollective_(absoluteRank_(vr - mask, root), seq, 0, buf, size);
+        break;
+      }
+      mask <<= 1;
+    }
+
+    for(mask >>= 1; mask > 0; mask >>= 1){
+      if(vr + mask < n){
+        sendCollective_(absoluteRank_(vr + mask, root), buf, size, seq, 0);
+      }
+    }
+  }
+
+  // binomial tree reduction of count elements into out on root, out is
+  // only written on root. op(a, b) combines b into a
+  template<class T, class Op>
+  void reduce(const T* in, T* out, size_t count, Op op, int root){
+    size_t n = groupSize_;
+    size_t vr = relativeRank_(root);
+    size_t size = count * sizeof(T);
+
+    uint32_t seq = nextCollective_();
+
+    std::vector<T> acc(in, in + count);
+    std::vector<T> tmp(count);
+
+    for(size_t mask = 1; mask < n; mask <<= 1){
+      if(vr & mask){
+        sendCollective_(absoluteRank_(vr - mask, root), acc.data(), size,
+                        seq, 0);
+        return;
+      }
+
+      if(vr + mask < n){
+        receiveCollective_(absoluteRank_(vr + mask, root), seq, 0,
+                           tmp.data(), size);
+        combine_(acc.data(), tmp.data(), count, op);
+      }
+    }
+
+    std::copy(acc.begin(), acc.end(), out);
+  }
+
+  // small buffers are reduced to rank 0 and broadcast, large ones use a
+  // ring reduce-scatter followed by a ring allgather so each rank only
+  // moves about twice the buffer
+  template<class T, class Op>
+  void allreduce(const T* in, T* out, size_t count, Op op){
+    size_t n = groupSize_;
+
+    if(count * sizeof(T) < RING_THRESHOLD || count < n){
+      reduce(in, out, count, op, 0);
+      bcast(out, count * sizeof(T), 0);
+      return;
+    }
+
+    int r = rank();
+    int right = (r + 1) % n;
+    int left = (r + n - 1) % n;
+
+    uint32_t seq = nextCollective_();
+
+    if(out != in){
+      std::copy(in, in + count, out);
+    }
+
+    // chunk i is [offset(i), offset(i + 1))
+    auto offset = [&](size_t i){
+      return count / n * i + std::min(i, count % n);
+    };
+
+    std::vector<T> tmp(count / n + 1);
+
+    // after step s rank r holds the partial sum of chunk r - s - 1 over
+    // s + 2 ranks, after n - 1 steps chunk r + 1 is complete
+    for(size_t s = 0; s < n - 1; ++s){
+      size_t sendChunk = (r + n - s) % n;
+      size_t recvChunk = (r + n - s - 1) % n;
+
+      sendCollective_(right, out + offset(sendChunk),
+                      (offset(sendChunk + 1) - offset(sendChunk)) * sizeof(T),
+                      seq, s);
+
+      size_t len = offset(recvChunk + 1) - offset(recvChunk);
+      receiveCollective_(left, seq, s, tmp.data(), len * sizeof(T));
+      combine_(out + offset(recvChunk), tmp.data(), len, op);
+    }
+
+    for(size_t s = 0; s < n - 1; ++s){
+      size_t sendChunk = (r + 1 + n - s) % n;
+      size_t recvChunk = (r + n - s) % n;
+
+      sendCollective_(right, out + offset(sendChunk),
+                      (offset(sendChunk + 1) - offset(sendChunk)) * sizeof(T),
+                      seq, n + s);
+
+      receiveCollective_(left, seq, n + s, out + offset(recvChunk),
+                         (offset(recvChunk + 1) - offset(recvChunk)) *
+                         sizeof(T));
+    }
+  }
+
+  // binomial tree gather of size bytes from each rank into out on root
+  // in rank order, out holds groupSize() * size bytes and is only
+  // written on root
+  void gather(const void* in, size_t size, void* out, int root){
+    size_t n = groupSize_;
+    size_t vr = relativeRank_(root);
+
+    uint32_t seq = nextCollective_();
+
+    // blocks of relative ranks vr, vr + 1, ... in the order received
+    std::vector<char> blocks(size);
+    memcpy(blocks.data(), in, size);
+
+    for(size_t mask = 1; mask < n; mask <<= 1){
+      if(vr & mask){
+        sendCollective_(absoluteRank_(vr - mask, root), blocks.data(),
+                        blocks.size(), seq, 0);
+        return;
+      }
+
+      size_t src = vr + mask;
+      if(src < n){
+        size_t have = blocks.size();
+        blocks.resize(have + std::min(mask, n - src) * size);
+        receiveCollective_(absoluteRank_(src, root), seq, 0,
+                           blocks.data() + have, blocks.size() - have);
+      }
+    }
+
+    // root has every block in relative rank order
+    char* dest = (char*)out;
+    for(size_t i = 0; i < n; ++i){
+      memcpy(dest + absoluteRank_(i, root) * size,
+             blocks.data() + i * size, size);
+    }
+  }
+
+  // called once this rank is done communicating, before the communicator
+  // is deleted. its queued frames are written out and the listener, which
+  // relays between the other ranks, waits for all of them to disconnect
+  virtual void finalize(){
+    flushAggregates_();
+
+    bool all = rank_ == 0;
+
+    std::unique_lock<std::mutex> lock(drainMutex_);
+    while(!drained_(all)){
+      // notified without drainMutex_ held so check again now and then
+      drainCond_.wait_for(lock, std::chrono::milliseconds(10));
+    }
+  }
+
+  // pack raw and active messages of up to maxSize bytes bound for the
+  // same peer into one frame, written once flushSize bytes are packed or
+  // micros microseconds after the first. a maxSize of 0 turns this off
+  void setAggregation(size_t maxSize, size_t flushSize, uint32_t micros){
+    aggregateFlush_ = flushSize;
+    aggregateMicros_ = micros;
+    aggregateMax_ = maxSize;
+  }
+
+  void init(size_t groupSize){
+    assert(groupSize_ == 0);
+    groupSize_ = groupSize;
+  }
+
+  bool handleMessage(MessageBuffer* msg) override{
+    switch(msg->type()){
+      case MessageType::Rank:{
+        std::lock_guard<std::mutex> lock(peersMutex_);
+        rank_ = msg->as<RankMessage>()->rank;
+        peersCond_.notify_all();
+        return true;
+      }
+      default:
+        return false;
+    }
+  }
+
+protected:
+  struct NoEventLoop{};
+
+  // for communicators that deliver every message themselves, with no
+  // event loop thread or descriptors
+  Communicator(NoEventLoop)
+  : epollFD_(-1),
+  wakeFD_(-1),
+  timerFD_(-1),
+  loopThread_(nullptr){}
+
+  // something the event loop polls
+  class EventSource{
+  public:
+    virtual ~EventSource(){}
+
+    virtual void handleEvent(uint32_t events) = 0;
+  };
+
+  // hand msg, addressed to another rank, to the peer it goes through
+  virtual void transmit_(int rank, MessageBuffer* msg){
+    queue_(route_(rank), msg);
+  }
+
+  void setRank_(int rank){
+    std::lock_guard<std::mutex> lock(peersMutex_);
+    rank_ = rank;
+    peersCond_.notify_all();
+  }
+
+  // become rank 0, peers added later get the next free rank
+  void setListener_(){
+    std::lock_guard<std::mutex> lock(peersMutex_);
+    rank_ = 0;
+  }
+
+  // add a connected peer. the listener assigns its rank and tells it,
+  // otherwise the peer is rank 0 and this waits to learn its own rank
+  void addPeer_(Channel* channel){
+    auto p = new Peer(this, channel);
+
+    std::unique_lock<std::mutex> lock(peersMutex_);
+
+    peers_.push_back(p);
+
+    bool listener = rank_ == 0;
+
+    if(listener){
+      p->rank = rankPeers_.size() + 1;
+    }
+    else{
+      p->rank = 0;
+    }
+
+    rankPeers_.push_back(p);
+    peersCond_.notify_all();
+
+    std::vector<MessageBuffer*> parked;
+    for(auto itr = parked_.begin(); itr != parked_.end(); ){
+      if(int((*itr)->dest()) == p->rank){
+        parked.push_back(*itr);
+        itr = parked_.erase(itr);
+      }
+      else{
+        ++itr;
+      }
+    }
+    lock.unlock();
+
+    watch_(channel->readFD(), EPOLLIN, p);
+
+    if(channel->writeFD() != channel->readFD()){
+      watch_(channel->writeFD(), 0, &p->writer);
+    }
+
+    if(listener){
+      RankMessage rm;
+      rm.rank = p->rank;
+
+      auto msg = new MessageBuffer(rm, true);
+      msg->setSource(0);
+      msg->setDest(p->rank);
+      queue_(p, msg);
+
+      for(MessageBuffer* msg : parked){
+        queue_(p, msg);
+      }
+    }
+    else{
+      rank();
+    }
+  }
+
+  // watch fd for events, src->handleEvent() runs on the event loop
+  void watch_(int fd, uint32_t events, EventSource* src){
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    int status = epoll_ctl(epollFD_, EPOLL_CTL_ADD, fd, &ev);
+    assert(status == 0);
+    (void)status;
+  }
+
+  void modify_(int fd, uint32_t events, EventSource* src){
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    epoll_ctl(epollFD_, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+private:
+  friend class LoopbackCommunicator;
+
+  struct PostedReceive{
+    int rank;
+    char* buf;
+    size_t size;
+    Request* request;
+  };
+
+  class Peer : public EventSource{
+  public:
+    class Writer : public EventSource{
+    public:
+      Writer(Peer* peer)
+      : peer_(peer){}
+
+      void handleEvent(uint32_t events) override{
+        peer_->handleEvent(EPOLLOUT);
+      }
+
+    private:
+      Peer* peer_;
+    };
+
+    Peer(Communicator* comm, Channel* channel)
+    : comm(comm),
+    channel(channel),
+    writer(this){}
+
+    ~Peer(){
+      for(MessageBuffer* msg : sendQueue){
+        MessageBuffer::recycle(msg);
+      }
+
+      for(MessageBuffer* msg : sending){
+        MessageBuffer::recycle(msg);
+      }
+
+      free(aggregate);
+
+      if(receiving){
+        MessageBuffer::recycle(receiving);
+      }
+
+      delete channel;
+    }
+
+    void handleEvent(uint32_t events) override{
+      if(events & EPOLLOUT){
+        comm->write_(this);
+      }
+
+      if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+        comm->read_(this);
+      }
+    }
+
+    Communicator* comm;
+    Channel* channel;
+    Writer writer;
+    int rank = -1;
+    bool closed = false;
+
+    // guarded by sendMutex, pending is set while the peer is queued on
+    // the event loop or being written
+    std::mutex sendMutex;
+    std::deque<MessageBuffer*> sendQueue;
+    bool pending = false;
+
+    // guarded by sendMutex, small messages packed for the next aggregate
+    char* aggregate = nullptr;
+    size_t aggregateSize = 0;
+
+    // event loop only, the batch being written
+    std::vector<MessageBuffer*> sending;
+    std::vector<MessageHeader> headers;
+    std::vector<iovec> iov;
+    size_t iovOffset = 0;
+    bool wantWrite = false;
+
+    // event loop only, the frame being read
+    MessageHeader header;
+    size_t headerRead = 0;
+    MessageBuffer* receiving = nullptr;
+    char* target = nullptr;
+    size_t targetRead = 0;
+    PostedReceive post = {-1, nullptr, 0, nullptr};
+  };
+
+  class Waker : public EventSource{
+  public:
+    Waker(Communicator* comm)
+    : comm_(comm){}
+
+    void handleEvent(uint32_t events) override{
+      uint64_t n;
+      ssize_t r = ::read(comm_->wakeFD_, &n, sizeof(n));
+      (void)r;
+    }
+
+  private:
+    Communicator* comm_;
+  };
+
+  class FlushTimer : public EventSource{
+  public:
+    FlushTimer(Communicator* comm)
+    : comm_(comm){}
+
+    void handleEvent(uint32_t events) override{
+      uint64_t n;
+      ssize_t r = ::read(comm_->timerFD_, &n, sizeof(n));
+      (void)r;
+
+      // messages packed from here on arm it again
+      comm_->timerArmed_ = false;
+      comm_->flushAggregates_();
+    }
+
+  private:
+    Communicator* comm_;
+  };
+
+  // the peer a frame for rank is written to, waits for that rank to
+  // connect
+  Peer* route_(int rank){
+    std::unique_lock<std::mutex> lock(peersMutex_);
+
+    if(rank_ != 0){
+      peersCond_.wait(lock, [&]{ return !rankPeers_.empty(); });
+      return rankPeers_[0];
+    }
+
+    assert(rank > 0);
+    peersCond_.wait(lock, [&]{ return rankPeers_.size() >= size_t(rank); });
+    return rankPeers_[rank - 1];
+  }
+
+  void queue_(Peer* p, MessageBuffer* msg){
+    std::unique_lock<std::mutex> lock(p->sendMutex);
+
+    // a limit of 0 turns aggregation off, even for empty messages
+    size_t aggregateMax = aggregateMax_;
+
+    if((msg->type() == MessageType::Raw ||
+        msg->type() == MessageType::Active) &&
+       aggregateMax > 0 && msg->size() <= aggregateMax){
+      pack_(p, msg);
+
+      if(p->aggregateSize < aggregateFlush_){
+        lock.unlock();
+        packed_(msg);
+        armTimer_();
+        return;
+      }
+
+      flushAggregate_(p);
+      kick_(p, lock);
+      packed_(msg);
+      return;
+    }
+
+    // small messages packed earlier go first
+    flushAggregate_(p);
+    p->sendQueue.push_back(msg);
+    kick_(p, lock);
+  }
+
+  // with p's sendMutex held by lock, have its queue written
+  void kick_(Peer* p, std::unique_lock<std::mutex>& lock){
+    bool wasPending = p->pending;
+    p->pending = true;
+    lock.unlock();
+
+    if(wasPending){
+      return;
+    }
+
+    if(std::this_thread::get_id() == loopThread_->get_id()){
+      write_(p);
+      return;
+    }
+
+    std::unique_lock<std::mutex> pendingLock(pendingMutex_);
+    pending_.push_back(p);
+    pendingLock.unlock();
+    wake_();
+  }
+
+  // with p's sendMutex held, append msg to its aggregate
+  void pack_(Peer* p, MessageBuffer* msg){
+    if(!p->aggregate){
+      p->aggregate = (char*)malloc(aggregateFlush_ + sizeof(MessageHeader) +
+                                   aggregateMax_);
+    }
+
+    MessageHeader h;
+    memset(&h, 0, sizeof(h));
+    h.size = msg->size();
+    h.source = msg->source();
+    h.dest = msg->dest();
+    h.tag = msg->tag();
+    h.type = msg->type();
+
+    char* pos = p->aggregate + p->aggregateSize;
+    memcpy(pos, &h, sizeof(h));
+    memcpy(pos + sizeof(h), msg->buffer(), msg->size());
+    p->aggregateSize += sizeof(h) + msg->size();
+  }
+
+  // msg was copied into an aggregate, its buffer may be reused
+  void packed_(MessageBuffer* msg){
+    if(msg->request()){
+      msg->request()->complete(msg->size(), msg->dest());
+    }
+    MessageBuffer::recycle(msg);
+  }
+
+  // with p's sendMutex held, queue its aggregate as one frame
+  void flushAggregate_(Peer* p){
+    if(p->aggregateSize == 0){
+      return;
+    }
+
+    auto msg = new MessageBuffer(MessageType::Aggregate, p->aggregate,
+                                 p->aggregateSize, true);
+    msg->setSource(rank_);
+    msg->setDest(p->rank);
+    p->sendQueue.push_back(msg);
+
+    p->aggregate = nullptr;
+    p->aggregateSize = 0;
+  }
+
+  void flushAggregates_(){
+    std::unique_lock<std::mutex> peersLock(peersMutex_);
+    std::vector<Peer*> peers = peers_;
+    peersLock.unlock();
+
+    for(Peer* p : peers){
+      std::unique_lock<std::mutex> lock(p->sendMutex);
+      if(p->aggregateSize > 0){
+        flushAggregate_(p);
+        kick_(p, lock);
+      }
+    }
+  }
+
+  void armTimer_(){
+    if(timerArmed_.exchange(true)){
+      return;
+    }
+
+    itimerspec it;
+    memset(&it, 0, sizeof(it));
+    it.it_value.tv_sec = aggregateMicros_ / 1000000;
+    it.it_value.tv_nsec = (aggregateMicros_ % 1000000) * 1000;
+
+    // a zero value would disarm it
+    if(aggregateMicros_ == 0){
+      it.it_value.tv_nsec = 1;
+    }
+
+    timerfd_settime(timerFD_, 0, &it, nullptr);
+  }
+
+  void wake_(){
+    uint64_t n = 1;
+    ssize_t r = ::write(wakeFD_, &n, sizeof(n));
+    (void)r;
+  }
+
+  void run_(){
+    const int MAX_EVENTS = 64;
+    epoll_event events[MAX_EVENTS];
+
+    std::vector<Peer*> pending;
+
+    while(!stop_){
+      int n = epoll_wait(epollFD_, events, MAX_EVENTS, -1);
+
+      for(int i = 0; i < n; ++i){
+        auto src = static_cast<EventSource*>(events[i].data.ptr);
+        src->handleEvent(events[i].events);
+      }
+
+      pendingMutex_.lock();
+      pending.swap(pending_);
+      pendingMutex_.unlock();
+
+      for(Peer* p : pending){
+        write_(p);
+      }
+
+      pending.clear();
+    }
+  }
+
+  void setWantWrite_(Peer* p, bool flag){
+    if(p->wantWrite == flag){
+      return;
+    }
+
+    p->wantWrite = flag;
+
+    Channel* c = p->channel;
+    if(c->writeFD() == c->readFD()){
+      modify_(c->readFD(), flag ? EPOLLIN | EPOLLOUT : EPOLLIN, p);
+    }
+    else{
+      modify_(c->writeFD(), flag ? c->writeEvents() : 0, &p->writer);
+    }
+  }
+
+  // write queued frames to p as gathered writes of header, payload,
+  // header, payload... until the queue is empty or the channel is full
+  void write_(Peer* p){
+    for(;;){
+      if(p->iovOffset == p->iov.size()){
+        for(MessageBuffer* msg : p->sending){
+          if(msg->request()){
+            msg->request()->complete(msg->size(), msg->dest());
+          }
+          MessageBuffer::recycle(msg);
+        }
+        p->sending.clear();
+
+        std::unique_lock<std::mutex> lock(p->sendMutex);
+        if(p->sendQueue.empty() || p->closed){
+          p->pending = false;
+          lock.unlock();
+          setWantWrite_(p, false);
+          drainCond_.notify_all();
+          return;
+        }
+
+        p->sending.assign(p->sendQueue.begin(), p->sendQueue.end());
+        p->sendQueue.clear();
+        lock.unlock();
+
+        size_t n = p->sending.size();
+        p->headers.resize(n);
+        p->iov.resize(n * 2);
+        p->iovOffset = 0;
+
+        for(size_t i = 0; i < n; ++i){
+          MessageBuffer* msg = p->sending[i];
+          MessageHeader& h = p->headers[i];
+          memset(&h, 0, sizeof(h));
+          h.size = msg->size();
+          h.source = msg->source();
+          h.dest = msg->dest();
+          h.tag = msg->tag();
+          h.type = msg->type();
+
+          p->iov[i * 2] = {&h, sizeof(h)};
+          p->iov[i * 2 + 1] = {msg->buffer(), msg->size()};
+        }
+      }
+
+      iovec* iov = &p->iov[p->iovOffset];
+      int count = p->iov.size() - p->iovOffset;
+
+      ssize_t n = p->channel->write(iov, count);
+      if(n < 0){
+        close_(p);
+        return;
+      }
+
+      if(n == 0){
+        setWantWrite_(p, true);
+        return;
+      }
+
+      Channel::consume(iov, count, n);
+      p->iovOffset = p->iov.size() - count;
+    }
+  }
+
+  // read whatever p has available, delivering each complete frame
+  void read_(Peer* p){
+    while(!p->closed){
+      if(p->headerRead < sizeof(MessageHeader)){
+        ssize_t n = 
+          p->channel->read((char*)&p->header + p->headerRead,
+                           sizeof(MessageHeader) - p->headerRead);
+        if(n < 0){
+          close_(p);
+          return;
+        }
+
+        if(n == 0){
+          return;
+        }
+
+        p->headerRead += n;
+        if(p->headerRead < sizeof(MessageHeader)){
+          continue;
+        }
+
+        startFrame_(p);
+      }
+
+      MessageHeader& h = p->header;
+
+      while(p->targetRead < h.size){
+        ssize_t n = p->channel->read(p->target + p->targetRead,
+                                     h.size - p->targetRead);
+        if(n < 0){
+          close_(p);
+          return;
+        }
+
+        if(n == 0){
+          return;
+        }
+
+        p->targetRead += n;
+      }
+
+      finishFrame_(p);
+    }
+  }
+
+  // a raw frame for this rank goes straight into the buffer of the first
+  // matching posted receive if it fits, anything else into a pool buffer
+  void startFrame_(Peer* p){
+    MessageHeader& h = p->header;
+
+    p->targetRead = 0;
+    p->post.request = nullptr;
+
+    if(h.type == MessageType::Raw && int(h.dest) == rank_){
+      std::lock_guard<std::mutex> lock(receiveMutex_);
+
+      if(takePosted_(h.source, p->post) && h.size <= p->post.size){
+        p->target = p->post.buf;
+        return;
+      }
+    }
+
+    MessageBuffer* msg = pool_.acquire(h.type, h.size);
+    msg->setSource(h.source);
+    msg->setDest(h.dest);
+    msg->setTag(h.tag);
+
+    p->receiving = msg;
+    p->target = msg->buffer();
+  }
+
+  void finishFrame_(Peer* p){
+    MessageHeader& h = p->header;
+
+    p->headerRead = 0;
+
+    Request* request = p->post.request;
+
+    if(request && !p->receiving){
+      request->complete(h.size, h.source);
+      return;
+    }
+
+    MessageBuffer* msg = p->receiving;
+    p->receiving = nullptr;
+
+    // too large for the posted buffer it matched
+    if(request){
+      complete_(p->post, msg);
+      return;
+    }
 
-  char* buffer(){
-    return buf_;
-  }
+    if(h.type == MessageType::Aggregate){
+      unpack_(msg);
+      return;
+    }
 
-  uint32_t size() const{
-    return size_;
-  }
-  
-  MessageType type(){
-    return type_;
+    dispatch_(msg);
   }
 
-private:
-  MessageType type_;
-  char* buf_;
-  uint32_t size_;
-  bool owned_;
-};
+  // each message packed in an aggregate is routed on its own
+  void unpack_(MessageBuffer* aggregate){
+    char* pos = aggregate->buffer();
+    char* end = pos + aggregate->size();
 
-class MessageHandler{
-public:
-  virtual bool handleMessage(MessageBuffer* msg) = 0;
-};
+    while(pos < end){
+      MessageHeader h;
+      memcpy(&h, pos, sizeof(h));
+      pos += sizeof(h);
 
-class MessageDispatcher{
-public:
-  MessageDispatcher(MessageHandler* handler,
-                    Channel* sendChannel,
-                    Channel* receiveChannel)
-  : handler_(handler), 
-  sendChannel_(sendChannel),
-  receiveChannel_(receiveChannel){}
+      MessageBuffer* msg = pool_.acquire(h.type, h.size);
+      memcpy(msg->buffer(), pos, h.size);
+      msg->setSource(h.source);
+      msg->setDest(h.dest);
+      msg->setTag(h.tag);
+      pos += h.size;
 
-  ~MessageDispatcher(){
-    delete sendChannel_;
-    delete receiveChannel_;
-  }
+      dispatch_(msg);
+    }
 
-  void setSendThread(std::thread* t){
-    sendThread_ = t;
+    MessageBuffer::recycle(aggregate);
   }
 
-  void setReceiveThread(std::thread* t){
-    receiveThread_ = t;
-  }
+  void dispatch_(MessageBuffer* msg){
+    // the listener relays frames between the other ranks
+    if(rank_ == 0 && msg->dest() != 0){
+      std::unique_lock<std::mutex> lock(peersMutex_);
 
-  void runSend(){
-    for(;;){
-      sendSem_.acquire();
-      sendMutex_.lock();
-      MessageBuffer* msg = sendQueue_.front();
-      sendQueue_.pop_front();
-      sendMutex_.unlock();
+      // held until that rank connects
+      if(msg->dest() > rankPeers_.size()){
+        parked_.push_back(msg);
+        return;
+      }
 
-      uint32_t size = msg->size();
-      char sbuf[5];
-      memcpy(sbuf, &size, 4);
-      sbuf[4] = char(msg->type());
-      sendChannel_->send(sbuf, 5);
-      sendChannel_->send(msg->buffer(), size);
+      Peer* dest = rankPeers_[msg->dest() - 1];
+      lock.unlock();
 
-      delete msg;
+      queue_(dest, msg);
+      return;
     }
+
+    deliver_(msg);
   }
 
-  void runReceive(){
-    for(;;){
-      char sbuf[5];
-      receiveChannel_->receive(sbuf, 5);
-      uint32_t size = *((uint32_t*)sbuf);
-      MessageType type = MessageType(sbuf[4]);
+  void deliver_(MessageBuffer* msg){
+    // collective traffic is matched by the collective calls and never
+    // seen by receive()
+    if(msg->type() == MessageType::Collective){
+      std::unique_lock<std::mutex> lock(collectiveMutex_);
+      collectiveQueue_.push_back(msg);
+      lock.unlock();
+      collectiveCond_.notify_all();
+      return;
+    }
 
-      MessageBuffer* msg = new MessageBuffer(type, size, false);
-      receiveChannel_->receive(msg->buffer(), size);
+    if(msg->type() == MessageType::Active){
+      runActive_(msg);
+      return;
+    }
 
-      if(handler_->handleMessage(msg)){
-        delete msg;
-        continue;
-      }
+    if(handleMessage(msg)){
+      MessageBuffer::recycle(msg);
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(receiveMutex_);
 
-      receiveMutex_.lock();
-      receiveQueue_.push_back(msg);
-      receiveMutex_.unlock();
-      receiveSem_.release();
+    PostedReceive post = {-1, nullptr, 0, nullptr};
+    if(msg->type() == MessageType::Raw && takePosted_(msg->source(), post)){
+      lock.unlock();
+      complete_(post, msg);
+      return;
     }
-  }
 
-  void send(MessageBuffer* msg){
-    sendMutex_.lock();
-    sendQueue_.push_back(msg);
-    sendMutex_.unlock();
-    sendSem_.release();
+    receiveQueue_.push_back(msg);
+    lock.unlock();
+    receiveCond_.notify_all();
   }
 
-  MessageBuffer* receive(){
-    receiveSem_.acquire();
-    receiveMutex_.lock();
-    MessageBuffer* msg = receiveQueue_.front();
-    receiveQueue_.pop_front();
-    receiveMutex_.unlock();
-    return msg;
-  }
+  void runActive_(MessageBuffer* msg){
+    std::unique_lock<std::mutex> lock(handlersMutex_);
 
-private:
-  std::thread* sendThread_;
-  std::thread* receiveThread_;
-  Channel* sendChannel_;
-  Channel* receiveChannel_;
-
-  CVSemaphore sendSem_;
-  std::mutex sendMutex_;
-  std::deque<MessageBuffer*> sendQueue_;
-  
-  CVSemaphore receiveSem_;
-  std::mutex receiveMutex_;
-  std::deque<MessageBuffer*> receiveQueue_;
+    auto itr = handlers_.find(msg->tag());
+    if(itr == handlers_.end()){
+      unhandled_.push_back(msg);
+      return;
+    }
 
-  MessageHandler* handler_;
-};
+    ActiveHandler handler = itr->second;
+    lock.unlock();
 
-class Communicator : public MessageHandler{
-public:
-  class Barrier{
-  public:
-    Barrier(int n)
-    : sem_(n){}
+    handler(msg);
+  }
 
-    void release(){
-      sem_.release();
+  void close_(Peer* p){
+    if(p->closed){
+      return;
     }
 
-    void acquire(){
-      sem_.acquire();
+    std::unique_lock<std::mutex> lock(p->sendMutex);
+    p->closed = true;
+    lock.unlock();
+
+    Channel* c = p->channel;
+    epoll_ctl(epollFD_, EPOLL_CTL_DEL, c->readFD(), nullptr);
+    if(c->writeFD() != c->readFD()){
+      epoll_ctl(epollFD_, EPOLL_CTL_DEL, c->writeFD(), nullptr);
     }
 
-  private:
-    CVSemaphore sem_;
-  };
+    drainCond_.notify_all();
+  }
 
-  virtual ~Communicator(){
-    for(MessageDispatcher* h : dispatchers_){
-      delete h;
+  // every frame queued so far has been written, or every peer has
+  // disconnected if all is set
+  bool drained_(bool all){
+    std::lock_guard<std::mutex> lock(peersMutex_);
+
+    if(all && peers_.size() + 1 < groupSize_){
+      return false;
+    }
+
+    for(Peer* p : peers_){
+      std::lock_guard<std::mutex> sendLock(p->sendMutex);
+      if(all ? !p->closed : p->pending && !p->closed){
+        return false;
+      }
     }
+
+    return true;
   }
 
-  void addDispatcher(MessageDispatcher* dispatcher){
-    dispatchers_.push_back(dispatcher);
+  // ring allreduce is used from this many bytes
+  static const size_t RING_THRESHOLD = 64 * 1024;
 
-    auto sendThread = new std::thread(&MessageDispatcher::runSend, dispatcher);
-    dispatcher->setSendThread(sendThread);
+  // the low bits of a collective tag are the step within the call
+  static const uint32_t STEP_BITS = 12;
 
-    auto receiveThread = new std::thread(&MessageDispatcher::runReceive, dispatcher);
-    dispatcher->setReceiveThread(receiveThread);
+  uint32_t nextCollective_(){
+    assert(groupSize_ > 0);
+    return collectiveSeq_++;
   }
 
-  void send(MessageBuffer* buf){
-    dispatchers_[0]->send(buf);
+  static uint32_t collectiveTag_(uint32_t seq, uint32_t step){
+    assert(step < (1u << STEP_BITS));
+    return (seq << STEP_BITS) | step;
   }
 
-  MessageBuffer* receive(){
-    return dispatchers_[0]->receive();
+  // rank relative to root, root is 0
+  size_t relativeRank_(int root){
+    return (rank() + groupSize_ - root) % groupSize_;
   }
 
-  void createdConnection(){
-    ++numConnections_;
+  int absoluteRank_(size_t vr, int root){
+    return (vr + root) % groupSize_;
   }
 
-  virtual bool isListener() = 0; 
+  void sendCollective_(int rank, const void* buf, size_t size,
+                       uint32_t seq, uint32_t step){
+    auto msg = new MessageBuffer(MessageType::Collective, size, true);
+    if(size > 0){
+      memcpy(msg->buffer(), buf, size);
+    }
+    msg->setTag(collectiveTag_(seq, step));
+    send(rank, msg);
+  }
 
-  void barrier(){
-    assert(barrier_);
+  MessageBuffer* receiveCollective_(int rank, uint32_t seq, uint32_t step){
+    uint32_t tag = collectiveTag_(seq, step);
 
-    BarrierMessage bm;
-    auto msg = new MessageBuffer(bm, true);
+    std::unique_lock<std::mutex> lock(collectiveMutex_);
 
-    send(msg);
+    auto itr = collectiveQueue_.end();
+    collectiveCond_.wait(lock, [&]{
+      itr = std::find_if(collectiveQueue_.begin(), collectiveQueue_.end(),
+                         [&](MessageBuffer* msg){
+                           return int(msg->source()) == rank &&
+                             msg->tag() == tag;
+                         });
+      return itr != collectiveQueue_.end();
+    });
 
-    barrier_->acquire();
+    MessageBuffer* msg = *itr;
+    collectiveQueue_.erase(itr);
+    return msg;
   }
 
-  void init(size_t groupSize){
-    assert(!barrier_);
-    barrier_ = new Barrier(2 - (int)groupSize);
+  void receiveCollective_(int rank, uint32_t seq, uint32_t step,
+                          void* buf, size_t size){
+    MessageBuffer* msg = receiveCollective_(rank, seq, step);
+    assert(msg->size() == size);
+    memcpy(buf, msg->buffer(), size);
+    MessageBuffer::recycle(msg);
   }
 
-  bool handleMessage(MessageBuffer* msg) override{
-    switch(msg->type()){
-      case MessageType::Barrier:{
-        auto bm = msg->as<BarrierMessage>();
-        assert(barrier_);
-        barrier_->release();
-        return true;
-      }
-      default:
-        return false;
+  template<class T, class Op>
+  static void combine_(T* acc, const T* x, size_t count, Op op){
+    for(size_t i = 0; i < count; ++i){
+      acc[i] = op(acc[i], x[i]);
     }
   }
 
-private:
-  using MessageDispatcherVec = std::vector<MessageDispatcher*>;
+  // with receiveMutex_ held, remove the first receive posted for source
+  bool takePosted_(int source, PostedReceive& post){
+    auto itr = std::find_if(posted_.begin(), posted_.end(),
+                            [&](const PostedReceive& p){
+                              return p.rank < 0 || p.rank == source;
+                            });
+
+    if(itr == posted_.end()){
+      return false;
+    }
+
+    post = *itr;
+    posted_.erase(itr);
+    return true;
+  }
+
+  void complete_(const PostedReceive& post, MessageBuffer* msg){
+    memcpy(post.buf, msg->buffer(), std::min<size_t>(post.size, msg->size()));
+    post.request->complete(msg->size(), msg->source());
+    MessageBuffer::recycle(msg);
+  }
+
+  std::deque<MessageBuffer*>::iterator findQueued_(int rank){
+    if(rank < 0){
+      return receiveQueue_.begin();
+    }
+
+    return std::find_if(receiveQueue_.begin(), receiveQueue_.end(),
+                        [&](MessageBuffer* msg){
+                          return int(msg->source()) == rank;
+                        });
+  }
+
+  int epollFD_;
+  int wakeFD_;
+  Waker waker_{this};
+  int timerFD_;
+  FlushTimer flushTimer_{this};
+  std::atomic<bool> timerArmed_{false};
+
+  std::atomic<size_t> aggregateMax_{0};
+  std::atomic<size_t> aggregateFlush_{0};
+  std::atomic<uint32_t> aggregateMicros_{0};
+  std::thread* loopThread_;
+  std::atomic<bool> stop_{false};
+
+  std::mutex pendingMutex_;
+  std::vector<Peer*> pending_;
+
+  std::mutex drainMutex_;
+  std::condition_variable drainCond_;
+
+  // peers in rank order, the listener has every other rank, other
+  // ranks only have the listener
+  std::mutex peersMutex_;
+  std::condition_variable peersCond_;
+  std::vector<Peer*> peers_;
+  std::vector<Peer*> rankPeers_;
+  std::deque<MessageBuffer*> parked_;
+  std::atomic<int> rank_{-1};
+  size_t groupSize_ = 0;
+
+  std::mutex receiveMutex_;
+  std::condition_variable receiveCond_;
+  std::deque<MessageBuffer*> receiveQueue_;
+  MessageBufferPool pool_;
+
+  // receives waiting for a message, guarded by receiveMutex_
+  std::deque<PostedReceive> posted_;
+
+  std::mutex collectiveMutex_;
+  std::condition_variable collectiveCond_;
+  std::deque<MessageBuffer*> collectiveQueue_;
+  uint32_t collectiveSeq_ = 0;
 
-  MessageDispatcherVec dispatchers_;
-  Barrier* barrier_ = nullptr;
-  size_t numConnections_ = 0;
+  std::mutex handlersMutex_;
+  std::unordered_map<uint32_t, ActiveHandler> handlers_;
+  std::vector<MessageBuffer*> unhandled_;
+  std::atomic<uint32_t> nextHandler_{0};
 };
 
 class SocketCommunicator : public Communicator{
 public:
-  SocketCommunicator(){}
+  SocketCommunicator()
+  : listener_(this){}
+
+  ~SocketCommunicator(){
+    // also stops the event loop watching it
+    if(listenFD_ >= 0){
+      ::close(listenFD_);
+    }
+  }
 
   bool listen(int port){
     listenFD_ = socket(PF_INET, SOCK_STREAM, 0);
@@ -413,7 +2026,11 @@ public:
     
     port_ = port;
 
-    auto t = new std::thread(&SocketCommunicator::accept_, this);
+    setListener_();
+
+    // connections are accepted on the event loop
+    fcntl(listenFD_, F_SETFL, fcntl(listenFD_, F_GETFL) | O_NONBLOCK);
+    watch_(listenFD_, EPOLLIN, &listener_);
 
     return true;
   }
@@ -443,51 +2060,53 @@ public:
     addr.sin_port = htons(port);
     
     if(::connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0){
+      ::close(fd);
       return false;
     }
     
-    auto channel = new SocketChannel(fd);
-    auto dispatcher = new MessageDispatcher(this, channel, channel);
-
-    addDispatcher(dispatcher);
+    addPeer_(new SocketChannel(fd));
 
     return true;
   }
 
+  bool isListener() override{
+    return listenFD_ > 0;
+  }
+
+private:
+  class Listener : public EventSource{
+  public:
+    Listener(SocketCommunicator* comm)
+    : comm_(comm){}
+
+    void handleEvent(uint32_t events) override{
+      comm_->accept_();
+    }
+
+  private:
+    SocketCommunicator* comm_;
+  };
+
   void accept_(){
     for(;;){
-      int opts = fcntl(listenFD_, F_GETFL);
-      opts &= ~O_NONBLOCK;
-      
-      fcntl(listenFD_, F_SETFL, opts);
-      
       sockaddr addr;
       socklen_t len = sizeof(sockaddr);
             
       int fd = ::accept(listenFD_, &addr, &len);
       
       if(fd < 0){
-        continue;
+        return;
       }
       
       int reuseOn = 1;
       setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, 
                  &reuseOn, sizeof(reuseOn));
 
-      auto channel = new SocketChannel(fd);
-      auto dispatcher = new MessageDispatcher(this, channel, channel);
-
-      addDispatcher(dispatcher);
-
-      createdConnection();
+      addPeer_(new SocketChannel(fd));
     }
   }
 
-  bool isListener() override{
-    return listenFD_ > 0;
-  }
-
-private:
+  Listener listener_;
   int port_ = -1;
   int listenFD_ = -1;
 };
@@ -509,15 +2128,11 @@ public:
     int receiveFD = open(receivePath.c_str(), O_RDONLY);
     assert(receiveFD > 0);
 
-    auto sendChannel = new FIFOChannel(sendFD);
-    auto receiveChannel = new FIFOChannel(receiveFD);
-    auto dispatcher = new MessageDispatcher(this, sendChannel, receiveChannel);
-
-    addDispatcher(dispatcher);
-
     isListener_ = true;
 
-    createdConnection();
+    setListener_();
+
+    addPeer_(new FIFOChannel(receiveFD, sendFD));
 
     return true;
   }
@@ -529,14 +2144,10 @@ public:
     int sendFD = open(sendPath.c_str(), O_WRONLY);
     assert(sendFD > 0);
 
-    auto sendChannel = new FIFOChannel(sendFD);
-    auto receiveChannel = new FIFOChannel(receiveFD);
-    auto dispatcher = new MessageDispatcher(this, sendChannel, receiveChannel);
-
-    addDispatcher(dispatcher);
-
     isListener_ = false;
 
+    addPeer_(new FIFOChannel(receiveFD, sendFD));
+
     return true;
   }
 
@@ -548,6 +2159,253 @@ private:
   bool isListener_ = false;
 };
 
+// ranks on one node, the listener accepts on a unix socket at path and
+// hands each connecting process a SharedMemoryChannel
+class SharedMemoryCommunicator : public Communicator{
+public:
+  SharedMemoryCommunicator()
+  : listener_(this){}
+
+  ~SharedMemoryCommunicator(){
+    if(listenFD_ >= 0){
+      ::close(listenFD_);
+      unlink(path_.c_str());
+    }
+  }
+
+  bool listen(const std::string& path){
+    sockaddr_un addr;
+    if(!address_(path, addr)){
+      return false;
+    }
+
+    listenFD_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenFD_ < 0){
+      return false;
+    }
+
+    unlink(path.c_str());
+
+    if(::bind(listenFD_, (const sockaddr*)&addr, sizeof(addr)) < 0){
+      return false;
+    }
+
+    if(::listen(listenFD_, 500) < 0){
+      return false;
+    }
+
+    path_ = path;
+
+    setListener_();
+
+    fcntl(listenFD_, F_SETFL, fcntl(listenFD_, F_GETFL) | O_NONBLOCK);
+    watch_(listenFD_, EPOLLIN, &listener_);
+
+    return true;
+  }
+
+  bool connect(const std::string& path){
+    sockaddr_un addr;
+    if(!address_(path, addr)){
+      return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0){
+      return false;
+    }
+
+    if(::connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0){
+      ::close(fd);
+      return false;
+    }
+
+    int fds[SharedMemoryChannel::NUM_FDS];
+    bool received = receiveFDs_(fd, fds);
+    ::close(fd);
+
+    if(!received){
+      return false;
+    }
+
+    addPeer_(new SharedMemoryChannel(fds, false));
+
+    return true;
+  }
+
+  bool isListener() override{
+    return listenFD_ >= 0;
+  }
+
+private:
+  class Listener : public EventSource{
+  public:
+    Listener(SharedMemoryCommunicator* comm)
+    : comm_(comm){}
+
+    void handleEvent(uint32_t events) override{
+      comm_->accept_();
+    }
+
+  private:
+    SharedMemoryCommunicator* comm_;
+  };
+
+  void accept_(){
+    for(;;){
+      int fd = ::accept(listenFD_, nullptr, nullptr);
+
+      if(fd < 0){
+        return;
+      }
+
+      int fds[SharedMemoryChannel::NUM_FDS];
+      if(!SharedMemoryChannel::create(fds)){
+        ::close(fd);
+        continue;
+      }
+
+      bool sent = sendFDs_(fd, fds);
+      ::close(fd);
+
+      // the peer has its own copies of the descriptors
+      if(sent){
+        addPeer_(new SharedMemoryChannel(fds, true));
+      }
+      else{
+        for(int i = 0; i < SharedMemoryChannel::NUM_FDS; ++i){
+          ::close(fds[i]);
+        }
+      }
+    }
+  }
+
+  static bool address_(const std::string& path, sockaddr_un& addr){
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if(path.size() >= sizeof(addr.sun_path)){
+      return false;
+    }
+
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+  }
+
+  // descriptors go as SCM_RIGHTS ancillary data on a one byte message
+  static bool sendFDs_(int fd, const int* fds){
+    const size_t n = SharedMemoryChannel::NUM_FDS;
+
+    char byte = 0;
+    iovec iov = {&byte, 1};
+
+    char control[CMSG_SPACE(sizeof(int) * n)];
+    memset(control, 0, sizeof(control));
+
+    msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * n);
+
+    return ::sendmsg(fd, &mh, MSG_NOSIGNAL) == 1;
+  }
+
+  static bool receiveFDs_(int fd, int* fds){
+    const size_t n = SharedMemoryChannel::NUM_FDS;
+
+    char byte;
+    iovec iov = {&byte, 1};
+
+    char control[CMSG_SPACE(sizeof(int) * n)];
+
+    msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    if(::recvmsg(fd, &mh, 0) != 1){
+      return false;
+    }
+
+    cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    if(!cm || cm->cmsg_type != SCM_RIGHTS ||
+       cm->cmsg_len != CMSG_LEN(sizeof(int) * n)){
+      return false;
+    }
+
+    memcpy(fds, CMSG_DATA(cm), sizeof(int) * n);
+    return true;
+  }
+
+  Listener listener_;
+  std::string path_;
+  int listenFD_ = -1;
+};
+
+// ranks that are threads of this process. a message is handed to the
+// receiving rank's queue as is, only a nonblocking send is copied since
+// its buffer is the caller's once its request completes
+class LoopbackCommunicator : public Communicator{
+public:
+  typedef std::vector<LoopbackCommunicator*> Group;
+
+  // rank i of the group is element i
+  static Group createGroup(size_t groupSize){
+    auto group = std::make_shared<Group>();
+
+    for(size_t i = 0; i < groupSize; ++i){
+      group->push_back(new LoopbackCommunicator(i, group));
+    }
+
+    return *group;
+  }
+
+  bool isListener() override{
+    return rank() == 0;
+  }
+
+  // every message was delivered by the send that queued it
+  void finalize() override{}
+
+protected:
+  void transmit_(int rank, MessageBuffer* msg) override{
+    assert(size_t(rank) < group_->size());
+
+    if(Request* request = msg->request()){
+      MessageBuffer* copy = pool_.acquire(msg->type(), msg->size());
+      memcpy(copy->buffer(), msg->buffer(), msg->size());
+      copy->setSource(msg->source());
+      copy->setDest(msg->dest());
+      copy->setTag(msg->tag());
+
+      request->complete(msg->size(), rank);
+      MessageBuffer::recycle(msg);
+      msg = copy;
+    }
+
+    (*group_)[rank]->deliver_(msg);
+  }
+
+private:
+  LoopbackCommunicator(int rank, std::shared_ptr<Group> group)
+  : Communicator(NoEventLoop()),
+  group_(group){
+    setRank_(rank);
+  }
+
+  std::shared_ptr<Group> group_;
+};
+
 } // namespace ares
 
 #endif // __ARES_COMMUNICATION_H__
@@ -49,7 +49,7 @@
  * #####
  */
 
-//#define USE_ARGO_BOTS 1
+//#define USE_ARGOBOTS 1
 
 #include <iostream>
 #include <cmath>
@@ -58,20 +58,29 @@
 #include <atomic>
 #include <vector>
 #include <functional>
+#include <algorithm>
 #include <cassert>
 #include <deque>
 #include <queue>
+#include <condition_variable>
 
-#ifdef USE_ARGO_BOTS
-#include "ArgoPool.h"
+#ifdef USE_ARGOBOTS
+#include "ArgoPool.hpp"
 #else
 #include "ThreadPool.h"
 #endif
 
+#ifdef USE_KOKKOS
+#include "KokkosPool.h"
+#endif
+
 #include "Barrier.h"
+#include "CVSemaphore.h"
 
 #include "communication.h"
 
+#include "ares/runtime.h"
+
 using namespace std;
 using namespace ares;
 
@@ -94,7 +103,14 @@ namespace{
     }
 
     void await(){
+#ifdef USE_ARGOBOTS
+      // blocking would stall every ULT on this execution stream
+      while(!sem_.tryAcquire()){
+        ArgoPool::AP_yield();
+      }
+#else
       sem_.acquire();
+#endif
     }
 
     bool tryAwait(){
@@ -116,22 +132,164 @@ namespace{
     void* args;
   };
 
-  struct TaskArg{
-    TaskArg(Synch* futureSync)
-      : futureSync(futureSync){}
+  class TaskGroup{
+  public:
+    TaskGroup()
+    : count_(0){}
+
+    void add(){
+      std::unique_lock<std::mutex> lock(mutex_);
+      ++count_;
+    }
+
+    void release(){
+      std::unique_lock<std::mutex> lock(mutex_);
+      if(--count_ == 0){
+        cond_.notify_all();
+      }
+    }
+
+    void await(){
+#ifdef USE_ARGOBOTS
+      while(!tryAwait()){
+        ArgoPool::AP_yield();
+      }
+#else
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [&]{ return count_ == 0; });
+#endif
+    }
+
+    bool tryAwait(){
+      std::unique_lock<std::mutex> lock(mutex_);
+      return count_ == 0;
+    }
+
+  private:
+    std::condition_variable cond_;
+    std::mutex mutex_;
+    size_t count_;
+  };
 
+  // header of the args struct generated for each task, the return value
+  // and parameters follow
+  struct TaskArg{
     Synch* futureSync;
-    uint32_t depth;
+    TaskGroup* group;
   };
 
-#ifdef USE_ARGO_BOTS
-  ArgoPool* _threadPool = new ArgoPool;
+#ifdef USE_ARGOBOTS
+  ArgoPool* _threadPool = new ArgoPool(0, nullptr, NUM_THREADS);
 #else
   ThreadPool* _threadPool = new ThreadPool(NUM_THREADS);
 #endif
 
+#ifdef USE_KOKKOS
+  // created on first use, Kokkos has its own statics to initialize, the
+  // thread that launches the first loop becomes the Kokkos master
+  KokkosPool& kokkosPool(){
+    static KokkosPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+  }
+
+  template<typename T>
+  void parallelReduce(void* fp, void* args, uint32_t start, uint32_t end,
+                      uint32_t sum, void* result){
+    using BodyFunc = void(*)(void*, T*, uint32_t);
+    auto body = reinterpret_cast<BodyFunc>(fp);
+
+    *reinterpret_cast<T*>(result) =
+      kokkosPool().parallelReduce<T>(start, end, sum,
+        [=](uint32_t i, T& v){
+          body(args, &v, i);
+        });
+  }
+#endif
+
   Communicator* _communicator = nullptr;
 
+  void finalizeCommunicator(){
+    _communicator->finalize();
+    delete _communicator;
+    _communicator = nullptr;
+  }
+
+  // peers are only disconnected once this process is done with them
+  void setCommunicator(Communicator* c){
+    assert(!_communicator);
+    _communicator = c;
+    atexit(finalizeCommunicator);
+  }
+
+  // set on the threads of a loopback rank, and on a pool thread while it
+  // runs a task queued by one
+  thread_local Communicator* _localCommunicator = nullptr;
+
+  Communicator* communicator(){
+    return _localCommunicator ? _localCommunicator : _communicator;
+  }
+
+  // wraps f to run with c as its thread's communicator
+  template<typename F>
+  std::function<void()>* withCommunicator(Communicator* c, F f){
+    return new std::function<void()>([=]{
+      Communicator* prev = _localCommunicator;
+      _localCommunicator = c;
+      f();
+      _localCommunicator = prev;
+    });
+  }
+
+  // runs and frees a queued std::function
+  void runTask(void* arg){
+    auto f = reinterpret_cast<std::function<void()>*>(arg);
+    (*f)();
+    delete f;
+  }
+
+  template<typename T, typename F>
+  void withOp(ReduceOp op, F f){
+    switch(op){
+      case ReduceOp::Sum:
+        f(T(), [](T a, T b){ return a + b; });
+        break;
+      case ReduceOp::Product:
+        f(T(), [](T a, T b){ return a * b; });
+        break;
+      case ReduceOp::Min:
+        f(T(), [](T a, T b){ return std::min(a, b); });
+        break;
+      case ReduceOp::Max:
+        f(T(), [](T a, T b){ return std::max(a, b); });
+        break;
+    }
+  }
+
+  // calls f(T(), op) with the element type and combining functor
+  template<typename F>
+  void withReduction(DataType type, ReduceOp op, F f){
+    switch(type){
+      case DataType::Int32:
+        withOp<int32_t>(op, f);
+        break;
+      case DataType::Int64:
+        withOp<int64_t>(op, f);
+        break;
+      case DataType::UInt32:
+        withOp<uint32_t>(op, f);
+        break;
+      case DataType::UInt64:
+        withOp<uint64_t>(op, f);
+        break;
+      case DataType::Float:
+        withOp<float>(op, f);
+        break;
+      case DataType::Double:
+        withOp<double>(op, f);
+        break;
+    }
+  }
+
 } // namespace
 
 extern "C"{
@@ -148,6 +306,27 @@ extern "C"{
     return new Synch(count);
   }
 
+#ifdef USE_ARGOBOTS
+  // ABT barriers suspend the waiting ULT instead of its execution stream
+  void* __ares_create_barrier(uint32_t count){
+    auto b = new ABT_barrier;
+    int ret = ABT_barrier_create(count, b);
+    assert(ret == ABT_SUCCESS);
+    (void)ret;
+    return b;
+  }
+
+  void __ares_wait_barrier(void* barrier){
+    auto b = static_cast<ABT_barrier*>(barrier);
+    ABT_barrier_wait(*b);
+  }
+
+  void __ares_delete_barrier(void* barrier){
+    auto b = static_cast<ABT_barrier*>(barrier);
+    ABT_barrier_free(b);
+    delete b;
+  }
+#else
   void* __ares_create_barrier(uint32_t count){
     return new Barrier(count);
   }
@@ -161,6 +340,7 @@ extern "C"{
     auto b = static_cast<Barrier*>(barrier);
     delete b;
   }
+#endif
 
   void __ares_queue_func(void* synch, void* args, void* fp,
                          uint32_t index, uint32_t priority){
@@ -170,10 +350,53 @@ extern "C"{
 
   void __ares_finish_func(void* arg){
     auto a = reinterpret_cast<FuncArg*>(arg);
+
+    // range launches own their FuncArg and have no synch
+    if(!a->synch){
+      return;
+    }
+
     a->synch->release();
     delete a;
   }
 
+#ifdef USE_KOKKOS
+  void __ares_parallel_for(void* fp, void* args, uint32_t start,
+                           uint32_t end, uint32_t priority){
+    auto body = reinterpret_cast<FuncPtr>(fp);
+
+    kokkosPool().parallelFor(start, end,
+      [=](uint32_t i){
+        FuncArg a(nullptr, i, args);
+        body(&a);
+      });
+  }
+
+  void __ares_parallel_reduce_i32(void* fp, void* args, uint32_t start,
+                                  uint32_t end, uint32_t sum, void* result,
+                                  uint32_t priority){
+    parallelReduce<int32_t>(fp, args, start, end, sum, result);
+  }
+
+  void __ares_parallel_reduce_i64(void* fp, void* args, uint32_t start,
+                                  uint32_t end, uint32_t sum, void* result,
+                                  uint32_t priority){
+    parallelReduce<int64_t>(fp, args, start, end, sum, result);
+  }
+
+  void __ares_parallel_reduce_f32(void* fp, void* args, uint32_t start,
+                                  uint32_t end, uint32_t sum, void* result,
+                                  uint32_t priority){
+    parallelReduce<float>(fp, args, start, end, sum, result);
+  }
+
+  void __ares_parallel_reduce_f64(void* fp, void* args, uint32_t start,
+                                  uint32_t end, uint32_t sum, void* result,
+                                  uint32_t priority){
+    parallelReduce<double>(fp, args, start, end, sum, result);
+  }
+#endif
+
   void __ares_signal_synch(void* sync){
     auto s = reinterpret_cast<Synch*>(sync);
     s->release();
@@ -185,11 +408,51 @@ extern "C"{
     delete s;
   }
 
-  void __ares_task_queue(void* funcPtr, void* argsPtr){
+  bool __ares_try_await_synch(void* synch){
+    auto s = reinterpret_cast<Synch*>(synch);
+    if(s->tryAwait()){
+      delete s;
+      return true;
+    }
+    return false;
+  }
+
+  void __ares_task_queue(void* funcPtr, void* argsPtr, uint32_t priority){
     auto func = reinterpret_cast<FuncPtr>(funcPtr);
     auto args = reinterpret_cast<TaskArg*>(argsPtr);
     args->futureSync = new Synch(1);
-    _threadPool->push(func, args, 0);
+    args->group = nullptr;
+    _threadPool->push(func, args, priority);
+  }
+
+  void* __ares_create_task_group(){
+    return new TaskGroup;
+  }
+
+  void __ares_task_group_queue(void* group, void* funcPtr, void* argsPtr,
+                               uint32_t priority){
+    auto g = reinterpret_cast<TaskGroup*>(group);
+    auto func = reinterpret_cast<FuncPtr>(funcPtr);
+    auto args = reinterpret_cast<TaskArg*>(argsPtr);
+    args->futureSync = nullptr;
+    args->group = g;
+    g->add();
+    _threadPool->push(func, args, priority);
+  }
+
+  void __ares_task_group_await(void* group){
+    auto g = reinterpret_cast<TaskGroup*>(group);
+    g->await();
+  }
+
+  bool __ares_task_group_try_await(void* group){
+    auto g = reinterpret_cast<TaskGroup*>(group);
+    return g->tryAwait();
+  }
+
+  void __ares_delete_task_group(void* group){
+    auto g = reinterpret_cast<TaskGroup*>(group);
+    delete g;
   }
 
   void __ares_task_await_future(void* argsPtr){
@@ -204,11 +467,26 @@ extern "C"{
 
   void __ares_task_release_future(void* argsPtr){
     auto args = reinterpret_cast<TaskArg*>(argsPtr);
+
+    // nothing reads the args of a grouped task after it has run
+    if(args->group){
+      TaskGroup* g = args->group;
+      free(args);
+      g->release();
+      return;
+    }
+
     args->futureSync->release();
   }
 
+  void __ares_task_free_future(void* argsPtr){
+    auto args = reinterpret_cast<TaskArg*>(argsPtr);
+    delete args->futureSync;
+    free(args);
+  }
+
   void __ares_thread_yield(){
-#ifdef USE_ARGO_BOTS
+#ifdef USE_ARGOBOTS
     _threadPool->yield();
 #else
     assert(false && "unable to yield");
@@ -230,6 +508,56 @@ extern "C"{
     np(x);
   }
 
+  // lowered HLIRSend, HLIRReceive, HLIRFuture, HLIRBarrier and HLIRTeam
+
+  void* __ares_isend(int32_t rank, void* buf, uint64_t size){
+    return ares_isend(rank, (const char*)buf, size);
+  }
+
+  void* __ares_irecv(int32_t rank, void* buf, uint64_t size){
+    return ares_irecv(rank, (char*)buf, size);
+  }
+
+  uint64_t __ares_wait(void* request){
+    return ares_wait(reinterpret_cast<ares_request>(request));
+  }
+
+  void __ares_comm_barrier(){
+    ares_barrier();
+  }
+
+  // a DistributedForall may run without a communicator, as rank 0 of 0
+  int32_t __ares_comm_rank(){
+    Communicator* c = communicator();
+    return c ? c->rank() : 0;
+  }
+
+  int32_t __ares_comm_size(){
+    Communicator* c = communicator();
+    return c ? c->groupSize() : 0;
+  }
+
+  // an even split of [start, end), the first (end - start) % size ranks
+  // take one extra index. without a communicator size is 0 and the one
+  // rank owns the whole range
+  void __ares_comm_block(uint32_t start, uint32_t end,
+                         int32_t rank, int32_t size,
+                         uint32_t* first, uint32_t* last){
+    if(size <= 0){
+      *first = start;
+      *last = end;
+      return;
+    }
+
+    uint32_t n = end > start ? end - start : 0;
+    uint32_t chunk = n / size;
+    uint32_t extra = n % size;
+    uint32_t r = rank;
+
+    *first = start + r * chunk + std::min(r, extra);
+    *last = *first + chunk + (r < extra ? 1 : 0);
+  }
+
 } // extern "C"
 
 namespace ares{
@@ -237,51 +565,224 @@ namespace ares{
   bool ares_listen(int port){
     assert(!_communicator);
     auto c = new SocketCommunicator;
-    _communicator = c;
+    setCommunicator(c);
     return c->listen(port);
   }
 
   bool ares_listen(const std::string& sendPath, const std::string& receivePath){
     assert(!_communicator);
     auto c = new FIFOCommunicator;
-    _communicator = c;
+    setCommunicator(c);
     return c->listen(sendPath, receivePath);
   }
 
   bool ares_connect(const char* host, int port){
     assert(!_communicator);
     auto c = new SocketCommunicator;
-    _communicator = c;
+    setCommunicator(c);
     return c->connect(host, port);  
   }
 
   bool ares_connect(const std::string& sendPath, const std::string& receivePath){
     assert(!_communicator);
     auto c = new FIFOCommunicator;
-    _communicator = c;
+    setCommunicator(c);
     return c->connect(sendPath, receivePath);  
   }
 
+  bool ares_listen(const std::string& path){
+    assert(!_communicator);
+    auto c = new SharedMemoryCommunicator;
+    setCommunicator(c);
+    return c->listen(path);
+  }
+
+  bool ares_connect(const std::string& path){
+    assert(!_communicator);
+    auto c = new SharedMemoryCommunicator;
+    setCommunicator(c);
+    return c->connect(path);
+  }
+
+  void ares_run_loopback(size_t groupSize, std::function<void()> main){
+    auto group = LoopbackCommunicator::createGroup(groupSize);
+
+    std::vector<std::thread> threads;
+
+    for(LoopbackCommunicator* c : group){
+      threads.emplace_back([=]{
+        _localCommunicator = c;
+        main();
+      });
+    }
+
+    for(std::thread& t : threads){
+      t.join();
+    }
+
+    for(LoopbackCommunicator* c : group){
+      delete c;
+    }
+  }
+
   void ares_send(char* buf, size_t size){
     auto msg = new MessageBuffer(MessageType::Raw, buf, size, true);
-    _communicator->send(msg);
+    communicator()->send(msg);
   }
 
-  char* ares_receive(size_t& size){
-    MessageBuffer* msg = _communicator->receive();
+  void ares_send(int rank, char* buf, size_t size){
+    auto msg = new MessageBuffer(MessageType::Raw, buf, size, true);
+    communicator()->send(rank, msg);
+  }
+
+  char* ares_receive(int rank, size_t& size){
+    MessageBuffer* msg = communicator()->receive(rank);
     size = msg->size();
-    char* buf = msg->buffer();
+    char* buf = msg->detach();
+    MessageBuffer::recycle(msg);
     return buf;
   }
 
+  char* ares_receive(size_t& size){
+    return ares_receive(-1, size);
+  }
+
+  size_t ares_receive(char* buf, size_t size){
+    return communicator()->receive(buf, size);
+  }
+
+  size_t ares_receive(int rank, char* buf, size_t size){
+    return communicator()->receive(rank, buf, size);
+  }
+
+  ares_request ares_isend(int rank, const char* buf, size_t size){
+    assert(communicator());
+    auto request = new Request;
+    communicator()->isend(rank, buf, size, request);
+    return request;
+  }
+
+  ares_request ares_irecv(int rank, char* buf, size_t size){
+    assert(communicator());
+    auto request = new Request;
+    communicator()->irecv(rank, buf, size, request);
+    return request;
+  }
+
+  bool ares_test(ares_request request, size_t* size){
+    if(!request->done()){
+      return false;
+    }
+
+    // returns at once, but only after complete() lets go of the request
+    request->wait();
+
+    if(size){
+      *size = request->size();
+    }
+
+    delete request;
+    return true;
+  }
+
+  size_t ares_wait(ares_request request){
+#ifdef USE_ARGOBOTS
+    // blocking would stall every ULT on this execution stream
+    while(!request->done()){
+      ArgoPool::AP_yield();
+    }
+#endif
+
+    request->wait();
+
+    size_t size = request->size();
+    delete request;
+    return size;
+  }
+
+  void ares_waitall(ares_request* requests, size_t count){
+    for(size_t i = 0; i < count; ++i){
+      ares_wait(requests[i]);
+    }
+  }
+
+  void ares_then(ares_request request, std::function<void(size_t)> f){
+    Communicator* c = communicator();
+
+    request->then([=]{
+      size_t size = request->size();
+      delete request;
+
+      auto task = withCommunicator(c, [=]{ f(size); });
+      _threadPool->push(runTask, task, 0);
+    });
+  }
+
+  ares_handler ares_register_handler(ares_handler_function f){
+    Communicator* c = communicator();
+    assert(c);
+
+    return c->addHandler([=](MessageBuffer* msg){
+      auto task = withCommunicator(c, [=]{
+        f(msg->source(), msg->buffer(), msg->size());
+        MessageBuffer::recycle(msg);
+      });
+      _threadPool->push(runTask, task, 0);
+    });
+  }
+
+  void ares_remote_spawn(int rank, ares_handler handler,
+                         const char* payload, size_t size){
+    assert(communicator());
+    communicator()->spawn(rank, handler, payload, size);
+  }
+
+  int ares_rank(){
+    assert(communicator());
+    return communicator()->rank();
+  }
+
   void ares_init_comm(size_t groupSize){
-    assert(_communicator);
-    _communicator->init(groupSize);
+    assert(communicator());
+    communicator()->init(groupSize);
+  }
+
+  void ares_aggregate(size_t maxSize, size_t flushSize, uint32_t micros){
+    assert(communicator());
+    communicator()->setAggregation(maxSize, flushSize, micros);
   }
 
   void ares_barrier(){
-    assert(_communicator);
-    _communicator->barrier();
+    assert(communicator());
+    communicator()->barrier();
+  }
+
+  void ares_bcast(void* buf, size_t size, int root){
+    assert(communicator());
+    communicator()->bcast(buf, size, root);
+  }
+
+  void ares_reduce(const void* in, void* out, size_t count,
+                   DataType type, ReduceOp op, int root){
+    assert(communicator());
+    withReduction(type, op, [&](auto t, auto f){
+      using T = decltype(t);
+      communicator()->reduce((const T*)in, (T*)out, count, f, root);
+    });
+  }
+
+  void ares_allreduce(const void* in, void* out, size_t count,
+                      DataType type, ReduceOp op){
+    assert(communicator());
+    withReduction(type, op, [&](auto t, auto f){
+      using T = decltype(t);
+      communicator()->allreduce((const T*)in, (T*)out, count, f);
+    });
+  }
+
+  void ares_gather(const void* in, size_t size, void* out, int root){
+    assert(communicator());
+    communicator()->gather(in, size, out, root);
   }
 
 } // namespace ares
@@ -14,7 +14,7 @@
  */
 
 
-#include "ArgoPool.h"
+#include "ArgoPool.hpp"
 #include <stdio.h>
 #include <unistd.h>
 
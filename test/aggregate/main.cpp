@@ -0,0 +1,70 @@
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+
+#include <cassert>
+
+#include <ares/runtime.h>
+
+using namespace std;
+using namespace ares;
+
+int main(int argc, char** argv){
+  assert(argc == 2);
+
+  string type = argv[1];
+
+  if(type == "listen"){
+    ares_listen("aggregate.sock");
+  }
+  else if(type == "connect"){
+    ares_connect("aggregate.sock");
+  }
+  else{
+    assert(false);
+  }
+
+  ares_init_comm(2);
+  ares_aggregate();
+
+  int rank = ares_rank();
+  int other = 1 - rank;
+
+  // many small updates, packed into a few frames
+  size_t n = 10000;
+
+  for(size_t i = 0; i < n; ++i){
+    int* x = (int*)malloc(sizeof(int));
+    *x = i;
+    ares_send(other, (char*)x, sizeof(int));
+  }
+
+  // too large to pack, must still arrive after the small ones
+  size_t m = 100000;
+  vector<double> large(m, rank);
+  ares_wait(ares_isend(other, (const char*)large.data(),
+                       m * sizeof(double)));
+
+  for(size_t i = 0; i < n; ++i){
+    int x;
+    size_t size = ares_receive(other, (char*)&x, sizeof(x));
+    assert(size == sizeof(int) && x == int(i));
+  }
+
+  vector<double> ghost(m);
+  ares_receive(other, (char*)ghost.data(), m * sizeof(double));
+  assert(ghost[0] == other && ghost[m - 1] == other);
+
+  // a lone small send goes out on the flush deadline
+  int value = rank;
+  ares_request request = ares_irecv(other, (char*)&value, sizeof(value));
+  ares_wait(ares_isend(other, (const char*)&rank, sizeof(rank)));
+  ares_wait(request);
+  assert(value == other);
+
+  ares_barrier();
+
+  cout << "rank " << rank << " done" << endl;
+
+  return 0;
+}
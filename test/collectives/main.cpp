@@ -0,0 +1,72 @@
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+
+#include <cassert>
+
+#include <ares/runtime.h>
+
+using namespace std;
+using namespace ares;
+
+int main(int argc, char** argv){
+  assert(argc == 2);
+
+  string type = argv[1];
+
+  // both ranks on this node, through shared memory
+  if(type == "listen"){
+    ares_listen("collectives.sock");
+  }
+  else if(type == "connect"){
+    ares_connect("collectives.sock");
+  }
+  else{
+    assert(false);
+  }
+
+  ares_init_comm(2);
+
+  int rank = ares_rank();
+
+  // a timestep loop agreeing on the smallest dt
+  for(int step = 0; step < 10; ++step){
+    double dt = 0.1 * (rank + 1) / (step + 1);
+    dt = ares_allreduce(dt, ReduceOp::Min);
+    assert(dt == 0.1 / (step + 1));
+  }
+
+  vector<int> b(16, rank == 1 ? 7 : 0);
+  ares_bcast(b.data(), b.size(), 1);
+  for(int x : b){
+    assert(x == 7);
+  }
+
+  int64_t sum = 0;
+  int64_t x = rank + 1;
+  ares_reduce(&x, &sum, 1, ReduceOp::Sum, 0);
+  if(rank == 0){
+    assert(sum == 3);
+  }
+
+  // large enough for the ring allreduce
+  vector<float> in(100000, rank + 1.0f);
+  vector<float> out(in.size());
+  ares_allreduce(in.data(), out.data(), in.size(), ReduceOp::Sum);
+  for(float y : out){
+    assert(y == 3.0f);
+  }
+
+  int mine[2] = {rank, rank * 10};
+  int all[4];
+  ares_gather(mine, 2, all, 0);
+  if(rank == 0){
+    assert(all[0] == 0 && all[1] == 0 && all[2] == 1 && all[3] == 10);
+  }
+
+  ares_barrier();
+
+  cout << "rank " << rank << " done" << endl;
+
+  return 0;
+}
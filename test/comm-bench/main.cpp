@@ -0,0 +1,255 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include <cassert>
+#include <unistd.h>
+
+#include <ares/runtime.h>
+
+using namespace std;
+using namespace ares;
+
+// usage:
+//   comm-bench socket|fifo|shm listen|connect [group size] [aggregate]
+//   comm-bench loopback [group size] [aggregate]
+//
+// one process listens and the others connect, fifo pairs two ranks.
+// rank 0 writes CSV lines of
+//   transport,test,ranks,size,iterations,value,unit
+// the point to point tests run between ranks 0 and 1
+
+const size_t MAX_SIZE = 64 << 20;
+
+// bytes streamed per bandwidth size, with at least MIN_ITERATIONS
+const size_t STREAM_BYTES = 256 << 20;
+const size_t MIN_ITERATIONS = 4;
+
+// sends in flight for the bandwidth and message rate tests
+const size_t WINDOW = 64;
+
+string transport;
+size_t groupSize = 2;
+
+double now(){
+  return chrono::duration<double>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void report(const char* test, size_t size, size_t iterations,
+            double value, const char* unit){
+  if(ares_rank() == 0){
+    printf("%s,%s,%zu,%zu,%zu,%.3f,%s\n", transport.c_str(), test,
+           groupSize, size, iterations, value, unit);
+    fflush(stdout);
+  }
+}
+
+// half the round trip time
+void pingPong(char* buf){
+  int rank = ares_rank();
+
+  for(size_t size = 8; size <= (1 << 20); size *= 8){
+    size_t iterations = size < 65536 ? 10000 : 1000;
+
+    ares_barrier();
+
+    double start = 0;
+
+    // the first round trips warm up the path
+    for(size_t i = 0; i < iterations + 100; ++i){
+      if(i == 100){
+        start = now();
+      }
+
+      if(rank == 0){
+        ares_wait(ares_isend(1, buf, size));
+        ares_receive(1, buf, size);
+      }
+      else if(rank == 1){
+        ares_receive(0, buf, size);
+        ares_wait(ares_isend(0, buf, size));
+      }
+    }
+
+    double t = now() - start;
+    report("pingpong", size, iterations, t / iterations / 2 * 1e6, "us");
+  }
+}
+
+// rank 1 streams count messages of size bytes to rank 0 with up to
+// WINDOW in flight, returns the seconds rank 0 took to receive them
+double stream(char* buf, size_t size, size_t count){
+  int rank = ares_rank();
+
+  vector<ares_request> requests;
+
+  ares_barrier();
+
+  double start = now();
+
+  if(rank == 1){
+    for(size_t i = 0; i < count; ++i){
+      if(requests.size() == WINDOW){
+        ares_waitall(requests.data(), requests.size());
+        requests.clear();
+      }
+      requests.push_back(ares_isend(0, buf, size));
+    }
+  }
+  else if(rank == 0){
+    for(size_t i = 0; i < count; ++i){
+      if(requests.size() == WINDOW){
+        ares_waitall(requests.data(), requests.size());
+        requests.clear();
+      }
+      requests.push_back(ares_irecv(1, buf, size));
+    }
+  }
+
+  ares_waitall(requests.data(), requests.size());
+
+  double t = now() - start;
+
+  ares_barrier();
+
+  return t;
+}
+
+void bandwidth(char* buf){
+  // quarter steps, and a last step to MAX_SIZE
+  for(size_t size = 8; size <= MAX_SIZE;
+      size *= size < MAX_SIZE / 4 ? 4 : 2){
+    size_t count = max(MIN_ITERATIONS, min<size_t>(STREAM_BYTES / size,
+                                                   100000));
+
+    double t = stream(buf, size, count);
+    report("bandwidth", size, count, size * count / t / 1e6, "MB/s");
+  }
+}
+
+void messageRate(char* buf){
+  for(size_t size : {8, 64, 256, 1024}){
+    size_t count = 200000;
+
+    double t = stream(buf, size, count);
+    report("rate", size, count, count / t / 1e6, "Mmsg/s");
+  }
+}
+
+void barrierLatency(){
+  size_t iterations = 1000;
+
+  for(size_t i = 0; i < 10; ++i){
+    ares_barrier();
+  }
+
+  double start = now();
+
+  for(size_t i = 0; i < iterations; ++i){
+    ares_barrier();
+  }
+
+  double t = now() - start;
+  report("barrier", 0, iterations, t / iterations * 1e6, "us");
+}
+
+void run(bool aggregate){
+  ares_init_comm(groupSize);
+
+  if(aggregate){
+    ares_aggregate();
+  }
+
+  vector<char> buf(MAX_SIZE, 1);
+
+  if(groupSize > 1){
+    pingPong(buf.data());
+    bandwidth(buf.data());
+    messageRate(buf.data());
+  }
+
+  barrierLatency();
+
+  ares_barrier();
+}
+
+int main(int argc, char** argv){
+  assert(argc >= 2);
+
+  transport = argv[1];
+
+  if(transport == "loopback"){
+    if(argc > 2){
+      groupSize = atoi(argv[2]);
+    }
+
+    bool aggregate = argc > 3;
+
+    if(aggregate){
+      transport += "-aggregate";
+    }
+
+    printf("transport,test,ranks,size,iterations,value,unit\n");
+
+    ares_run_loopback(groupSize, [=]{ run(aggregate); });
+    return 0;
+  }
+
+  assert(argc >= 3);
+
+  string type = argv[2];
+  bool listen = type == "listen";
+  assert(listen || type == "connect");
+
+  if(argc > 3){
+    groupSize = atoi(argv[3]);
+  }
+
+  bool aggregate = argc > 4;
+
+  if(transport == "socket"){
+    if(listen){
+      ares_listen(14700);
+    }
+    else{
+      ares_connect("localhost", 14700);
+    }
+  }
+  else if(transport == "fifo"){
+    assert(groupSize == 2);
+
+    if(listen){
+      ares_listen("comm-bench.f1", "comm-bench.f2");
+    }
+    else{
+      ares_connect("comm-bench.f2", "comm-bench.f1");
+    }
+  }
+  else if(transport == "shm"){
+    if(listen){
+      ares_listen(string("comm-bench.sock"));
+    }
+    else{
+      ares_connect(string("comm-bench.sock"));
+    }
+  }
+  else{
+    assert(false);
+  }
+
+  if(aggregate){
+    transport += "-aggregate";
+  }
+
+  if(listen){
+    printf("transport,test,ranks,size,iterations,value,unit\n");
+  }
+
+  run(aggregate);
+
+  return 0;
+}
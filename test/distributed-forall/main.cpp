@@ -0,0 +1,74 @@
+#include <iostream>
+#include <algorithm>
+
+#include <cassert>
+
+#include <ares/frontend.h>
+#include <ares/runtime.h>
+
+using namespace std;
+using namespace ares;
+
+const size_t SIZE = 101;
+
+// rank 0 takes the last block
+void reversed(uint32_t start, uint32_t end, int rank, int size,
+              uint32_t& first, uint32_t& last){
+  uint32_t chunk = (end - start + size - 1) / size;
+  first = min(end, start + (size - 1 - rank) * chunk);
+  last = min(end, first + chunk);
+}
+
+int main(int argc, char** argv){
+  assert(argc == 2);
+
+  string type = argv[1];
+
+  if(type == "listen"){
+    ares_listen("distributed-forall.sock");
+  }
+  else if(type == "connect"){
+    ares_connect("distributed-forall.sock");
+  }
+  else{
+    assert(false);
+  }
+
+  ares_init_comm(2);
+
+  int rank = ares_rank();
+
+  float A[SIZE];
+  float B[SIZE];
+
+  for(size_t i = 0; i < SIZE; ++i){
+    A[i] = 0;
+    B[i] = 0;
+  }
+
+  // rank 0 runs [0, 51) and rank 1 runs [51, 101)
+  for(auto i : DistributedForall(0, SIZE)){
+    A[i] = i;
+  }
+
+  for(auto i : DistributedForall(0, SIZE, reversed)){
+    B[i] = 1;
+  }
+
+  float sum = 0;
+  float count = 0;
+  for(size_t i = 0; i < SIZE; ++i){
+    sum += A[i];
+    count += B[i];
+  }
+
+  assert(ares_allreduce(sum, ReduceOp::Sum) == SIZE * (SIZE - 1) / 2);
+  assert(ares_allreduce(count, ReduceOp::Sum) == SIZE);
+  assert(count == (rank == 0 ? 50 : 51));
+
+  ares_barrier();
+
+  cout << "rank " << rank << " done" << endl;
+
+  return 0;
+}
@@ -0,0 +1,72 @@
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+
+#include <cassert>
+
+#include <ares/runtime.h>
+
+using namespace std;
+using namespace ares;
+
+int main(int argc, char** argv){
+  assert(argc == 2);
+
+  string type = argv[1];
+
+  if(type == "listen"){
+    ares_listen("isend.sock");
+  }
+  else if(type == "connect"){
+    ares_connect("isend.sock");
+  }
+  else{
+    assert(false);
+  }
+
+  ares_init_comm(2);
+
+  int rank = ares_rank();
+  int other = 1 - rank;
+
+  // exchange halos while computing on the interior
+  size_t n = 100000;
+  vector<double> halo(n, rank);
+  vector<double> ghost(n);
+
+  for(int step = 0; step < 10; ++step){
+    ares_request requests[2];
+    requests[0] = ares_irecv(other, (char*)ghost.data(), n * sizeof(double));
+    requests[1] = ares_isend(other, (const char*)halo.data(),
+                             n * sizeof(double));
+
+    double sum = 0;
+    for(size_t i = 0; i < n; ++i){
+      sum += i * 0.5;
+    }
+
+    ares_waitall(requests, 2);
+
+    assert(ghost[0] == other + step && ghost[n - 1] == other + step);
+    assert(sum > 0);
+
+    // the send has completed so the buffer may change
+    for(double& x : halo){
+      x += 1;
+    }
+  }
+
+  int value = rank;
+  ares_request request = ares_irecv(other, (char*)&value, sizeof(value));
+  ares_wait(ares_isend(other, (const char*)&rank, sizeof(rank)));
+
+  size_t size;
+  while(!ares_test(request, &size)){}
+  assert(size == sizeof(int) && value == other);
+
+  ares_barrier();
+
+  cout << "rank " << rank << " done" << endl;
+
+  return 0;
+}
@@ -0,0 +1,70 @@
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+#include <atomic>
+
+#include <cassert>
+#include <unistd.h>
+
+#include <ares/runtime.h>
+
+using namespace std;
+using namespace ares;
+
+const size_t GROUP_SIZE = 4;
+
+atomic<int> spawned(0);
+
+void run(){
+  ares_init_comm(GROUP_SIZE);
+
+  int rank = ares_rank();
+  int n = GROUP_SIZE;
+  int right = (rank + 1) % n;
+  int left = (rank + n - 1) % n;
+
+  // pass a token around the ring
+  for(int round = 0; round < 100; ++round){
+    int* token = (int*)malloc(sizeof(int));
+    *token = rank + round;
+    ares_send(right, (char*)token, sizeof(int));
+
+    int x;
+    ares_receive(left, (char*)&x, sizeof(x));
+    assert(x == left + round);
+  }
+
+  vector<double> halo(1000, rank);
+  vector<double> ghost(1000);
+  ares_request requests[2];
+  requests[0] = ares_irecv(left, (char*)ghost.data(),
+                           ghost.size() * sizeof(double));
+  requests[1] = ares_isend(right, (const char*)halo.data(),
+                           halo.size() * sizeof(double));
+  ares_waitall(requests, 2);
+  assert(ghost[0] == left && ghost[999] == left);
+
+  int sum = ares_allreduce(rank, ReduceOp::Sum);
+  assert(sum == n * (n - 1) / 2);
+
+  ares_handler count = ares_register_handler(
+    [](int source, const char* payload, size_t size){
+      ++spawned;
+    });
+
+  ares_remote_spawn(right, count, nullptr, 0);
+
+  ares_barrier();
+}
+
+int main(int argc, char** argv){
+  ares_run_loopback(GROUP_SIZE, run);
+
+  while(spawned < int(GROUP_SIZE)){
+    usleep(1000);
+  }
+
+  cout << "done" << endl;
+
+  return 0;
+}
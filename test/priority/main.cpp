@@ -0,0 +1,30 @@
+#include <iostream>
+
+#include <ares/frontend.h>
+
+using namespace std;
+using namespace ares;
+
+const size_t SIZE = 100;
+
+task(priority=10) int pack(int i){
+  return i * 2;
+}
+
+int main(int argc, char** argv){
+  float A[SIZE];
+
+  for(auto i : Forall(0, SIZE, 5)){
+    A[i] = i;
+  }
+
+  int p = pack(21);
+
+  cout << "p = " << p << endl;
+
+  for(size_t i = 0; i < SIZE; ++i){
+    cout << "A[" << i << "] = " << A[i] << endl;
+  }
+
+  return 0;
+}
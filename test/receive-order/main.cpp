@@ -0,0 +1,55 @@
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+
+#include <ares/runtime.h>
+
+using namespace std;
+using namespace ares;
+
+const size_t SIZE = 1000;
+
+extern "C" void receive_two(double* a, double* b, int64_t n);
+
+bool ok = true;
+
+void run(){
+  ares_init_comm(2);
+
+  if(ares_rank() == 0){
+    for(int i = 1; i <= 2; ++i){
+      double* buf = (double*)malloc(SIZE * sizeof(double));
+      for(size_t j = 0; j < SIZE; ++j){
+        buf[j] = i;
+      }
+      ares_send(1, (char*)buf, SIZE * sizeof(double));
+    }
+  }
+  else{
+    vector<double> a(SIZE);
+    vector<double> b(SIZE);
+    receive_two(a.data(), b.data(), SIZE);
+
+    for(size_t j = 0; j < SIZE; ++j){
+      if(a[j] != 1 || b[j] != 2){
+        ok = false;
+        break;
+      }
+    }
+  }
+
+  ares_barrier();
+}
+
+int main(int argc, char** argv){
+  ares_run_loopback(2, run);
+
+  if(!ok){
+    cout << "messages were received out of order" << endl;
+    return 1;
+  }
+
+  cout << "done" << endl;
+
+  return 0;
+}
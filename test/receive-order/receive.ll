@@ -0,0 +1,34 @@
+; two back-to-back receives from rank 0 into a and b, in the deferred
+; form written by clang -mllvm -hlir-defer-lowering. lowered by hlir-opt,
+; the receive into a must be posted first so it matches the first message
+
+define void @receive_two(double* %a, double* %b, i64 %n) {
+entry:
+  %bytes = mul i64 %n, 8, !hlir.ref !15
+  call void @hlir.receive(), !hlir.ref !16
+  call void @hlir.receive(), !hlir.ref !17
+  ret void
+}
+
+declare void @hlir.receive()
+
+!hlir = !{!0, !2, !14, !14}
+
+!0 = !{!"module", !"name", !1}
+!1 = !{!"string", !"receive-order"}
+!2 = !{!3, !10}
+!3 = distinct !{!"construct", !"receive", !"buffer", !4, !"marker", !7, !"rank", !8, !"team", !9}
+!4 = distinct !{!"construct", !"buffer", !"data", !5, !"size", !6}
+!5 = !{!"value", !"arg", void (double*, double*, i64)* @receive_two, i64 0}
+!6 = !{!"value", !"inst", i64 0}
+!7 = !{!"instruction", !"inst", i64 1}
+!8 = !{!"value", !"constant", i32 0}
+!9 = distinct !{!"construct", !"team"}
+!10 = distinct !{!"construct", !"receive", !"buffer", !11, !"marker", !13, !"rank", !8, !"team", !9}
+!11 = distinct !{!"construct", !"buffer", !"data", !12, !"size", !6}
+!12 = !{!"value", !"arg", void (double*, double*, i64)* @receive_two, i64 1}
+!13 = !{!"instruction", !"inst", i64 2}
+!14 = !{}
+!15 = !{i64 0}
+!16 = !{i64 1}
+!17 = !{i64 2}
@@ -0,0 +1,66 @@
+#include <iostream>
+#include <cstdlib>
+#include <atomic>
+
+#include <cassert>
+#include <unistd.h>
+
+#include <ares/runtime.h>
+
+using namespace std;
+using namespace ares;
+
+atomic<int> total(0);
+atomic<int> replies(0);
+
+int main(int argc, char** argv){
+  assert(argc == 2);
+
+  string type = argv[1];
+
+  if(type == "listen"){
+    ares_listen("remote-spawn.sock");
+  }
+  else if(type == "connect"){
+    ares_connect("remote-spawn.sock");
+  }
+  else{
+    assert(false);
+  }
+
+  ares_init_comm(2);
+
+  int rank = ares_rank();
+  int other = 1 - rank;
+
+  ares_handler reply = ares_register_handler(
+    [](int source, const char* payload, size_t size){
+      ++replies;
+    });
+
+  // add the payload to the total and tell the sender it is done
+  ares_handler add = ares_register_handler(
+    [=](int source, const char* payload, size_t size){
+      assert(size == sizeof(int));
+      total += *(const int*)payload;
+      ares_remote_spawn(source, reply, nullptr, 0);
+    });
+
+  int n = 100;
+  for(int i = 0; i < n; ++i){
+    ares_remote_spawn(other, add, (const char*)&i, sizeof(i));
+  }
+
+  // no receive calls, the handlers run as the messages arrive
+  while(replies < n){
+    usleep(1000);
+  }
+
+  ares_barrier();
+
+  assert(total == n * (n - 1) / 2);
+
+  cout << "rank " << rank << " done" << endl;
+
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include <iostream>
+
+using namespace std;
+
+const size_t SIZE = 64;
+
+struct State{
+  double values[SIZE];
+  int steps;
+};
+
+task State init(double x){
+  State s;
+  for(size_t i = 0; i < SIZE; ++i){
+    s.values[i] = x * i;
+  }
+  s.steps = 0;
+  return s;
+}
+
+task void advance(State& s, double dt){
+  for(size_t i = 0; i < SIZE; ++i){
+    s.values[i] += dt;
+  }
+  ++s.steps;
+}
+
+// s is the task's own copy, the caller's state is left as it was
+task double total(State s){
+  double t = 0;
+  for(size_t i = 0; i < SIZE; ++i){
+    t += s.values[i];
+    s.values[i] = 0;
+  }
+  return t;
+}
+
+int main(int argc, char** argv){
+  State s1 = init(1.0);
+  State s2 = init(2.0);
+
+  advance(s1, 0.5);
+  advance(s2, 0.25);
+
+  cout << "s1.values[1] = " << s1.values[1] << endl;
+  cout << "s2.values[1] = " << s2.values[1] << endl;
+  cout << "steps = " << s1.steps + s2.steps << endl;
+
+  // advance must not start before init has written s1
+  if(s1.values[1] != 1.5 || s2.values[1] != 2.25 ||
+     s1.steps + s2.steps != 2){
+    cout << "advance ran before init" << endl;
+    return 1;
+  }
+
+  // each advance must see the previous one's result
+  State s4 = init(0.0);
+  for(int i = 0; i < 4; ++i){
+    advance(s4, 1.0);
+  }
+
+  cout << "s4.values[1] = " << s4.values[1] << endl;
+
+  if(s4.values[1] != 4.0 || s4.steps != 4){
+    cout << "advance steps overlapped" << endl;
+    return 1;
+  }
+
+  State s3;
+  for(size_t i = 0; i < SIZE; ++i){
+    s3.values[i] = i;
+  }
+  s3.steps = 0;
+
+  double t = total(s3);
+
+  cout << "total = " << t << endl;
+  cout << "s3.values[1] = " << s3.values[1] << endl;
+
+  if(t != 2016 || s3.values[1] != 1){
+    cout << "total changed the caller's state" << endl;
+    return 1;
+  }
+
+  return 0;
+}